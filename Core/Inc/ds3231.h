@@ -42,6 +42,8 @@
 #define DS3231_REG_SECOND 	0x00
 #define DS3231_REG_MINUTE 	0x01
 #define DS3231_REG_HOUR  	0x02
+#define DS3231_12_24		6
+#define DS3231_AM_PM		5
 #define DS3231_REG_DOW    	0x03
 
 #define DS3231_REG_DATE   	0x04
@@ -77,13 +79,175 @@
 #define DS3231_BSY			2
 #define DS3231_A2F			1
 #define DS3231_A1F			0
+/* Flags that can only be written to 0, writing 1 leaves them unchanged */
+#define DS3231_STATUS_FLAGS	((1 << DS3231_OSF) | (1 << DS3231_A2F) | (1 << DS3231_A1F))
 
 #define DS3231_AGING		0x10
 
 #define DS3231_TEMP_MSB		0x11
 #define DS3231_TEMP_LSB		0x12
 
-#define DS3231_TIMEOUT		HAL_MAX_DELAY
+#define DS3231_TIME_REG_COUNT	7
+#define DS3231_REG_COUNT		0x13
+
+/*
+ * Register fields as (register, bit position, width), used through the DS3231_FIELD_xxx()
+ * macros below, e.g. DS3231_FIELD_SET(DS3231_F_RS, DS3231_1HZ). Every field argument is a
+ * constant, so the macros fold to the plain mask and shift at compile time.
+ */
+#define DS3231_F_SECOND			DS3231_REG_SECOND, 0, 7
+#define DS3231_F_MINUTE			DS3231_REG_MINUTE, 0, 7
+#define DS3231_F_HOUR_24		DS3231_REG_HOUR, 0, 6
+#define DS3231_F_HOUR_12		DS3231_REG_HOUR, 0, 5
+#define DS3231_F_AM_PM			DS3231_REG_HOUR, DS3231_AM_PM, 1
+#define DS3231_F_12_24			DS3231_REG_HOUR, DS3231_12_24, 1
+#define DS3231_F_DOW			DS3231_REG_DOW, 0, 3
+#define DS3231_F_DATE			DS3231_REG_DATE, 0, 6
+#define DS3231_F_MONTH			DS3231_REG_MONTH, 0, 5
+#define DS3231_F_CENTURY		DS3231_REG_MONTH, DS3231_CENTURY, 1
+#define DS3231_F_YEAR			DS3231_REG_YEAR, 0, 8
+
+#define DS3231_F_A1_SECOND		DS3231_A1_SECOND, 0, 7
+#define DS3231_F_A1M1			DS3231_A1_SECOND, DS3231_AXMY, 1
+#define DS3231_F_A1_MINUTE		DS3231_A1_MINUTE, 0, 7
+#define DS3231_F_A1M2			DS3231_A1_MINUTE, DS3231_AXMY, 1
+#define DS3231_F_A1_HOUR		DS3231_A1_HOUR, 0, 6
+#define DS3231_F_A1_12_24		DS3231_A1_HOUR, DS3231_12_24, 1
+#define DS3231_F_A1M3			DS3231_A1_HOUR, DS3231_AXMY, 1
+#define DS3231_F_A1_DAY_DATE	DS3231_A1_DATE, 0, 6
+#define DS3231_F_A1_DYDT		DS3231_A1_DATE, DS3231_DYDT, 1
+#define DS3231_F_A1M4			DS3231_A1_DATE, DS3231_AXMY, 1
+
+#define DS3231_F_A2_MINUTE		DS3231_A2_MINUTE, 0, 7
+#define DS3231_F_A2M2			DS3231_A2_MINUTE, DS3231_AXMY, 1
+#define DS3231_F_A2_HOUR		DS3231_A2_HOUR, 0, 6
+#define DS3231_F_A2_12_24		DS3231_A2_HOUR, DS3231_12_24, 1
+#define DS3231_F_A2M3			DS3231_A2_HOUR, DS3231_AXMY, 1
+#define DS3231_F_A2_DAY_DATE	DS3231_A2_DATE, 0, 6
+#define DS3231_F_A2_DYDT		DS3231_A2_DATE, DS3231_DYDT, 1
+#define DS3231_F_A2M4			DS3231_A2_DATE, DS3231_AXMY, 1
+
+#define DS3231_F_EOSC			DS3231_REG_CONTROL, DS3231_EOSC, 1
+#define DS3231_F_BBSQW			DS3231_REG_CONTROL, DS3231_BBSQW, 1
+#define DS3231_F_CONV			DS3231_REG_CONTROL, DS3231_CONV, 1
+#define DS3231_F_RS				DS3231_REG_CONTROL, DS3231_RS1, 2
+#define DS3231_F_INTCN			DS3231_REG_CONTROL, DS3231_INTCN, 1
+#define DS3231_F_A2IE			DS3231_REG_CONTROL, DS3231_A2IE, 1
+#define DS3231_F_A1IE			DS3231_REG_CONTROL, DS3231_A1IE, 1
+
+#define DS3231_F_OSF			DS3231_REG_STATUS, DS3231_OSF, 1
+#define DS3231_F_EN32KHZ		DS3231_REG_STATUS, DS3231_EN32KHZ, 1
+#define DS3231_F_BSY			DS3231_REG_STATUS, DS3231_BSY, 1
+#define DS3231_F_A2F			DS3231_REG_STATUS, DS3231_A2F, 1
+#define DS3231_F_A1F			DS3231_REG_STATUS, DS3231_A1F, 1
+
+#define DS3231_F_AGING			DS3231_AGING, 0, 8
+
+/* Register address and in-place mask of a field */
+#define DS3231_FIELD_REG(field)				DS3231_FIELD_REG_(field)
+#define DS3231_FIELD_MASK(field)			DS3231_FIELD_MASK_(field)
+/* Field value shifted into place, extra high bits of value are dropped */
+#define DS3231_FIELD_SET(field, value)		DS3231_FIELD_SET_(field, value)
+/* Field value taken out of a register value */
+#define DS3231_FIELD_GET(field, reg_value)	DS3231_FIELD_GET_(field, reg_value)
+/* Register value with one field replaced */
+#define DS3231_FIELD_PUT(field, reg_value, value)	DS3231_FIELD_PUT_(field, reg_value, value)
+
+/* Read-modify-write of one field, or of two fields of the same register folded into one
+ * update; fields of different registers do not compile (negative array size) */
+#define DS3231_UPDATE_FIELD(dev, field, value)	DS3231_UPDATE_FIELD_(dev, field, value)
+#define DS3231_UPDATE_FIELDS(dev, field1, value1, field2, value2) \
+	DS3231_UPDATE_FIELDS_(dev, field1, value1, field2, value2)
+
+/* Expansions of the macros above with the field spelled out as reg, pos, width */
+#define DS3231_FIELD_REG_(reg, pos, width)			(reg)
+#define DS3231_FIELD_MASK_(reg, pos, width)			((uint8_t)(((1u << (width)) - 1) << (pos)))
+#define DS3231_FIELD_SET_(reg, pos, width, value) \
+	((uint8_t)(((uint32_t)(value) & ((1u << (width)) - 1)) << (pos)))
+#define DS3231_FIELD_GET_(reg, pos, width, reg_value) \
+	((uint8_t)(((uint32_t)(reg_value) >> (pos)) & ((1u << (width)) - 1)))
+#define DS3231_FIELD_PUT_(reg, pos, width, reg_value, value) \
+	((uint8_t)(((reg_value) & ~DS3231_FIELD_MASK_(reg, pos, width)) | DS3231_FIELD_SET_(reg, pos, width, value)))
+#define DS3231_UPDATE_FIELD_(dev, reg, pos, width, value) \
+	ds3231_update_reg((dev), (reg), DS3231_FIELD_MASK_(reg, pos, width), DS3231_FIELD_SET_(reg, pos, width, value))
+#define DS3231_UPDATE_FIELDS_(dev, reg1, pos1, width1, value1, reg2, pos2, width2, value2) \
+	ds3231_update_reg((dev), (reg1) + 0 * sizeof(char[((reg1) == (reg2)) ? 1 : -1]), \
+	                  DS3231_FIELD_MASK_(reg1, pos1, width1) | DS3231_FIELD_MASK_(reg2, pos2, width2), \
+	                  DS3231_FIELD_SET_(reg1, pos1, width1, value1) | DS3231_FIELD_SET_(reg2, pos2, width2, value2))
+
+/* Default deadline of a blocking transfer, see ds3231_set_timeout() */
+#define DS3231_TIMEOUT_US	10000
+
+/* Devices the driver can run at once, one per I2C bus */
+#define DS3231_MAX_INSTANCES	3
+
+/* Bus pins of the on-board DS3231 on I2C3, see ds3231_bus_config. Bus recovery after a
+ * missed deadline drives nine SCL clocks and a STOP on them, then the I2C peripheral,
+ * its DMA and interrupts are initialized again */
+#define DS3231_SCL_PORT		GPIOA
+#define DS3231_SCL_PIN		GPIO_PIN_8
+#define DS3231_SDA_PORT		GPIOC
+#define DS3231_SDA_PIN		GPIO_PIN_9
+
+/* Fastest I2C profile tried by ds3231_init(), slower ones are tried when the
+ * device does not answer reliably, see ds3231_select_bus_profile() */
+#define DS3231_BUS_PROFILE	DS3231_BUS_FAST_16_9
+/* Full register file reads that must all agree for a profile to be accepted */
+#define DS3231_BUS_VERIFY_READS	16
+/* Calls per API timed by ds3231_measure_bus_profile() */
+#define DS3231_BUS_MEASURE_CALLS	16
+
+/* Keep a RAM shadow of registers 0x07 to 0x0f so configuration calls are a single write.
+ * Comment out to read-modify-write the device on every call. */
+#define DS3231_SHADOW_REGS
+/* Debug: compare the shadow with the device after every shadowed write */
+//#define DS3231_SHADOW_VERIFY
+
+/* Transport of every transfer, on every bus. Chosen at build time, the request queue calls it directly.
+ *   DS3231_BUS_HAL_IT   - HAL interrupt transfers, one interrupt per byte
+ *   DS3231_BUS_HAL_DMA  - HAL DMA transfers. I2C3_RX is DMA1 Stream 2 channel 3, I2C3_TX is DMA1 Stream 4 channel 3.
+ *   DS3231_BUS_HAL_POLL - HAL blocking transfers
+ *   DS3231_BUS_LL       - register level (LL) polled transfers, without the HAL I2C state machine
+ *   DS3231_BUS_SIM      - no bus traffic, a register file in RAM stands in for the device. Still a target
+ *                         build: the driver keeps using the HAL types, DWT and NVIC, it does not compile on a PC.
+ * The last three run every transfer to completion inside ds3231_submit(), also when it is
+ * called from an interrupt handler. Override with -DDS3231_BUS_POLICY=... on the compiler command line. */
+#define DS3231_BUS_HAL_IT	0
+#define DS3231_BUS_HAL_DMA	1
+#define DS3231_BUS_HAL_POLL	2
+#define DS3231_BUS_LL		3
+#define DS3231_BUS_SIM		4
+#ifndef DS3231_BUS_POLICY
+#define DS3231_BUS_POLICY	DS3231_BUS_HAL_DMA
+#endif
+#define DS3231_DMA_RX_IRQn	DMA1_Stream2_IRQn
+#define DS3231_DMA_TX_IRQn	DMA1_Stream4_IRQn
+/* Full register file reads per backend timed by ds3231_benchmark_backends() */
+#define DS3231_BENCH_READS	16
+
+/* Mirror snapshots older than this are not used, e.g. when the SQW edges stop */
+#define DS3231_MIRROR_MAX_AGE_MS	1500
+
+/* ds3231_set_datetime_at(): time before the aligned write to claim the bus and measure the lead */
+#define DS3231_SET_GUARD_US		2000
+
+/* ds3231_set_datetime_at(): nominal SCL clocks from the START to the ACK of the seconds byte
+ * (START, address, register pointer and seconds bytes with their ACKs), places the guard window */
+#define DS3231_SET_LEAD_CLOCKS	28
+
+/* On-demand temperature conversion: BSY poll interval and give-up time (a conversion takes up to 200 ms) */
+#define DS3231_CONV_POLL_MS		10
+#define DS3231_CONV_TIMEOUT_MS	500
+
+#if (DS3231_BUS_POLICY == DS3231_BUS_HAL_DMA)
+#define DS3231_ASYNC_DMA
+#elif (DS3231_BUS_POLICY != DS3231_BUS_HAL_IT)
+/* Transfers complete where they are started, no completion interrupt */
+#define DS3231_BUS_SYNC
+#endif
+
+#define DS3231_SHADOW_FIRST	DS3231_A1_SECOND
+#define DS3231_SHADOW_COUNT	(DS3231_REG_STATUS - DS3231_A1_SECOND + 1)
 /*----------------------------------------------------------------------------*/
 typedef enum d3231_rate
 {
@@ -100,6 +264,49 @@ typedef enum d3231_state
 	DS3231_DISABLED, DS3231_ENABLED
 }ds3231_state;
 
+typedef enum d3231_bus_profile
+{
+	DS3231_BUS_STANDARD,		/* 100 kHz */
+	DS3231_BUS_FAST_2,			/* 400 kHz, SCL low/high 2:1 */
+	DS3231_BUS_FAST_16_9,		/* 400 kHz, SCL low/high 16:9 */
+	DS3231_BUS_PROFILE_COUNT
+}ds3231_bus_profile;
+
+#define DS3231_BUS_API_COUNT	7
+
+typedef struct d3231_bus_api_time
+{
+	const char *name;			/* API that was timed */
+	uint32_t mean_us;			/* mean time of one call */
+	uint32_t max_us;			/* longest call */
+	uint32_t errors;			/* failed calls */
+}ds3231_bus_api_time;
+
+typedef struct d3231_bus_report
+{
+	ds3231_bus_profile profile;
+	uint32_t clock_hz;			/* nominal SCL frequency */
+	ds3231_bus_api_time api[DS3231_BUS_API_COUNT];
+}ds3231_bus_report;
+
+#define DS3231_BACKEND_COUNT	3
+
+typedef struct d3231_backend_time
+{
+	const char *name;			/* I2C backend that was timed */
+	uint32_t wall_cycles;		/* mean core cycles from start to end of one read */
+	uint32_t cpu_cycles;		/* mean core cycles the CPU was busy with one read */
+	uint32_t gap_cycles;		/* wall time not explained by the nominal bus time */
+	uint32_t errors;			/* failed reads */
+}ds3231_backend_time;
+
+typedef struct d3231_backend_report
+{
+	uint32_t clock_hz;			/* nominal SCL frequency */
+	uint32_t bus_cycles;		/* nominal bus time of one read in core cycles */
+	ds3231_backend_time backend[DS3231_BACKEND_COUNT];
+}ds3231_backend_report;
+
 typedef enum d3231_alarm_1_mode
 {
 	DS3231_A1_EVERY_S = 0x0f, DS3231_A1_MATCH_S = 0x0e, DS3231_A1_MATCH_S_M = 0x0c, DS3231_A1_MATCH_S_M_H = 0x08, DS3231_A1_MATCH_S_M_H_DATE = 0x00, DS3231_A1_MATCH_S_M_H_DAY = 0x80,
@@ -110,54 +317,362 @@ typedef enum d3231_alarm_2_mode
 	DS3231_A2_EVERY_M = 0x07, DS3231_A2_MATCH_M = 0x06, DS3231_A2_MATCH_M_H = 0x04, DS3231_A2_MATCH_M_H_DATE = 0x00, DS3231_A2_MATCH_M_H_DAY = 0x80,
 }ds3231_alarm_2_mode;
 
-extern I2C_HandleTypeDef *_ds3231_ui2c;
-
-extern uint8_t ds3231_init(I2C_HandleTypeDef *hi2c);
-extern uint8_t ds3231_set_reg_byte(uint8_t reg_addr, uint8_t val);
-extern uint8_t ds3231_get_reg_byte(uint8_t reg_addr, uint8_t *reg_value);
-extern uint8_t ds3231_get_day_of_week(void);
-extern uint8_t ds3231_get_date(void);
-extern uint8_t ds3231_get_month(void);
-extern uint16_t ds3231_get_year(void);
-extern uint8_t ds3231_get_hour(void);
-extern uint8_t ds3231_get_minute(void);
-extern uint8_t ds3231_get_second(void);
-extern uint8_t ds3231_set_day_of_week(uint8_t dow);
-extern uint8_t ds3231_set_date(uint8_t date);
-extern uint8_t ds3231_set_month(uint8_t month);
-extern uint8_t ds3231_set_year(uint16_t year);
-extern uint8_t ds3231_set_hour(uint8_t hour_24mode);
-extern uint8_t ds3231_set_minute(uint8_t minute);
-extern uint8_t ds3231_set_second(uint8_t second);
-extern uint8_t ds3231_set_full_time(uint8_t hour_24mode, uint8_t minute, uint8_t second);
-extern uint8_t ds3231_set_full_date(uint8_t date, uint8_t month, uint8_t dow, uint16_t year);
+typedef struct d3231_datetime
+{
+	uint8_t second;			/* 0 to 59 */
+	uint8_t minute;			/* 0 to 59 */
+	uint8_t hour;			/* 0 to 23 */
+	uint8_t day_of_week;	/* 1 to 7 */
+	uint8_t date;			/* 1 to 31 */
+	uint8_t month;			/* 1 to 12 */
+	uint16_t year;			/* 2000 to 2199 */
+}ds3231_datetime;
+
+typedef struct d3231_snapshot
+{
+	ds3231_datetime datetime;	/* hour in 24h format */
+	int16_t temperature;		/* hundredths of a degree Celsius, 0.25 resolution */
+}ds3231_snapshot;
+
+typedef struct d3231_alarm_1_config
+{
+	ds3231_alarm_1_mode mode;
+	uint8_t second;			/* 0 to 59 */
+	uint8_t minute;			/* 0 to 59 */
+	uint8_t hour;			/* 0 to 23 */
+	uint8_t day_date;		/* date 1 to 31, or day 1 to 7 in DS3231_A1_MATCH_S_M_H_DAY mode */
+	uint8_t regs[4];		/* registers 0x07 to 0x0a, encoded by ds3231_stage_alarm_1 */
+}ds3231_alarm_1_config;
+
+typedef struct d3231_alarm_2_config
+{
+	ds3231_alarm_2_mode mode;
+	uint8_t minute;			/* 0 to 59 */
+	uint8_t hour;			/* 0 to 23 */
+	uint8_t day_date;		/* date 1 to 31, or day 1 to 7 in DS3231_A2_MATCH_M_H_DAY mode */
+	uint8_t regs[3];		/* registers 0x0b to 0x0d, encoded by ds3231_stage_alarm_2 */
+}ds3231_alarm_2_config;
+
+/**
+ *  @enum ds3231_request_status
+ *  @brief Life cycle of an asynchronous register transfer
+ */
+typedef enum ds3231_request_status
+{
+	DS3231_REQUEST_IDLE = 0,	/*!< not submitted */
+	DS3231_REQUEST_QUEUED,		/*!< waiting for the bus */
+	DS3231_REQUEST_BUSY,		/*!< transfer in progress */
+	DS3231_REQUEST_DONE,		/*!< transfer completed */
+	DS3231_REQUEST_ERROR		/*!< transfer failed */
+}ds3231_request_status;
+
+/**
+ *  @enum ds3231_request_dir
+ *  @brief Direction of an asynchronous register transfer
+ */
+typedef enum ds3231_request_dir
+{
+	DS3231_REQUEST_READ = 0,
+	DS3231_REQUEST_WRITE
+}ds3231_request_dir;
+
+/**
+ *  @enum ds3231_op
+ *  @brief Operation type of a transfer, selects its latency statistics
+ */
+typedef enum d3231_op
+{
+	DS3231_OP_READ = 0,			/*!< register read */
+	DS3231_OP_WRITE,			/*!< register write */
+	DS3231_OP_MIRROR,			/*!< background refresh of the register mirror */
+	DS3231_OP_COUNT
+}ds3231_op;
+
+/**
+ *  @brief Number of latency histogram buckets, bucket n counts 2^n to 2^(n+1)-1 us,
+ *         the last one everything above
+ */
+#define DS3231_LATENCY_BUCKETS 16
+
+/**
+ *  @struct ds3231_latency_stats
+ *  @brief Bus time statistics of one operation type, from the start of the
+ *         transfer on the bus to its completion
+ */
+typedef struct d3231_latency_stats
+{
+	uint32_t count;									/*!< finished transfers, failed ones included */
+	uint32_t errors;								/*!< transfers failed on the bus, bus timeouts included */
+	uint32_t timeouts;								/*!< transfers that missed their deadline, on the bus or queued */
+	uint32_t max_us;								/*!< longest bus time */
+	uint64_t total_us;								/*!< sum of bus times */
+	uint32_t histogram[DS3231_LATENCY_BUCKETS];		/*!< log2 histogram of bus times */
+	uint32_t wait_max_us;							/*!< longest wait in the queue before the bus */
+	uint64_t wait_total_us;							/*!< sum of queue waits of the finished transfers */
+}ds3231_latency_stats;
+
+/**
+ *  @enum ds3231_priority
+ *  @brief Queue order of a request. Higher priorities go to the bus first, equal
+ *         priorities by earliest deadline, then in submit order.
+ */
+typedef enum d3231_priority
+{
+	DS3231_PRIORITY_BACKGROUND = 0, /*!< polls that can wait, e.g. temperature conversion */
+	DS3231_PRIORITY_NORMAL,			/*!< blocking calls from thread context */
+	DS3231_PRIORITY_URGENT			/*!< requests queued by interrupt handlers, mirror refresh */
+}ds3231_priority;
+
+typedef struct ds3231_request ds3231_request;
+typedef struct d3231_handle ds3231_t;
+
+/**
+ *  @brief Completion callback, called from interrupt context when the request is DONE or ERROR
+ */
+typedef void (*ds3231_callback)(ds3231_request *request);
+
+/**
+ *  @struct ds3231_request
+ *  @brief Descriptor of one register range transfer. Owned by the driver from
+ *         ds3231_submit() until ds3231_is_done() returns 1, so it must not live
+ *         on a stack frame that returns before then.
+ */
+struct ds3231_request
+{
+	ds3231_request_dir dir;					/*!< read or write */
+	uint8_t reg_addr;						/*!< first register address */
+	uint8_t *data;							/*!< register values to write, or buffer to read into */
+	uint16_t len;							/*!< number of registers */
+	ds3231_callback callback;				/*!< completion callback, may be NULL */
+	void *context;							/*!< user data for the callback */
+	volatile ds3231_request_status status;	/*!< set by the driver */
+	ds3231_request *next;					/*!< queue link, used by the driver */
+	ds3231_op op;							/*!< statistics bucket */
+	uint32_t timeout_us;					/*!< deadline, 0 = DS3231_TIMEOUT_US; from submit while queued, from start on the bus */
+	ds3231_priority priority;				/*!< queue order */
+	uint32_t submit_cycles;					/*!< set by the driver */
+	uint32_t start_cycles;					/*!< set by the driver */
+};
+
+typedef enum d3231_conv_state
+{
+	DS3231_CONV_IDLE,			/* no conversion requested */
+	DS3231_CONV_CHECK,			/* reading CONV/BSY before setting CONV */
+	DS3231_CONV_START,			/* writing CONV */
+	DS3231_CONV_WAIT,			/* converting, next BSY poll due after DS3231_CONV_POLL_MS */
+	DS3231_CONV_POLL			/* reading CONV/BSY and the temperature */
+}ds3231_conv_state;
+
+/* Delivers an on-demand conversion, from the I2C completion interrupt or ds3231_conversion_poll().
+ * status 0 = success, otherwise = bus error or timeout; centi_celsius is only valid on success. */
+typedef void (*ds3231_temp_callback)(ds3231_t *dev, uint8_t status, int16_t centi_celsius, void *context);
+
+/* Delivers an alarm event queued by ds3231_alarm_event() or ds3231_mirror_event(), from the I2C completion interrupt.
+ * status 0 = success; flags holds the A1F/A2F bits that were set, they are being cleared.
+ * datetime is the time read with the flags, valid on success only. */
+typedef void (*ds3231_alarm_callback)(ds3231_t *dev, uint8_t status, uint8_t flags,
+									  const ds3231_datetime *datetime, void *context);
+
+typedef struct d3231_bus_config
+{
+	I2C_HandleTypeDef *hi2c;	/* I2C handle initialized by CubeMX */
+	GPIO_TypeDef *scl_port;		/* bus pins, driven by hand for bus recovery */
+	uint16_t scl_pin;
+	GPIO_TypeDef *sda_port;
+	uint16_t sda_pin;
+	void (*bus_reinit)(void);	/* CubeMX initialization of the peripheral, e.g. MX_I2C3_Init */
+	IRQn_Type dma_rx_irqn;		/* DMA stream interrupts with DS3231_ASYNC_DMA */
+	IRQn_Type dma_tx_irqn;
+}ds3231_bus_config;
+
+/* Driver context of one DS3231. All state lives here, so devices on different
+ * buses have their own queue, mirror and statistics and transfer concurrently. */
+struct d3231_handle
+{
+	ds3231_bus_config bus;
+	uint32_t timeout_us;						/* deadline of the blocking transfers */
+	ds3231_bus_profile bus_profile;				/* I2C speed profile, MX init starts at Standard-mode */
+
+	ds3231_request *queue_head;					/* requests waiting for the bus, oldest first */
+	ds3231_request *queue_tail;
+	ds3231_request * volatile active;			/* request whose transfer is on the bus */
+	ds3231_latency_stats stats[DS3231_OP_COUNT];	/* bus time statistics per operation type */
+	volatile uint32_t recoveries;				/* missed deadlines that reset the bus */
+	volatile uint8_t recovering;				/* a bus recovery owns the peripheral */
+	volatile uint8_t recover_pending;			/* deadline missed in an interrupt handler, bus held until thread context recovers it */
+	uint32_t queue_depth;						/* requests waiting for the bus */
+	uint32_t queue_depth_max;					/* deepest the queue has been */
+
+	uint8_t mirror[DS3231_REG_COUNT];			/* registers 0x00 to 0x12, refreshed per SQW edge */
+	uint8_t mirror_rx[DS3231_REG_COUNT];
+	ds3231_request mirror_request;
+	volatile uint32_t mirror_generation;		/* odd while a refresh is in flight */
+	volatile uint32_t mirror_tick;
+	volatile uint8_t mirror_enabled;
+	volatile uint8_t mirror_valid;
+	uint8_t mirror_bypass;						/* set while bus times are measured */
+	uint8_t bus_aging;							/* aging register written back while measuring */
+#ifdef DS3231_SHADOW_REGS
+	uint8_t shadow[DS3231_SHADOW_COUNT];		/* registers 0x07 to 0x0f, in the form safe to write back */
+	uint8_t shadow_valid;
+#endif
+#if (DS3231_BUS_POLICY == DS3231_BUS_SIM)
+	uint8_t sim_regs[DS3231_REG_COUNT];			/* simulated device registers */
+#endif
+
+	ds3231_request event_request;				/* alarm event queued from the INT#/SQW interrupt */
+	uint8_t event_regs[DS3231_REG_STATUS + 1];	/* registers 0x00 to 0x0f */
+	ds3231_alarm_callback event_callback;
+	void *event_context;
+	volatile uint8_t event_pending;				/* event delivered by the mirror refresh in flight */
+	uint32_t event_cycles;						/* SQW edge of the pending event, a refresh started before it is not used */
+
+	ds3231_request conv_request;				/* on-demand temperature conversion */
+	uint8_t conv_regs[5];						/* control, status, aging, temperature MSB/LSB */
+	volatile ds3231_conv_state conv_state;
+	uint32_t conv_start_tick;
+	uint32_t conv_poll_tick;
+	ds3231_temp_callback conv_callback;
+	void *conv_context;
+};
+
+/* Unix epoch range of the DS3231 calendar, 2000-01-01 00:00:00 to 2199-12-31 23:59:59 */
+#define DS3231_EPOCH_MIN 946684800ull
+#define DS3231_EPOCH_MAX 7258118399ull
+
+/**
+ * @brief Days since 1970-01-01 of a proleptic Gregorian date, days-from-civil without
+ *        branches or run-time divisions (all divisors are constants).
+ * @param year Year, 1 to 65535.
+ * @param month Month, 1 to 12.
+ * @param date Date, 1 to 31.
+ * @return Days since 1970-01-01, negative before it.
+ */
+static inline int32_t ds3231_days_from_civil(uint32_t year, uint32_t month, uint32_t date)
+{
+	/* Years start on March 1st so the leap day is the last day of the year */
+	uint32_t y = year - (month <= 2);
+	uint32_t era = y / 400;
+	uint32_t yoe = y - era * 400;
+	uint32_t doy = (153 * (month + ((month > 2) ? -3 : 9)) + 2) / 5 + date - 1;
+	uint32_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+	return (int32_t)(era * 146097 + doe) - 719468;
+}
+
+/**
+ * @brief Proleptic Gregorian date of a day count since 1970-01-01, the inverse of
+ *        ds3231_days_from_civil.
+ * @param days Days since 1970-01-01, -719468 or later.
+ * @param year Year.
+ * @param month Month, 1 to 12.
+ * @param date Date, 1 to 31.
+ * @return None
+ */
+static inline void ds3231_civil_from_days(int32_t days, uint16_t *year, uint8_t *month, uint8_t *date)
+{
+	uint32_t z = (uint32_t)(days + 719468);
+	uint32_t era = z / 146097;
+	uint32_t doe = z - era * 146097;
+	uint32_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	uint32_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	uint32_t mp = (5 * doy + 2) / 153;
+	uint32_t m = mp + ((mp < 10) ? 3 : -9);
+
+	*date = (uint8_t)(doy - (153 * mp + 2) / 5 + 1);
+	*month = (uint8_t)m;
+	*year = (uint16_t)(yoe + era * 400 + (m <= 2));
+}
+
+/* On-board RTC, defined in main.c */
+extern ds3231_t hds3231;
+
+extern uint8_t ds3231_init(ds3231_t *dev, const ds3231_bus_config *bus);
+extern void ds3231_set_timeout(ds3231_t *dev, uint32_t timeout_us);
+extern uint32_t ds3231_get_timeout(ds3231_t *dev);
+extern uint8_t ds3231_set_bus_profile(ds3231_t *dev, ds3231_bus_profile profile);
+extern ds3231_bus_profile ds3231_get_bus_profile(ds3231_t *dev);
+extern uint32_t ds3231_get_bus_clock(ds3231_t *dev);
+extern uint8_t ds3231_select_bus_profile(ds3231_t *dev, ds3231_bus_profile preferred);
+extern uint8_t ds3231_measure_bus_profile(ds3231_t *dev, ds3231_bus_profile profile, ds3231_bus_report *report);
+extern uint8_t ds3231_write_regs(ds3231_t *dev, uint8_t reg_addr, const uint8_t *vals, uint16_t len);
+extern uint8_t ds3231_read_regs(ds3231_t *dev, uint8_t reg_addr, uint8_t *vals, uint16_t len);
+extern uint8_t ds3231_set_reg_byte(ds3231_t *dev, uint8_t reg_addr, uint8_t val);
+extern uint8_t ds3231_get_reg_byte(ds3231_t *dev, uint8_t reg_addr, uint8_t *reg_value);
+extern uint8_t ds3231_update_reg(ds3231_t *dev, uint8_t reg_addr, uint8_t mask, uint8_t val);
+#ifdef DS3231_SHADOW_REGS
+extern uint8_t ds3231_shadow_sync(ds3231_t *dev);
+extern void ds3231_shadow_invalidate(ds3231_t *dev);
+extern uint8_t ds3231_shadow_verify(ds3231_t *dev);
+#endif
+extern uint8_t ds3231_mirror_enable(ds3231_t *dev, ds3231_state enable);
+extern uint8_t ds3231_is_mirror_enabled(ds3231_t *dev);
+extern uint8_t ds3231_mirror_refresh(ds3231_t *dev);
+extern uint32_t ds3231_mirror_generation(ds3231_t *dev);
+extern uint8_t ds3231_mirror_event(ds3231_t *dev, ds3231_alarm_callback callback, void *context);
+extern uint8_t ds3231_get_datetime(ds3231_t *dev, ds3231_datetime *datetime);
+extern uint8_t ds3231_get_day_of_week(ds3231_t *dev);
+extern uint8_t ds3231_get_date(ds3231_t *dev);
+extern uint8_t ds3231_get_month(ds3231_t *dev);
+extern uint16_t ds3231_get_year(ds3231_t *dev);
+extern uint8_t ds3231_get_hour(ds3231_t *dev);
+extern uint8_t ds3231_get_minute(ds3231_t *dev);
+extern uint8_t ds3231_get_second(ds3231_t *dev);
+extern uint8_t ds3231_set_day_of_week(ds3231_t *dev, uint8_t dow);
+extern uint8_t ds3231_set_date(ds3231_t *dev, uint8_t date);
+extern uint8_t ds3231_set_month(ds3231_t *dev, uint8_t month);
+extern uint8_t ds3231_set_year(ds3231_t *dev, uint16_t year);
+extern uint8_t ds3231_set_hour(ds3231_t *dev, uint8_t hour_24mode);
+extern uint8_t ds3231_set_minute(ds3231_t *dev, uint8_t minute);
+extern uint8_t ds3231_set_second(ds3231_t *dev, uint8_t second);
+extern uint8_t ds3231_set_full_time(ds3231_t *dev, uint8_t hour_24mode, uint8_t minute, uint8_t second);
+extern uint8_t ds3231_set_full_date(ds3231_t *dev, uint8_t date, uint8_t month, uint8_t dow, uint16_t year);
+extern uint8_t ds3231_set_datetime(ds3231_t *dev, const ds3231_datetime *datetime);
+extern uint8_t ds3231_set_datetime_at(ds3231_t *dev, uint64_t epoch, uint32_t micros, int32_t *est_error_us);
+extern uint8_t ds3231_decode_time_regs(const uint8_t *regs, ds3231_datetime *datetime);
+extern uint8_t ds3231_is_datetime_valid(const ds3231_datetime *datetime);
+extern uint8_t ds3231_datetime_to_epoch(const ds3231_datetime *datetime, uint64_t *epoch);
+extern uint8_t ds3231_datetime_to_epoch32(const ds3231_datetime *datetime, uint32_t *epoch);
+extern uint8_t ds3231_epoch_to_datetime(uint64_t epoch, ds3231_datetime *datetime);
+extern uint8_t ds3231_epoch32_to_datetime(uint32_t epoch, ds3231_datetime *datetime);
 extern uint8_t ds3231_decode_BCD(uint8_t bin);
 extern uint8_t ds3231_encode_BCD(uint8_t dec);
-extern uint8_t ds3231_enable_battery_square_wave(ds3231_state enable);
-extern uint8_t ds3231_set_interrupt_mode(ds3231_interrupt_mode mode);
-extern uint8_t ds3231_set_rate_select(ds3231_rate rate);
-extern uint8_t ds3231_enable_oscillator(ds3231_state enable);
-extern uint8_t ds3231_enable_alarm_2(ds3231_state enable);
-extern uint8_t ds3231_set_alarm_2_mode(ds3231_alarm_2_mode alarm_mode);
-extern uint8_t ds3231_clear_alarm_2_flag(void);
-extern uint8_t ds3231_set_alarm_2_minute(uint8_t minute);
-extern uint8_t ds3231_set_alarm_2_hour(uint8_t hour_24mode);
-extern uint8_t ds3231_set_alarm_2_date(uint8_t date);
-extern uint8_t ds3231_set_alarm_2_day(uint8_t day);
-extern uint8_t ds3231_enable_alarm_1(ds3231_state enable);
-extern uint8_t ds3231_set_alarm_1_mode(ds3231_alarm_1_mode alarm_mode);
-extern uint8_t ds3231_clear_alarm_1_flag(void);
-extern uint8_t ds3231_set_alarm_1_second(uint8_t second);
-extern uint8_t ds3231_set_alarm_1_minute(uint8_t minute);
-extern uint8_t ds3231_set_alarm_1_hour(uint8_t hour_24mode);
-extern uint8_t ds3231_set_alarm_1_date(uint8_t date);
-extern uint8_t ds3231_set_alarm_1_day(uint8_t day);
-extern uint8_t ds3231_enable_32kHz_output(ds3231_state enable);
-extern uint8_t ds3231_is_oscillator_stopped(void);
-extern uint8_t ds3231_is_32kHz_enabled(void);
-extern uint8_t ds3231_is_alarm_1_triggered(void);
-extern uint8_t ds3231_is_alarm_2_triggered(void);
-extern int8_t ds3231_get_temperature_integer(uint8_t *temp_whole);
-extern uint8_t ds3231_get_temperature_fraction(uint8_t *temp_frac);
+extern uint8_t ds3231_enable_battery_square_wave(ds3231_t *dev, ds3231_state enable);
+extern uint8_t ds3231_set_interrupt_mode(ds3231_t *dev, ds3231_interrupt_mode mode);
+extern uint8_t ds3231_set_rate_select(ds3231_t *dev, ds3231_rate rate);
+extern uint8_t ds3231_enable_oscillator(ds3231_t *dev, ds3231_state enable);
+extern uint8_t ds3231_enable_alarm_2(ds3231_t *dev, ds3231_state enable);
+extern uint8_t ds3231_set_alarm_2_mode(ds3231_t *dev, ds3231_alarm_2_mode alarm_mode);
+extern uint8_t ds3231_clear_alarm_2_flag(ds3231_t *dev);
+extern uint8_t ds3231_set_alarm_2_minute(ds3231_t *dev, uint8_t minute);
+extern uint8_t ds3231_set_alarm_2_hour(ds3231_t *dev, uint8_t hour_24mode);
+extern uint8_t ds3231_set_alarm_2_date(ds3231_t *dev, uint8_t date);
+extern uint8_t ds3231_set_alarm_2_day(ds3231_t *dev, uint8_t day);
+extern uint8_t ds3231_enable_alarm_1(ds3231_t *dev, ds3231_state enable);
+extern uint8_t ds3231_set_alarm_1_mode(ds3231_t *dev, ds3231_alarm_1_mode alarm_mode);
+extern uint8_t ds3231_clear_alarm_1_flag(ds3231_t *dev);
+extern uint8_t ds3231_set_alarm_1_second(ds3231_t *dev, uint8_t second);
+extern uint8_t ds3231_set_alarm_1_minute(ds3231_t *dev, uint8_t minute);
+extern uint8_t ds3231_set_alarm_1_hour(ds3231_t *dev, uint8_t hour_24mode);
+extern uint8_t ds3231_set_alarm_1_date(ds3231_t *dev, uint8_t date);
+extern uint8_t ds3231_set_alarm_1_day(ds3231_t *dev, uint8_t day);
+extern uint8_t ds3231_stage_alarm_1(ds3231_alarm_1_config *config);
+extern uint8_t ds3231_commit_alarm_1(ds3231_t *dev, const ds3231_alarm_1_config *config);
+extern uint8_t ds3231_stage_alarm_2(ds3231_alarm_2_config *config);
+extern uint8_t ds3231_commit_alarm_2(ds3231_t *dev, const ds3231_alarm_2_config *config);
+extern uint8_t ds3231_enable_32kHz_output(ds3231_t *dev, ds3231_state enable);
+extern uint8_t ds3231_is_oscillator_stopped(ds3231_t *dev);
+extern uint8_t ds3231_is_32kHz_enabled(ds3231_t *dev);
+extern uint8_t ds3231_is_alarm_1_triggered(ds3231_t *dev);
+extern uint8_t ds3231_is_alarm_2_triggered(ds3231_t *dev);
+extern uint8_t ds3231_alarm_event(ds3231_t *dev, ds3231_alarm_callback callback, void *context);
+extern int8_t ds3231_get_temperature_integer(ds3231_t *dev, uint8_t *temp_whole);
+extern uint8_t ds3231_get_temperature_fraction(ds3231_t *dev, uint8_t *temp_frac);
+extern int16_t ds3231_decode_temperature(const uint8_t *regs);
+extern uint8_t ds3231_get_temperature(ds3231_t *dev, int16_t *centi_celsius);
+extern uint8_t ds3231_get_snapshot(ds3231_t *dev, ds3231_snapshot *snapshot);
+extern uint8_t ds3231_start_conversion(ds3231_t *dev, ds3231_temp_callback callback, void *context);
+extern void ds3231_conversion_poll(ds3231_t *dev);
+extern uint8_t ds3231_is_conversion_busy(ds3231_t *dev);
 
 #endif /* DS3231_H */
@@ -0,0 +1,50 @@
+/**
+  ******************************************************************************
+  * @file           : ds3231_async.h
+  * @brief          : Header for ds3231_async.c file.
+  * @note           : STM32CubeIDE Environment
+  ******************************************************************************
+  * @attention
+  *
+  * MIT License
+  *
+  * Copyright (c) 2024 Elray's Software LLC, elrays@sbcglobal.net
+  *
+  * Permission is hereby granted, free of charge, to any person obtaining a copy
+  * of this software and associated documentation files (the "Software"), to deal
+  * in the Software without restriction, including without limitation the rights
+  * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  * copies of the Software, and to permit persons to whom the Software is
+  * furnished to do so, subject to the following conditions:
+  *
+  * The above copyright notice and this permission notice shall be included in all
+  * copies or substantial portions of the Software.
+  *
+  * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  * SOFTWARE.
+  ******************************************************************************
+  */
+#ifndef INC_DS3231_ASYNC_H_
+#define INC_DS3231_ASYNC_H_
+
+#include "ds3231.h"
+
+extern uint8_t ds3231_attach(ds3231_t *dev);
+extern uint8_t ds3231_submit(ds3231_t *dev, ds3231_request *request);
+extern uint8_t ds3231_is_done(const ds3231_request *request);
+extern uint8_t ds3231_wait(ds3231_t *dev, ds3231_request *request);
+extern uint8_t ds3231_is_bus_idle(ds3231_t *dev);
+extern void ds3231_poll(ds3231_t *dev);
+extern uint8_t ds3231_get_latency_stats(ds3231_t *dev, ds3231_op op, ds3231_latency_stats *stats);
+extern void ds3231_reset_latency_stats(ds3231_t *dev);
+extern uint32_t ds3231_get_bus_recoveries(ds3231_t *dev);
+extern void ds3231_get_queue_depth(ds3231_t *dev, uint32_t *depth, uint32_t *max_depth);
+extern uint8_t ds3231_benchmark_backends(ds3231_t *dev, ds3231_backend_report *report);
+extern uint8_t ds3231_write_at(ds3231_t *dev, uint8_t reg_addr, const uint8_t *vals, uint16_t len, uint32_t at, uint32_t *ack_cycles);
+
+#endif /* INC_DS3231_ASYNC_H_ */
@@ -36,8 +36,13 @@
 
 #define get_millis() HAL_GetTick()
 #define delay_ms(t) HAL_Delay(t)
+/* DWT cycle counter, wraps after 2^32 core clocks (about 23 s at 180 MHz) */
+#define get_cycles() (DWT->CYCCNT)
 
 uint32_t get_micros(void);
 uint32_t get_micros_isr(void);
+void cycle_counter_init(void);
+uint32_t cycles_to_micros(uint32_t cycles);
+uint32_t micros_to_cycles(uint32_t micros);
 
 #endif /* INC_GET_TIME_H_ */
@@ -35,7 +35,8 @@ extern "C" {
 extern I2C_HandleTypeDef hi2c3;
 
 /* USER CODE BEGIN Private defines */
-
+extern DMA_HandleTypeDef hdma_i2c3_rx;
+extern DMA_HandleTypeDef hdma_i2c3_tx;
 /* USER CODE END Private defines */
 
 void MX_I2C3_Init(void);
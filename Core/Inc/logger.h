@@ -33,11 +33,50 @@
 #ifndef INC_LOGGER_H_
 #define INC_LOGGER_H_
 
+#include <stdint.h>
+
+/**
+ *  @brief Define to send binary records instead of formatted text, see LOG() below
+ */
+//#define LOG_BINARY
+
 /**
  *  @brief Maximum Logger Buffer Length
  */
 #define LOGGER_MAX_BUF_LENGTH 256
 
+/**
+ *  @brief Size of the ring buffer UART2 TX DMA drains, a power of two
+ */
+#define LOGGER_RING_SIZE 2048
+
+/**
+ *  @brief Overflow policy in effect at start up, see logger_set_overflow()
+ */
+#define LOGGER_OVERFLOW_DEFAULT LOGGER_OVERFLOW_DROP_NEWEST
+
+/**
+ *  @enum t_log_overflow
+ *  @brief What LOG() does with a line that does not fit in the ring buffer
+ */
+typedef enum
+{
+   LOGGER_OVERFLOW_DROP_NEWEST = 0,   /*!< the new line is dropped */
+   LOGGER_OVERFLOW_DROP_OLDEST,       /*!< queued lines not yet on the wire are dropped to make room */
+   LOGGER_OVERFLOW_BLOCK              /*!< LOG() waits for the DMA to free enough room */
+} t_log_overflow;
+
+/**
+ *  @struct t_log_stats
+ *  @brief Ring buffer counters
+ */
+typedef struct
+{
+   uint32_t dropped_bytes;   /*!< bytes of dropped lines */
+   uint32_t dropped_lines;   /*!< lines dropped by the overflow policy */
+   uint32_t high_water;      /*!< most bytes ever queued */
+} t_log_stats;
+
 /**
  *  @enum t_log_type
  *  @brief Type of log output
@@ -54,12 +93,64 @@ typedef enum
    MAX_LOG_TYPE        /*!< must be the last t_log_type */
 } t_log_type;
 
+/**
+ *  @brief Least severe log type compiled in. LOG() calls of less severe types are
+ *         removed by the compiler with their format strings, e.g. -DLOG_COMPILE_LEVEL=LOG_WARNING
+ */
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_DEBUG
+#endif
+
+/**
+ *  @enum t_log_module
+ *  @brief Source module of a LOG() call, selects its runtime mask
+ *  @note A source file defines LOG_MODULE before including logger.h, others are LOG_MODULE_OTHER
+ */
+typedef enum
+{
+   LOG_MODULE_OTHER = 0,   /*!< files that do not define LOG_MODULE */
+   LOG_MODULE_MAIN,        /*!< main loop */
+   LOG_MODULE_IRQ,         /*!< interrupt handlers */
+   LOG_MODULE_MENU,        /*!< serial menu */
+
+   MAX_LOG_MODULE          /*!< must be the last t_log_module */
+} t_log_module;
+
+#ifndef LOG_MODULE
+#define LOG_MODULE LOG_MODULE_OTHER
+#endif
+
+/**
+ *  @brief Runtime masks, bit n enables t_log_type n
+ */
+#define LOG_MASK_ALL            ((1ul << MAX_LOG_TYPE) - 1)
+#define LOG_MASK_UPTO(type)     ((2ul << (type)) - 1)
+
+/**
+ *  @brief Runtime mask of each module at start up
+ */
+#define LOG_MODULE_MASK_DEFAULT LOG_MASK_ALL
+
+/**
+ *  @brief Runtime mask of each module, read by LOG() before any formatting
+ */
+extern uint32_t logger_module_mask[MAX_LOG_MODULE];
+
+/**
+ *  @def LOG_ENABLED()
+ *  @brief Whether a LOG() of this type in this module is sent: a constant compare the compiler
+ *         folds, then one load and branch on the module mask
+ */
+#define LOG_ENABLED(type)                                                       \
+   (((type) <= LOG_COMPILE_LEVEL) &&                                            \
+    ((logger_module_mask[LOG_MODULE] & (1ul << (type))) != 0))
+
 /**
  *  @fn logger_printf_fn(t_log_type type, char const * typestring, char const * file, int line, char const * format, ...)
  *  @brief Logger printf backend function (which is used when Logger singleton object not yet instantiated)
  *  @param [ in] type - log type
  *  @param [ in] typestring - string corresponding to log type
- *  @param [ in] file - name of file logging the buffer
+ *  @param [ in] file - base name of file logging the buffer, see LOG_FILE
  *  @param [ in] line - file line number logging the buffer
  *  @param [ in] format - printf like format string
  *  @param [ in ] ... - printf like arguments
@@ -70,6 +161,180 @@ extern void logger_printf_fn(t_log_type type,
                              int line,
                              char const * format, ...);
 
+/**
+ *  @fn logger_set_overflow(t_log_overflow policy)
+ *  @brief Select what LOG() does when the ring buffer is full
+ *  @param [ in] policy - LOGGER_OVERFLOW_DROP_NEWEST, LOGGER_OVERFLOW_DROP_OLDEST or LOGGER_OVERFLOW_BLOCK
+ */
+extern void logger_set_overflow(t_log_overflow policy);
+
+/**
+ *  @fn logger_get_stats(t_log_stats *stats)
+ *  @brief Copy the ring buffer counters
+ *  @param [out] stats - dropped bytes and lines, most bytes ever queued
+ */
+extern void logger_get_stats(t_log_stats *stats);
+
+/**
+ *  @fn logger_flush(void)
+ *  @brief Wait until every queued line has been sent
+ */
+extern void logger_flush(void);
+
+/**
+ *  @fn logger_set_module_mask(t_log_module module, uint32_t mask)
+ *  @brief Select the log types a module sends
+ *  @param [ in] module - source module
+ *  @param [ in] mask - bit n enables t_log_type n, see LOG_MASK_UPTO()
+ */
+extern void logger_set_module_mask(t_log_module module, uint32_t mask);
+
+/**
+ *  @fn logger_get_module_mask(t_log_module module)
+ *  @brief Read the log types a module sends
+ *  @param [ in] module - source module
+ *  @retval mask, 0 for an unknown module
+ */
+extern uint32_t logger_get_module_mask(t_log_module module);
+
+/**
+ *  @fn logger_module_name(t_log_module module)
+ *  @brief Name of a module for display
+ *  @param [ in] module - source module
+ *  @retval name, "?" for an unknown module
+ */
+extern const char *logger_module_name(t_log_module module);
+
+/**
+ *  @fn logger_type_name(t_log_type type)
+ *  @brief Name of a log type for display, as LOG() prints it
+ *  @param [ in] type - log type
+ *  @retval name, "?" for an unknown type
+ */
+extern const char *logger_type_name(t_log_type type);
+
+/**
+ *  @def LOG_FILE
+ *  @brief Base name of the source file, resolved by the compiler. GCC 12 and later provide
+ *         __FILE_NAME__, so no build path is stored. Older compilers fold the search below
+ *         to a pointer into __FILE__, which keeps the path in flash unless the build maps it
+ *         away with -fmacro-prefix-map.
+ */
+#ifdef __FILE_NAME__
+#define LOG_FILE __FILE_NAME__
+#else
+#define LOG_FILE                                                                \
+   (__builtin_strrchr(__FILE__, '/') ? __builtin_strrchr(__FILE__, '/') + 1 :  \
+    __builtin_strrchr(__FILE__, '\\') ? __builtin_strrchr(__FILE__, '\\') + 1 : __FILE__)
+#endif
+
+#ifdef LOG_BINARY
+/**
+ *  @brief Binary record layout, all fields little endian:
+ *         sync, length of the rest, call site ID (16 bit), Unix time (32 bit), microseconds (32 bit), arguments,
+ *         CRC-8 (polynomial 0x07) of the length byte through the last argument byte.
+ *         Integer arguments take 4 bytes, long long 8, float and double 8 (as double), strings a
+ *         length byte and the characters. tools/logdecode.py turns the records back into text.
+ */
+#define LOGGER_BIN_SYNC     0xA5
+#define LOGGER_BIN_HEADER   12
+#define LOGGER_BIN_MAX      (LOGGER_BIN_HEADER + 64)
+
+/**
+ *  @struct t_log_record
+ *  @brief Binary record being built by one LOG() call
+ */
+typedef struct
+{
+   uint8_t data[LOGGER_BIN_MAX];   /*!< record bytes */
+   uint32_t len;                   /*!< bytes used */
+   uint8_t overflow;               /*!< arguments did not fit, the record is dropped */
+} t_log_record;
+
+extern void logger_bin_begin(t_log_record *rec, uint32_t site);
+extern void logger_bin_u32(t_log_record *rec, uint32_t value);
+extern void logger_bin_u64(t_log_record *rec, uint64_t value);
+extern void logger_bin_f64(t_log_record *rec, double value);
+extern void logger_bin_str(t_log_record *rec, const char *value);
+extern void logger_bin_ptr(t_log_record *rec, const void *value);
+extern void logger_bin_end(t_log_record *rec);
+
+/**
+ *  @fn logger_check_fmt(char const * format, ...)
+ *  @brief Never called: lets the compiler check LOG() arguments against the format, which
+ *         tools/logdecode.py decodes them by. LOG() turns the format warnings into errors.
+ */
+static inline void logger_check_fmt(char const * format, ...) __attribute__((format(printf, 1, 2)));
+static inline void logger_check_fmt(char const * format, ...)
+{
+   (void)format;
+}
+
+/**
+ *  @def LOG_BIN_ARG()
+ *  @brief Append one argument to a binary record in the encoding of its type
+ */
+#define LOG_BIN_ARG(rec, x) _Generic((x),                              \
+   char *: logger_bin_str, const char *: logger_bin_str,               \
+   void *: logger_bin_ptr, const void *: logger_bin_ptr,               \
+   float: logger_bin_f64, double: logger_bin_f64,                      \
+   long long: logger_bin_u64, unsigned long long: logger_bin_u64,      \
+   default: logger_bin_u32)((rec), (x));
+
+/* Argument count of a LOG() call (0 to 8) and one LOG_BIN_ARG() per argument */
+#define LOG_NARGS(...) LOG_NARGS_(0, ##__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define LOG_NARGS_(_0, _1, _2, _3, _4, _5, _6, _7, _8, n, ...) n
+#define LOG_CAT(a, b) LOG_CAT_(a, b)
+#define LOG_CAT_(a, b) a##b
+#define LOG_STR(x) LOG_STR_(x)
+#define LOG_STR_(x) #x
+
+/* File name stored with a call site, a string literal; the decoder strips any path */
+#ifdef __FILE_NAME__
+#define LOG_BIN_FILE __FILE_NAME__
+#else
+#define LOG_BIN_FILE __FILE__
+#endif
+#define LOG_BIN_ARGS_0(rec)
+#define LOG_BIN_ARGS_1(rec, a) LOG_BIN_ARG(rec, a)
+#define LOG_BIN_ARGS_2(rec, a, ...) LOG_BIN_ARG(rec, a) LOG_BIN_ARGS_1(rec, __VA_ARGS__)
+#define LOG_BIN_ARGS_3(rec, a, ...) LOG_BIN_ARG(rec, a) LOG_BIN_ARGS_2(rec, __VA_ARGS__)
+#define LOG_BIN_ARGS_4(rec, a, ...) LOG_BIN_ARG(rec, a) LOG_BIN_ARGS_3(rec, __VA_ARGS__)
+#define LOG_BIN_ARGS_5(rec, a, ...) LOG_BIN_ARG(rec, a) LOG_BIN_ARGS_4(rec, __VA_ARGS__)
+#define LOG_BIN_ARGS_6(rec, a, ...) LOG_BIN_ARG(rec, a) LOG_BIN_ARGS_5(rec, __VA_ARGS__)
+#define LOG_BIN_ARGS_7(rec, a, ...) LOG_BIN_ARG(rec, a) LOG_BIN_ARGS_6(rec, __VA_ARGS__)
+#define LOG_BIN_ARGS_8(rec, a, ...) LOG_BIN_ARG(rec, a) LOG_BIN_ARGS_7(rec, __VA_ARGS__)
+
+/**
+ *  @def LOG()
+ *  @brief LOG Macro used globally to log messages and errors, binary records
+ *  @param [ in] type - log type
+ *  @param [ in] format - printf format string literal, kept in the .logfmt section only
+ *  @param [ in] args... - printf arguments (optional, up to 8)
+ *  @note GNU gcc specific. The type, file, line and format of each call site go into the
+ *        .logfmt section, which is not loaded; the offset of the site in it is its ID.
+ *        Arguments that do not match the format fail the build, the decoder relies on it.
+ */
+#define LOG(type, format, args...)                                              \
+{                                                                               \
+   static const char _log_site[] __attribute__((section(".logfmt"), used)) =   \
+      #type "\0" LOG_BIN_FILE "\0" LOG_STR(__LINE__) "\0" format;               \
+   _Pragma("GCC diagnostic push")                                               \
+   _Pragma("GCC diagnostic error \"-Wformat\"")                                 \
+   if (0)                                                                       \
+   {                                                                            \
+      logger_check_fmt(format, ##args);                                         \
+   }                                                                            \
+   _Pragma("GCC diagnostic pop")                                                \
+   if (LOG_ENABLED(type))                                                       \
+   {                                                                            \
+      t_log_record _log_rec;                                                    \
+      logger_bin_begin(&_log_rec, (uint32_t)(uintptr_t)_log_site);              \
+      LOG_CAT(LOG_BIN_ARGS_, LOG_NARGS(args))(&_log_rec, ##args)                \
+      logger_bin_end(&_log_rec);                                                \
+   }                                                                            \
+}
+#else
 /**
  *  @def LOG()
  *  @brief LOG Macro used globally to log messages and errors
@@ -80,9 +345,13 @@ extern void logger_printf_fn(t_log_type type,
  */
 #define LOG(type, format, args...)                        \
 {                                                         \
-   	logger_printf_fn(type, #type + sizeof("LOG_")-1,      \
-                     __FILE__, __LINE__, format,          \
-                     ##args);                             \
+   if (LOG_ENABLED(type))                                 \
+   {                                                      \
+      logger_printf_fn(type, #type + sizeof("LOG_")-1,    \
+                       LOG_FILE, __LINE__, format,        \
+                       ##args);                           \
+   }                                                      \
 }
+#endif /* LOG_BINARY */
 
 #endif /* INC_LOGGER_H_ */
@@ -41,6 +41,8 @@ typedef enum
     MAIN_MENU_STATE_WAITING,
     RTC_MENU_STATE,
     RTC_MENU_STATE_WAITING,
+    LOG_MENU_STATE,
+    LOG_MENU_STATE_WAITING,
     END_RS_232_STATE
 }rs_232_menu_state_t;
 
@@ -50,6 +50,11 @@ extern uint16_t rs_232_tail;
 extern uint8_t rs_232_rx_index;
 extern uint8_t rs_232_rx_data[];
 
+#ifdef DEBUG_LOG
+/* Logger output */
+extern DMA_HandleTypeDef hdma_usart2_tx;
+#endif
+
 /* USER CODE END Private defines */
 
 void MX_USART2_UART_Init(void);
@@ -0,0 +1,102 @@
+/**
+  ******************************************************************************
+  * @file           : wall_clock.h
+  * @brief          : Header for wall_clock.c file.
+  * @note           : STM32CubeIDE Environment
+  ******************************************************************************
+  * @attention
+  *
+  * MIT License
+  *
+  * Copyright (c) 2024 Elray's Software LLC, elrays@sbcglobal.net
+  *
+  * Permission is hereby granted, free of charge, to any person obtaining a copy
+  * of this software and associated documentation files (the "Software"), to deal
+  * in the Software without restriction, including without limitation the rights
+  * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  * copies of the Software, and to permit persons to whom the Software is
+  * furnished to do so, subject to the following conditions:
+  *
+  * The above copyright notice and this permission notice shall be included in all
+  * copies or substantial portions of the Software.
+  *
+  * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  * SOFTWARE.
+  ******************************************************************************
+  */
+#ifndef INC_WALL_CLOCK_H_
+#define INC_WALL_CLOCK_H_
+
+#include <stdint.h>
+#include "ds3231.h"
+
+/**
+ *  @brief Resync from the RTC after this long without an SQW edge. Also keeps the
+ *         extrapolation well inside the 71 minute wrap of get_micros()
+ */
+#define WALL_CLOCK_RESYNC_MS        60000
+
+/**
+ *  @brief Least time between two RTC reads of wall_clock_poll(), so a failing or
+ *         unsynchronized RTC costs at most one bus transaction per second
+ */
+#define WALL_CLOCK_RETRY_MS         1000
+
+/**
+ *  @brief Worst case delay from the SQW falling edge to the EXTI0 timestamp
+ */
+#define WALL_CLOCK_EDGE_LATENCY_US  20
+
+/**
+ *  @brief Rate error assumed for the SysTick clock before it has been measured
+ *         against the SQW output (HSI factory tolerance)
+ */
+#define WALL_CLOCK_DRIFT_PPM_UNCAL  10000
+
+/**
+ *  @brief Rate error assumed once the SysTick clock has been measured against
+ *         the SQW output (DS3231 accuracy plus measurement residue)
+ */
+#define WALL_CLOCK_DRIFT_PPM_CAL    50
+
+/**
+ *  @brief Number of SQW edge intervals averaged before the rate counts as measured
+ */
+#define WALL_CLOCK_CAL_SAMPLES      8
+
+/**
+ *  @enum wall_clock_source
+ *  @brief What the current extrapolation is anchored to
+ */
+typedef enum
+{
+    WALL_CLOCK_UNSYNCED = 0,    /*!< no time yet */
+    WALL_CLOCK_SYNC_READ,       /*!< anchored to a register read, sub-second phase unknown */
+    WALL_CLOCK_SYNC_EDGE        /*!< anchored to an SQW edge, sub-second phase known */
+} wall_clock_source;
+
+/**
+ *  @struct wall_clock_time
+ *  @brief Extrapolated wall clock time
+ */
+typedef struct
+{
+    uint32_t seconds;           /*!< seconds since 1970-01-01 00:00:00 */
+    uint32_t micros;            /*!< 0 to 999999 */
+    uint32_t error_us;          /*!< bound of the extrapolation error in microseconds */
+    wall_clock_source source;   /*!< anchor of the extrapolation */
+} wall_clock_time;
+
+uint8_t wall_clock_init(ds3231_t *dev);
+uint8_t wall_clock_sync(void);
+void wall_clock_invalidate(void);
+void wall_clock_poll(void);
+void wall_clock_on_sqw(void);
+uint8_t wall_clock_now(wall_clock_time *now);
+
+#endif /* INC_WALL_CLOCK_H_ */
@@ -33,725 +33,1472 @@
   ******************************************************************************
   */
 
+#include <string.h>
 #include "ds3231.h"
+#include "ds3231_async.h"
+#include "get_time.h"
 #include "main.h"
 #ifdef __cplusplus
 extern "C"{
 #endif
 
-I2C_HandleTypeDef *_ds3231_ui2c;
+static uint8_t ds3231_mirror_read(ds3231_t *dev, uint8_t reg_addr, uint8_t *vals, uint16_t len);
+static uint8_t ds3231_read_regs_bus(ds3231_t *dev, uint8_t reg_addr, uint8_t *vals, uint16_t len);
+static void ds3231_mirror_patch(ds3231_t *dev, uint8_t reg_addr, const uint8_t *vals, uint16_t len);
+static void ds3231_conversion_complete(ds3231_request *request);
+static void ds3231_alarm_event_complete(ds3231_request *request);
+static void ds3231_alarm_event_deliver(ds3231_t *dev, uint8_t read_ok);
+
+/* BCD encoding of 0 to 99 */
+#define DS3231_BCD_ROW(t) 0x##t##0, 0x##t##1, 0x##t##2, 0x##t##3, 0x##t##4, \
+                          0x##t##5, 0x##t##6, 0x##t##7, 0x##t##8, 0x##t##9
+static const uint8_t _ds3231_bcd_table[100] =
+{
+    DS3231_BCD_ROW(0), DS3231_BCD_ROW(1), DS3231_BCD_ROW(2), DS3231_BCD_ROW(3), DS3231_BCD_ROW(4),
+    DS3231_BCD_ROW(5), DS3231_BCD_ROW(6), DS3231_BCD_ROW(7), DS3231_BCD_ROW(8), DS3231_BCD_ROW(9)
+};
+
+/**
+ * @brief Initializes the DS3231 module. Disables both alarms, clears their flags and selects alarm interrupt mode.
+ *        Every handle owns its bus, so devices on different I2C peripherals transfer concurrently.
+ * @param dev DS3231 handle, cleared and registered with the I2C completion callbacks.
+ * @param bus I2C handle, bus pins and re-initialization of the bus the device is on.
+ * @return 0 = success, otherwise = failure (no free instance slot or device not answering)
+ */
+uint8_t ds3231_init(ds3231_t *dev, const ds3231_bus_config *bus)
+{
+    uint8_t retval = 0;
+
+    memset(dev, 0, sizeof(*dev));
+    dev->bus = *bus;
+    dev->timeout_us = DS3231_TIMEOUT_US;
+    /* Transfer deadlines and bus times are counted in core clock cycles */
+    cycle_counter_init();
+    if (ds3231_attach(dev) != 0)
+    {
+        retval = 1;
+    }
+    else
+    {
+        /* Fastest I2C profile the device answers reliably at, Standard-mode if none does */
+        ds3231_select_bus_profile(dev, DS3231_BUS_PROFILE);
+#ifdef DS3231_SHADOW_REGS
+        if (ds3231_shadow_sync(dev) != 0)
+        {
+            retval = 1;
+        }
+        else
+#endif
+        if (ds3231_update_reg(dev, DS3231_REG_CONTROL,
+                              DS3231_FIELD_MASK(DS3231_F_INTCN) | DS3231_FIELD_MASK(DS3231_F_A2IE) | DS3231_FIELD_MASK(DS3231_F_A1IE),
+                              DS3231_FIELD_SET(DS3231_F_INTCN, DS3231_ALARM_INTERRUPT)) != 0)
+        {
+            retval = 1;
+        }
+        else if (DS3231_UPDATE_FIELDS(dev, DS3231_F_A2F, 0, DS3231_F_A1F, 0) != 0)
+        {
+            retval = 1;
+        }
+    }
+
+    return retval;
+}
+
+/**
+ * @brief Set the deadline of the blocking calls. A transfer that stays on the bus longer
+ *        fails, and the bus is recovered with nine SCL clocks, a STOP and a re-initialization.
+ * @param dev DS3231 handle.
+ * @param timeout_us Deadline in microseconds, 0 = DS3231_TIMEOUT_US.
+ * @return None
+ */
+void ds3231_set_timeout(ds3231_t *dev, uint32_t timeout_us)
+{
+    dev->timeout_us = (timeout_us != 0) ? timeout_us : DS3231_TIMEOUT_US;
+}
+
+/**
+ * @brief Get the deadline of the blocking calls.
+ * @param dev DS3231 handle.
+ * @return Deadline in microseconds.
+ */
+uint32_t ds3231_get_timeout(ds3231_t *dev)
+{
+    return dev->timeout_us;
+}
+
+/**
+ * @brief Check that the device answers reliably at the current I2C profile: DS3231_BUS_VERIFY_READS
+ *        reads of the whole register file must succeed, hold a valid time and agree on the alarm registers.
+ * @param dev DS3231 handle.
+ * @return 0 = reliable, otherwise = failure
+ */
+static uint8_t ds3231_verify_bus(ds3231_t *dev)
+{
+    uint8_t retval = 0;
+    uint8_t first[DS3231_REG_COUNT];
+    uint8_t regs[DS3231_REG_COUNT];
+    uint8_t *dst;
+    ds3231_datetime datetime;
+    uint8_t i;
+
+    for (i = 0; (i < DS3231_BUS_VERIFY_READS) && (retval == 0); i++)
+    {
+        dst = (i == 0) ? first : regs;
+        if ((ds3231_read_regs_bus(dev, DS3231_REG_SECOND, dst, DS3231_REG_COUNT) != 0) ||
+            (ds3231_decode_time_regs(dst, &datetime) != 0) ||
+            (memcmp(&first[DS3231_A1_SECOND], &dst[DS3231_A1_SECOND], DS3231_A2_DATE - DS3231_A1_SECOND + 1) != 0))
+        {
+            retval = 1;
+        }
+    }
+
+    return retval;
+}
+
+/**
+ * @brief Select the fastest I2C profile the device answers reliably at, starting from the preferred
+ *        one and falling back Fast 16:9, Fast 2:1, Standard.
+ * @param dev DS3231 handle.
+ * @param preferred Fastest profile to try.
+ * @return 0 = a profile passed, otherwise = none did and Standard-mode is left selected
+ */
+uint8_t ds3231_select_bus_profile(ds3231_t *dev, ds3231_bus_profile preferred)
+{
+    uint8_t retval = 1;
+    int32_t profile;
+
+    for (profile = (preferred < DS3231_BUS_PROFILE_COUNT) ? preferred : DS3231_BUS_STANDARD;
+         (profile >= DS3231_BUS_STANDARD) && (retval != 0);
+         profile--)
+    {
+        if ((ds3231_set_bus_profile(dev, (ds3231_bus_profile)profile) == 0) && (ds3231_verify_bus(dev) == 0))
+        {
+            retval = 0;
+        }
+    }
+
+    if (retval != 0)
+    {
+        ds3231_set_bus_profile(dev, DS3231_BUS_STANDARD);
+    }
+
+    return retval;
+}
+
+static uint8_t ds3231_bus_api_get_datetime(ds3231_t *dev)
+{
+    ds3231_datetime datetime;
+
+    return ds3231_get_datetime(dev, &datetime);
+}
+
+static uint8_t ds3231_bus_api_get_second(ds3231_t *dev)
+{
+    uint8_t second;
+
+    return ds3231_get_reg_byte(dev, DS3231_REG_SECOND, &second);
+}
+
+static uint8_t ds3231_bus_api_get_year(ds3231_t *dev)
+{
+    uint8_t regs[2];
+
+    return ds3231_read_regs(dev, DS3231_REG_MONTH, regs, sizeof(regs));
+}
+
+static uint8_t ds3231_bus_api_get_temperature(ds3231_t *dev)
+{
+    int16_t temperature;
+
+    return ds3231_get_temperature(dev, &temperature);
+}
+
+static uint8_t ds3231_bus_api_is_alarm_triggered(ds3231_t *dev)
+{
+    uint8_t status;
+
+    return ds3231_get_reg_byte(dev, DS3231_REG_STATUS, &status);
+}
+
+static uint8_t ds3231_bus_api_write_aging(ds3231_t *dev)
+{
+    return ds3231_set_reg_byte(dev, DS3231_AGING, dev->bus_aging);
+}
+
+static uint8_t ds3231_bus_api_read_all(ds3231_t *dev)
+{
+    uint8_t regs[DS3231_REG_COUNT];
+
+    return ds3231_read_regs(dev, DS3231_REG_SECOND, regs, DS3231_REG_COUNT);
+}
+
+/* APIs timed by ds3231_measure_bus_profile(), none of them changes the device state */
+static const struct
+{
+    const char *name;
+    uint8_t (*call)(ds3231_t *dev);
+} _ds3231_bus_apis[DS3231_BUS_API_COUNT] =
+{
+    { "get_datetime", ds3231_bus_api_get_datetime },
+    { "get_second", ds3231_bus_api_get_second },
+    { "get_year", ds3231_bus_api_get_year },
+    { "get_temperature", ds3231_bus_api_get_temperature },
+    { "is_alarm_triggered", ds3231_bus_api_is_alarm_triggered },
+    { "set_reg_byte", ds3231_bus_api_write_aging },
+    { "read_regs(19)", ds3231_bus_api_read_all }
+};
+
+/**
+ * @brief Measure the time of the driver APIs at one I2C profile. Each API is called DS3231_BUS_MEASURE_CALLS
+ *        times with the mirror bypassed, so every call goes to the bus. The previous profile is restored.
+ * @param dev DS3231 handle.
+ * @param profile Profile to measure.
+ * @param report Profile, SCL frequency derived from PCLK1 and the CCR divider, time per API.
+ * @return 0 = success, otherwise = failure (profile could not be set or device not answering)
+ * @note Thread context only. The aging register is written back with its own value.
+ */
+uint8_t ds3231_measure_bus_profile(ds3231_t *dev, ds3231_bus_profile profile, ds3231_bus_report *report)
+{
+    uint8_t retval = 0;
+    ds3231_bus_profile previous = ds3231_get_bus_profile(dev);
+    uint32_t start;
+    uint32_t us;
+    uint32_t total;
+    uint8_t api;
+    uint8_t i;
+
+    dev->mirror_bypass = 1;
+    if ((ds3231_set_bus_profile(dev, profile) != 0) || (ds3231_get_reg_byte(dev, DS3231_AGING, &dev->bus_aging) != 0))
+    {
+        retval = 1;
+    }
+    else
+    {
+        report->profile = profile;
+        report->clock_hz = ds3231_get_bus_clock(dev);
+
+        for (api = 0; api < DS3231_BUS_API_COUNT; api++)
+        {
+            report->api[api].name = _ds3231_bus_apis[api].name;
+            report->api[api].max_us = 0;
+            report->api[api].errors = 0;
+            total = 0;
+            for (i = 0; i < DS3231_BUS_MEASURE_CALLS; i++)
+            {
+                start = get_cycles();
+                if (_ds3231_bus_apis[api].call(dev) != 0)
+                {
+                    report->api[api].errors++;
+                }
+                us = cycles_to_micros(get_cycles() - start);
+                total += us;
+                if (us > report->api[api].max_us)
+                {
+                    report->api[api].max_us = us;
+                }
+            }
+            report->api[api].mean_us = total / DS3231_BUS_MEASURE_CALLS;
+        }
+    }
+    dev->mirror_bypass = 0;
+    ds3231_set_bus_profile(dev, previous);
+
+    return retval;
+}
 
 /**
- * @brief Initializes the DS3231 module. Set clock halt bit to 0 to start timing.
- * @param hi2c User I2C handle pointer.
+ * @brief Write consecutive DS3231 registers in one combined I2C transaction and wait for it.
+ *        The register pointer and the data go out in the same transfer, the pointer auto-increments.
+ *        Blocking wrapper over ds3231_submit(), see ds3231_async.h for the non-blocking interface.
+ * @param dev DS3231 handle.
+ * @param reg_addr First register address to write.
+ * @param vals Values to write.
+ * @param len Number of registers to write.
  * @return 0 = success, otherwise = failure
  */
-uint8_t ds3231_init(I2C_HandleTypeDef *hi2c)
+uint8_t ds3231_write_regs(ds3231_t *dev, uint8_t reg_addr, const uint8_t *vals, uint16_t len)
 {
     uint8_t retval = 0;
-	_ds3231_ui2c = hi2c;
-	if (ds3231_enable_alarm_1(DS3231_DISABLED) != 0)
-	{
-	    retval = 1;
-	}
-	else
-	{
-	    if (ds3231_enable_alarm_2(DS3231_DISABLED) != 0)
-	    {
-	        retval = 1;
-	    }
-	    else
-	    {
-	        if (ds3231_clear_alarm_1_flag() != 0)
-	        {
-	            retval = 1;
-	        }
-	        else
-	        {
-	            if (ds3231_clear_alarm_2_flag() != 0)
-	            {
-	                retval = 1;
-	            }
-	            else
-	            {
-	                if (ds3231_set_interrupt_mode(DS3231_ALARM_INTERRUPT) != 0)
-	                {
-	                    retval = 1;;
-	                }
-	            }
-	        }
-	    }
-	}
+    ds3231_request request = { DS3231_REQUEST_WRITE, reg_addr, (uint8_t *)vals, len, NULL, NULL, DS3231_REQUEST_IDLE, NULL,
+                               DS3231_OP_WRITE, dev->timeout_us, DS3231_PRIORITY_NORMAL, 0, 0 };
+
+    if ((ds3231_submit(dev, &request) != 0) || (ds3231_wait(dev, &request) != 0))
+    {
+        retval = 1;
+    }
+    else if (dev->mirror_enabled != 0)
+    {
+        ds3231_mirror_patch(dev, reg_addr, vals, len);
+    }
+    return retval;
+}
 
-	return retval;
+/**
+ * @brief Read consecutive DS3231 registers from the device, never from the mirror.
+ * @param dev DS3231 handle.
+ * @param reg_addr First register address to read.
+ * @param vals Values read from the registers.
+ * @param len Number of registers to read.
+ * @return 0 = success, otherwise = failure
+ */
+static uint8_t ds3231_read_regs_bus(ds3231_t *dev, uint8_t reg_addr, uint8_t *vals, uint16_t len)
+{
+    uint8_t retval = 0;
+    ds3231_request request = { DS3231_REQUEST_READ, reg_addr, vals, len, NULL, NULL, DS3231_REQUEST_IDLE, NULL,
+                               DS3231_OP_READ, dev->timeout_us, DS3231_PRIORITY_NORMAL, 0, 0 };
+
+    if ((ds3231_submit(dev, &request) != 0) || (ds3231_wait(dev, &request) != 0))
+    {
+        retval = 1;
+    }
+    return retval;
+}
+
+/**
+ * @brief Read consecutive DS3231 registers in one combined I2C transaction and wait for it.
+ *        The register pointer is sent, then a repeated START reads the data without releasing the bus.
+ *        Blocking wrapper over ds3231_submit(), see ds3231_async.h for the non-blocking interface.
+ *        Served from the register mirror without bus access when the mirror is enabled.
+ * @param dev DS3231 handle.
+ * @param reg_addr First register address to read.
+ * @param vals Values read from the registers.
+ * @param len Number of registers to read.
+ * @return 0 = success, otherwise = failure
+ */
+uint8_t ds3231_read_regs(ds3231_t *dev, uint8_t reg_addr, uint8_t *vals, uint16_t len)
+{
+    uint8_t retval = 0;
+
+    if ((dev->mirror_bypass != 0) || (ds3231_mirror_read(dev, reg_addr, vals, len) != 0))
+    {
+        retval = ds3231_read_regs_bus(dev, reg_addr, vals, len);
+    }
+    return retval;
+}
+
+/**
+ * @brief Publish a completed mirror refresh. Runs from the I2C/DMA completion interrupt.
+ * @param request The mirror refresh request, its context is the DS3231 handle.
+ */
+static void ds3231_mirror_complete(ds3231_request *request)
+{
+    ds3231_t *dev = (ds3231_t *)request->context;
+    uint32_t primask = __get_PRIMASK();
+    uint8_t deliver = 0;
+    uint8_t stale = 0;
+
+    __disable_irq();
+    if (request->status == DS3231_REQUEST_DONE)
+    {
+        memcpy(dev->mirror, dev->mirror_rx, DS3231_REG_COUNT);
+        dev->mirror_tick = HAL_GetTick();
+        dev->mirror_valid = 1;
+    }
+    /* back to even: no refresh in flight */
+    dev->mirror_generation++;
+
+    /* An alarm event waiting for this refresh takes the time and the flags from it, but only
+     * when the read started after the edge; an earlier read can miss a flag set on the edge */
+    if (dev->event_pending != 0)
+    {
+        if ((int32_t)(request->start_cycles - dev->event_cycles) < 0)
+        {
+            stale = 1;
+        }
+        else
+        {
+            dev->event_pending = 0;
+            deliver = 1;
+            if (request->status == DS3231_REQUEST_DONE)
+            {
+                memcpy(dev->event_regs, dev->mirror_rx, sizeof(dev->event_regs));
+            }
+        }
+    }
+    __set_PRIMASK(primask);
+
+    /* Read again for the event, or report it failed when no refresh can be queued */
+    if ((stale != 0) && (ds3231_mirror_refresh(dev) != 0))
+    {
+        __disable_irq();
+        dev->event_pending = 0;
+        __set_PRIMASK(primask);
+        ds3231_alarm_event_deliver(dev, 0);
+    }
+    else if (deliver != 0)
+    {
+        ds3231_alarm_event_deliver(dev, (request->status == DS3231_REQUEST_DONE) ? 1 : 0);
+    }
+}
+
+/**
+ * @brief Start a background refresh of the register mirror with one 19-byte DMA read.
+ *        Called from the SQW falling edge interrupt, when the seconds register has just changed.
+ * @param dev DS3231 handle.
+ * @return 0 = refresh queued, otherwise = mirror disabled or a refresh is already in flight
+ */
+uint8_t ds3231_mirror_refresh(ds3231_t *dev)
+{
+    uint8_t retval = 0;
+    uint32_t primask = __get_PRIMASK();
+
+    __disable_irq();
+    if ((dev->mirror_enabled == 0) || (dev->mirror_generation & 0x01))
+    {
+        retval = 1;
+    }
+    else
+    {
+        /* odd: refresh in flight */
+        dev->mirror_generation++;
+    }
+    __set_PRIMASK(primask);
+
+    if (retval == 0)
+    {
+        dev->mirror_request.dir = DS3231_REQUEST_READ;
+        dev->mirror_request.reg_addr = DS3231_REG_SECOND;
+        dev->mirror_request.data = dev->mirror_rx;
+        dev->mirror_request.len = DS3231_REG_COUNT;
+        dev->mirror_request.callback = ds3231_mirror_complete;
+        dev->mirror_request.context = dev;
+        dev->mirror_request.op = DS3231_OP_MIRROR;
+        dev->mirror_request.timeout_us = 0;
+        dev->mirror_request.priority = DS3231_PRIORITY_URGENT;
+        if (ds3231_submit(dev, &dev->mirror_request) != 0)
+        {
+            dev->mirror_generation++;
+            retval = 1;
+        }
+    }
+
+    return retval;
+}
+
+/**
+ * @brief Refresh the register mirror and deliver the alarm flags and the time from that same read,
+ *        then queue the clearing of the raised flags. Replaces ds3231_alarm_event() in the SQW
+ *        interrupt handler while the mirror is enabled, so each edge costs one register read.
+ * @param dev DS3231 handle.
+ * @param callback Receives the flags and the time from the I2C completion interrupt, may be NULL.
+ * @param context User data for the callback.
+ * @return 0 = queued, otherwise = mirror disabled or the previous event is still pending
+ */
+uint8_t ds3231_mirror_event(ds3231_t *dev, ds3231_alarm_callback callback, void *context)
+{
+    uint8_t retval = 0;
+    uint32_t edge = get_cycles();
+    uint32_t primask = __get_PRIMASK();
+
+    __disable_irq();
+    if ((dev->mirror_enabled == 0) || (dev->event_pending != 0))
+    {
+        retval = 1;
+    }
+    else
+    {
+        dev->event_callback = callback;
+        dev->event_context = context;
+        dev->event_cycles = edge;
+        dev->event_pending = 1;
+    }
+    __set_PRIMASK(primask);
+
+    /* A refresh already in flight takes the event when it completes: it delivers it when it
+     * started after the edge, otherwise it queues one more refresh for it */
+    if ((retval == 0) && (ds3231_mirror_refresh(dev) != 0))
+    {
+        __disable_irq();
+        if ((dev->event_pending != 0) && ((dev->mirror_generation & 0x01) == 0))
+        {
+            dev->event_pending = 0;
+            retval = 1;
+        }
+        __set_PRIMASK(primask);
+    }
+
+    return retval;
+}
+
+/**
+ * @brief Get the mirror generation counter. It is odd while a refresh is in flight and
+ *        advances by 2 with every published refresh.
+ * @param dev DS3231 handle.
+ * @return Generation counter.
+ */
+uint32_t ds3231_mirror_generation(ds3231_t *dev)
+{
+    return dev->mirror_generation;
+}
+
+/**
+ * @brief Enable the register mirror. Selects the 1Hz square wave on INT#/SQW so every falling edge
+ *        refreshes the mirror, and loads it once. Disabling returns INT#/SQW to alarm interrupt mode.
+ *        While enabled the alarm interrupts cannot be enabled; the alarm flags are read with the
+ *        mirror on every edge and reported by ds3231_mirror_event() instead.
+ * @param dev DS3231 handle.
+ * @param enable Enable, DS3231_ENABLED or DS3231_DISABLED.
+ * @return 0 = success, otherwise = failure
+ */
+uint8_t ds3231_mirror_enable(ds3231_t *dev, ds3231_state enable)
+{
+    uint8_t retval = 0;
+
+    dev->mirror_enabled = 0;
+    dev->mirror_valid = 0;
+    if (enable == DS3231_DISABLED)
+    {
+        retval = ds3231_set_interrupt_mode(dev, DS3231_ALARM_INTERRUPT);
+    }
+    else if (DS3231_UPDATE_FIELDS(dev, DS3231_F_INTCN, ds3231_SQUARE_WAVE_INTERRUPT, DS3231_F_RS, DS3231_1HZ) != 0)
+    {
+        retval = 1;
+    }
+    else
+    {
+        dev->mirror_enabled = 1;
+        if ((ds3231_mirror_refresh(dev) != 0) || (ds3231_wait(dev, &dev->mirror_request) != 0))
+        {
+            dev->mirror_enabled = 0;
+            retval = 1;
+        }
+    }
+
+    return retval;
+}
+
+/**
+ * @brief Check whether the register mirror is enabled.
+ * @param dev DS3231 handle.
+ * @return 1 = enabled, 0 = disabled
+ */
+uint8_t ds3231_is_mirror_enabled(ds3231_t *dev)
+{
+    return dev->mirror_enabled;
+}
+
+/**
+ * @brief Copy registers out of the mirror. Waits for a refresh that is in flight so the
+ *        values are never older than the last SQW edge.
+ * @param dev DS3231 handle.
+ * @param reg_addr First register address to read.
+ * @param vals Values read from the mirror.
+ * @param len Number of registers to read.
+ * @return 0 = served from the mirror, otherwise = the bus must be read
+ */
+static uint8_t ds3231_mirror_read(ds3231_t *dev, uint8_t reg_addr, uint8_t *vals, uint16_t len)
+{
+    uint8_t retval = 1;
+    uint32_t primask;
+
+    if ((dev->mirror_enabled != 0) && ((reg_addr + len) <= DS3231_REG_COUNT))
+    {
+        if (dev->mirror_generation & 0x01)
+        {
+            ds3231_wait(dev, &dev->mirror_request);
+        }
+
+        primask = __get_PRIMASK();
+        __disable_irq();
+        if ((dev->mirror_valid != 0) && ((HAL_GetTick() - dev->mirror_tick) <= DS3231_MIRROR_MAX_AGE_MS))
+        {
+            memcpy(vals, &dev->mirror[reg_addr], len);
+            retval = 0;
+        }
+        __set_PRIMASK(primask);
+    }
+
+    return retval;
+}
+
+/**
+ * @brief Apply a completed register write to the mirror so it stays coherent until the next refresh.
+ *        Status flags only change when written to 0, BSY is read-only.
+ * @param dev DS3231 handle.
+ * @param reg_addr First register address written.
+ * @param vals Values written.
+ * @param len Number of registers written.
+ */
+static void ds3231_mirror_patch(ds3231_t *dev, uint8_t reg_addr, const uint8_t *vals, uint16_t len)
+{
+    uint16_t i;
+    uint8_t reg;
+    uint32_t primask = __get_PRIMASK();
+
+    __disable_irq();
+    for (i = 0; i < len; i++)
+    {
+        reg = reg_addr + i;
+        if (reg == DS3231_REG_STATUS)
+        {
+            dev->mirror[reg] = (dev->mirror[reg] & vals[i] & DS3231_STATUS_FLAGS) |
+                                  (dev->mirror[reg] & DS3231_FIELD_MASK(DS3231_F_BSY)) |
+                                  (vals[i] & ~(DS3231_STATUS_FLAGS | DS3231_FIELD_MASK(DS3231_F_BSY)));
+        }
+        else if (reg < DS3231_TEMP_MSB)
+        {
+            dev->mirror[reg] = vals[i];
+        }
+    }
+    __set_PRIMASK(primask);
 }
 
 /**
  * @brief Set the byte in the designated DS3231 register to value.
+ * @param dev DS3231 handle.
  * @param reg_addr Register address to write.
  * @param val Value to set, 0 to 255.
  * @return 0 = success, otherwise = failure
  */
-uint8_t ds3231_set_reg_byte(uint8_t reg_addr, uint8_t val)
+uint8_t ds3231_set_reg_byte(ds3231_t *dev, uint8_t reg_addr, uint8_t val)
 {
-    uint8_t retval = 0;
-	uint8_t bytes[2] = { reg_addr, val };
-	if (HAL_I2C_Master_Transmit(_ds3231_ui2c, DS3231_I2C_ADDR << 1, bytes, 2, DS3231_TIMEOUT) != HAL_OK)
-	{
-	    retval = 1;
-	}
-	return retval;
+    return ds3231_write_regs(dev, reg_addr, &val, 1);
 }
 
 /**
  * @brief Gets the byte in the designated DS3231 register.
+ * @param dev DS3231 handle.
  * @param reg_addr Register address to read.
  * @param reg_value stored in the register, 0 to 255.
  * @return 0 = success, otherwise = failure
  */
-uint8_t ds3231_get_reg_byte(uint8_t reg_addr, uint8_t *reg_value)
+uint8_t ds3231_get_reg_byte(ds3231_t *dev, uint8_t reg_addr, uint8_t *reg_value)
 {
-    uint8_t retval = 0;
-	if (HAL_I2C_Master_Transmit(_ds3231_ui2c, DS3231_I2C_ADDR << 1, &reg_addr, 1, DS3231_TIMEOUT) != HAL_OK)
-	{
-	    retval = 1;
-	}
-	else
-	{
-	    if (HAL_I2C_Master_Receive(_ds3231_ui2c, DS3231_I2C_ADDR << 1, reg_value, 1, DS3231_TIMEOUT) != HAL_OK)
-	    {
-	        retval = 1;
-	    }
-	}
+    return ds3231_read_regs(dev, reg_addr, reg_value, 1);
+}
 
-	return retval;
+/**
+ * @brief Bring register values read from the device into the form that is safe to write back.
+ *        Status flags are set because writing 1 leaves them unchanged, BSY and CONV are cleared.
+ * @param reg_addr First register address of the values.
+ * @param vals Register values to adjust.
+ * @param len Number of registers.
+ */
+static void ds3231_cfg_normalize(uint8_t reg_addr, uint8_t *vals, uint8_t len)
+{
+    uint8_t i;
+
+    for (i = 0; i < len; i++)
+    {
+        if ((reg_addr + i) == DS3231_REG_CONTROL)
+        {
+            vals[i] = DS3231_FIELD_PUT(DS3231_F_CONV, vals[i], 0);
+        }
+        else if ((reg_addr + i) == DS3231_REG_STATUS)
+        {
+            vals[i] = DS3231_FIELD_PUT(DS3231_F_BSY, vals[i] | DS3231_STATUS_FLAGS, 0);
+        }
+    }
 }
 
+#ifdef DS3231_SHADOW_REGS
 /**
- * @brief Enables battery-backed square wave output at the INT#/SQW pin.
- * @param enable Enable, DS3231_ENABLED or DS3231_DISABLED.
+ * @brief Fill the shadow of registers 0x07 to 0x0f from the device in one transaction.
+ * @param dev DS3231 handle.
  * @return 0 = success, otherwise = failure
  */
-uint8_t ds3231_enable_battery_square_wave(ds3231_state enable)
+uint8_t ds3231_shadow_sync(ds3231_t *dev)
 {
     uint8_t retval = 0;
-	uint8_t control;
-	if (ds3231_get_reg_byte(DS3231_REG_CONTROL, &control) != 0)
-	{
-	    retval = 1;
-	}
-	else
-	{
-	    if (ds3231_set_reg_byte(DS3231_REG_CONTROL, (control & 0xbf) | ((enable & 0x01) << DS3231_BBSQW)) != 0)
-	    {
-	        retval = 1;
-	    }
-	}
 
-	return retval;
+    dev->shadow_valid = 0;
+    if (ds3231_read_regs_bus(dev, DS3231_SHADOW_FIRST, dev->shadow, DS3231_SHADOW_COUNT) != 0)
+    {
+        retval = 1;
+    }
+    else
+    {
+        ds3231_cfg_normalize(DS3231_SHADOW_FIRST, dev->shadow, DS3231_SHADOW_COUNT);
+        dev->shadow_valid = 1;
+    }
+
+    return retval;
 }
 
 /**
- * @brief Set the interrupt mode to either alarm interrupt or square wave interrupt.
- * @param mode Interrupt mode to set, DS3231_ALARM_INTERRUPT or DS3231_SQUARE_WAVE_INTERRUPT.
+ * @brief Mark the shadow stale, e.g. after the registers were written behind the driver's back.
+ *        The next configuration call resynchronizes it.
+ * @param dev DS3231 handle.
+ */
+void ds3231_shadow_invalidate(ds3231_t *dev)
+{
+    dev->shadow_valid = 0;
+}
+
+/**
+ * @brief Compare the shadow with the device. A mismatch resynchronizes the shadow.
+ * @param dev DS3231 handle.
+ * @return 0 = shadow matches the device, otherwise = mismatch or failure
+ */
+uint8_t ds3231_shadow_verify(ds3231_t *dev)
+{
+    uint8_t retval = 0;
+    uint8_t regs[DS3231_SHADOW_COUNT];
+
+    if (dev->shadow_valid == 0)
+    {
+        retval = 1;
+    }
+    else if (ds3231_read_regs_bus(dev, DS3231_SHADOW_FIRST, regs, DS3231_SHADOW_COUNT) != 0)
+    {
+        retval = 1;
+    }
+    else
+    {
+        ds3231_cfg_normalize(DS3231_SHADOW_FIRST, regs, DS3231_SHADOW_COUNT);
+        if (memcmp(regs, dev->shadow, DS3231_SHADOW_COUNT) != 0)
+        {
+            memcpy(dev->shadow, regs, DS3231_SHADOW_COUNT);
+            retval = 1;
+        }
+    }
+
+    return retval;
+}
+#endif /* DS3231_SHADOW_REGS */
+
+/**
+ * @brief Get the current values of configuration registers 0x07 to 0x0f, from the shadow when enabled.
+ * @param dev DS3231 handle.
+ * @param reg_addr First register address, DS3231_A1_SECOND to DS3231_REG_STATUS.
+ * @param vals Register values, in the form that is safe to write back.
+ * @param len Number of registers.
  * @return 0 = success, otherwise = failure
  */
-uint8_t ds3231_set_interrupt_mode(ds3231_interrupt_mode mode)
+static uint8_t ds3231_cfg_read(ds3231_t *dev, uint8_t reg_addr, uint8_t *vals, uint8_t len)
 {
     uint8_t retval = 0;
-	uint8_t control;
-	if (ds3231_get_reg_byte(DS3231_REG_CONTROL, &control) != 0)
-	{
-	    retval = 1;
-	}
-	else
-	{
-	    if (ds3231_set_reg_byte(DS3231_REG_CONTROL, (control & 0xfb) | ((mode & 0x01) << DS3231_INTCN)) != 0)
-	    {
-	        retval = 1;
-	    }
-	}
 
-	return retval;
+#ifdef DS3231_SHADOW_REGS
+    if ((dev->shadow_valid == 0) && (ds3231_shadow_sync(dev) != 0))
+    {
+        retval = 1;
+    }
+    else
+    {
+        memcpy(vals, &dev->shadow[reg_addr - DS3231_SHADOW_FIRST], len);
+    }
+#else
+    if (ds3231_read_regs(dev, reg_addr, vals, len) != 0)
+    {
+        retval = 1;
+    }
+    else
+    {
+        ds3231_cfg_normalize(reg_addr, vals, len);
+    }
+#endif
+
+    return retval;
 }
 
 /**
- * @brief Set frequency of the square wave output
- * @param rate Frequency to set, DS3231_1HZ, DS3231_1024HZ, DS3231_4096HZ or DS3231_8192HZ.
+ * @brief Write configuration registers 0x07 to 0x0f in one transaction and update the shadow when enabled.
+ * @param dev DS3231 handle.
+ * @param reg_addr First register address, DS3231_A1_SECOND to DS3231_REG_STATUS.
+ * @param vals Register values to write.
+ * @param len Number of registers.
  * @return 0 = success, otherwise = failure
  */
-uint8_t ds3231_set_rate_select(ds3231_rate rate)
+static uint8_t ds3231_cfg_write(ds3231_t *dev, uint8_t reg_addr, const uint8_t *vals, uint8_t len)
 {
     uint8_t retval = 0;
-	uint8_t control;
-	if (ds3231_get_reg_byte(DS3231_REG_CONTROL, &control) != 0)
-	{
-	    retval = 1;
-	}
-	else
-	{
-	    if (ds3231_set_reg_byte(DS3231_REG_CONTROL, (control & 0xe7) | ((rate & 0x03) << DS3231_RS1)) != 0)
-	    {
-	        retval = 1;
-	    }
-	}
 
-	return retval;
+    if (ds3231_write_regs(dev, reg_addr, vals, len) != 0)
+    {
+        retval = 1;
+#ifdef DS3231_SHADOW_REGS
+        /* the device state is unknown after a failed write */
+        dev->shadow_valid = 0;
+#endif
+    }
+#ifdef DS3231_SHADOW_REGS
+    else
+    {
+        memcpy(&dev->shadow[reg_addr - DS3231_SHADOW_FIRST], vals, len);
+        ds3231_cfg_normalize(reg_addr, &dev->shadow[reg_addr - DS3231_SHADOW_FIRST], len);
+#ifdef DS3231_SHADOW_VERIFY
+        if (ds3231_shadow_verify(dev) != 0)
+        {
+            retval = 1;
+        }
+#endif
+    }
+#endif
+
+    return retval;
 }
 
 /**
- * @brief Enables clock oscillator.
- * @param enable Enable, DS3231_ENABLED or DS3231_DISABLED.
+ * @brief Update some bits of one configuration register, a single write when the shadow is enabled.
+ * @param dev DS3231 handle.
+ * @param reg_addr Register address, DS3231_A1_SECOND to DS3231_REG_STATUS.
+ * @param mask Bits to change.
+ * @param val New value of the bits in mask.
  * @return 0 = success, otherwise = failure
  */
-uint8_t ds3231_enable_oscillator(ds3231_state enable)
+uint8_t ds3231_update_reg(ds3231_t *dev, uint8_t reg_addr, uint8_t mask, uint8_t val)
 {
     uint8_t retval = 0;
-	uint8_t control;
-	if (ds3231_get_reg_byte(DS3231_REG_CONTROL, &control) != 0)
-	{
-	    retval = 1;
-	}
-	else
-	{
-	    if (ds3231_set_reg_byte(DS3231_REG_CONTROL, (control & 0x7f) | ((!enable & 0x01) << DS3231_EOSC)) != 0)
-	    {
-	        retval = 1;
-	    }
-	}
-
-	return retval;
+    uint8_t reg_value;
+
+    if (ds3231_cfg_read(dev, reg_addr, &reg_value, 1) != 0)
+    {
+        retval = 1;
+    }
+    else
+    {
+        reg_value = (reg_value & ~mask) | (val & mask);
+        if (ds3231_cfg_write(dev, reg_addr, &reg_value, 1) != 0)
+        {
+            retval = 1;
+        }
+    }
+
+    return retval;
 }
 
 /**
- * @brief Enables alarm 2.
+ * @brief Enables battery-backed square wave output at the INT#/SQW pin.
+ * @param dev DS3231 handle.
  * @param enable Enable, DS3231_ENABLED or DS3231_DISABLED.
  * @return 0 = success, otherwise = failure
  */
-uint8_t ds3231_enable_alarm_2(ds3231_state enable)
+uint8_t ds3231_enable_battery_square_wave(ds3231_t *dev, ds3231_state enable)
 {
-    uint8_t retval = 0;
+    return DS3231_UPDATE_FIELD(dev, DS3231_F_BBSQW, enable);
+}
 
-	uint8_t control;
-	if (ds3231_get_reg_byte(DS3231_REG_CONTROL, &control) != 0)
-	{
-	    retval = 1;
-	}
-	else
-	{
-	    if (ds3231_set_reg_byte(DS3231_REG_CONTROL, (control & 0xfd) | ((enable & 0x01) << DS3231_A2IE)) != 0)
-	    {
-	        retval = 1;
-	    }
-	    else
-	    {
-	        if (ds3231_set_interrupt_mode(DS3231_ALARM_INTERRUPT) != 0)
-	        {
-	            retval = 1;
-	        }
-	    }
-	}
+/**
+ * @brief Set the interrupt mode to either alarm interrupt or square wave interrupt.
+ *        Alarm interrupt mode is refused while the register mirror is enabled, it would stop
+ *        the 1Hz square wave that refreshes the mirror and anchors the wall clock.
+ * @param dev DS3231 handle.
+ * @param mode Interrupt mode to set, DS3231_ALARM_INTERRUPT or DS3231_SQUARE_WAVE_INTERRUPT.
+ * @return 0 = success, otherwise = failure or mirror enabled
+ */
+uint8_t ds3231_set_interrupt_mode(ds3231_t *dev, ds3231_interrupt_mode mode)
+{
+    uint8_t retval = 1;
 
-	return retval;
+    if ((dev->mirror_enabled == 0) || (mode != DS3231_ALARM_INTERRUPT))
+    {
+        retval = DS3231_UPDATE_FIELD(dev, DS3231_F_INTCN, mode);
+    }
+
+    return retval;
+}
+
+/**
+ * @brief Set frequency of the square wave output
+ * @param dev DS3231 handle.
+ * @param rate Frequency to set, DS3231_1HZ, DS3231_1024HZ, DS3231_4096HZ or DS3231_8192HZ.
+ * @return 0 = success, otherwise = failure
+ */
+uint8_t ds3231_set_rate_select(ds3231_t *dev, ds3231_rate rate)
+{
+    return DS3231_UPDATE_FIELD(dev, DS3231_F_RS, rate);
+}
+
+/**
+ * @brief Enables clock oscillator.
+ * @param dev DS3231 handle.
+ * @param enable Enable, DS3231_ENABLED or DS3231_DISABLED.
+ * @return 0 = success, otherwise = failure
+ */
+uint8_t ds3231_enable_oscillator(ds3231_t *dev, ds3231_state enable)
+{
+    return DS3231_UPDATE_FIELD(dev, DS3231_F_EOSC, !enable);
+}
+
+/**
+ * @brief Enables alarm 2 and selects alarm interrupt mode in the same write.
+ *        Enabling is refused while the register mirror is enabled, see ds3231_enable_alarm_1.
+ *        Disabling then clears A2IE only.
+ * @param dev DS3231 handle.
+ * @param enable Enable, DS3231_ENABLED or DS3231_DISABLED.
+ * @return 0 = success, otherwise = failure or mirror enabled
+ */
+uint8_t ds3231_enable_alarm_2(ds3231_t *dev, ds3231_state enable)
+{
+    uint8_t retval = 1;
+
+    if (dev->mirror_enabled == 0)
+    {
+        retval = DS3231_UPDATE_FIELDS(dev, DS3231_F_A2IE, enable, DS3231_F_INTCN, DS3231_ALARM_INTERRUPT);
+    }
+    else if (enable == DS3231_DISABLED)
+    {
+        retval = DS3231_UPDATE_FIELD(dev, DS3231_F_A2IE, 0);
+    }
+
+    return retval;
 }
 
 /**
  * @brief Clears alarm 2 matched flag. Matched flags must be cleared before the next match or the next interrupt will be masked.
+ * @param dev DS3231 handle.
  * @return 0 = success, otherwise = failure
  */
-uint8_t ds3231_clear_alarm_2_flag(void)
+uint8_t ds3231_clear_alarm_2_flag(ds3231_t *dev)
 {
-    uint8_t retval = 0;
-	uint8_t status;
-	if (ds3231_get_reg_byte(DS3231_REG_STATUS, &status) != 0)
-	{
-	    retval = 1;
-	}
-	else
-	{
-	    status &= 0xfd;
-	    if (ds3231_set_reg_byte(DS3231_REG_STATUS, status & ~(0x01 << DS3231_A2F)) != 0)
-	    {
-	        retval = 1;
-	    }
-	}
-	return retval;
+    return DS3231_UPDATE_FIELD(dev, DS3231_F_A2F, 0);
 }
 
 /**
  * @brief Set alarm 2 minute to match. Does not change alarm 2 matching mode.
+ * @param dev DS3231 handle.
  * @param minute Minute, 0 to 59.
  * @return 0 = success, otherwise = failure
  */
-uint8_t ds3231_set_alarm_2_minute(uint8_t minute)
+uint8_t ds3231_set_alarm_2_minute(ds3231_t *dev, uint8_t minute)
 {
-    uint8_t retval = 0;
-	uint8_t temp_minute;
-	if (ds3231_get_reg_byte(DS3231_A2_MINUTE, &temp_minute) != 0)
-	{
-	    retval = 1;
-	}
-	temp_minute &= 0x80;
-	uint8_t a2m2 = temp_minute | (ds3231_encode_BCD(minute) & 0x3f);
-	if (ds3231_set_reg_byte(DS3231_A2_MINUTE, a2m2) != 0)
-	{
-	    retval = 1;
-	}
-
-	return retval;
+    return DS3231_UPDATE_FIELD(dev, DS3231_F_A2_MINUTE, ds3231_encode_BCD(minute));
 }
 
 /**
  * @brief Set alarm 2 hour to match. Does not change alarm 2 matching mode.
+ * @param dev DS3231 handle.
  * @param hour Hour to match in 24h format, 0 to 23.
  * @return 0 = success, otherwise = failure
  */
-uint8_t ds3231_set_alarm_2_hour(uint8_t hour_24mode)
+uint8_t ds3231_set_alarm_2_hour(ds3231_t *dev, uint8_t hour_24mode)
 {
-    uint8_t retval = 0;
-	uint8_t temp_hour;
-	if (ds3231_get_reg_byte(DS3231_A2_HOUR, &temp_hour) != 0)
-	{
-	    retval = 1;
-	}
-	else
-	{
-	    temp_hour &= 0x80;
-	    uint8_t a2m3 = temp_hour | (ds3231_encode_BCD(hour_24mode) & 0x3f);
-	    if (ds3231_set_reg_byte(DS3231_A2_HOUR, a2m3) != 0)
-	    {
-	        retval = 1;
-	    }
-	}
-
-	return retval;
+    return DS3231_UPDATE_FIELDS(dev, DS3231_F_A2_HOUR, ds3231_encode_BCD(hour_24mode), DS3231_F_A2_12_24, 0);
 }
 
 /**
  * @brief Set alarm 2 date. Alarm 2 can only be set to match either date or day. Does not change alarm 2 matching mode.
+ * @param dev DS3231 handle.
  * @param date Date, 0 to 31.
  * @return 0 = success, otherwise = failure
  */
-uint8_t ds3231_set_alarm_2_date(uint8_t date)
+uint8_t ds3231_set_alarm_2_date(ds3231_t *dev, uint8_t date)
 {
-    uint8_t retval = 0;
-	uint8_t temp_date;
-	if (ds3231_get_reg_byte(DS3231_A2_DATE, &temp_date) != 0)
-	{
-	    retval = 1;
-	}
-	else
-	{
-	    temp_date &= 0x80;
-	    uint8_t a2m4 = temp_date | (ds3231_encode_BCD(date) & 0x3f);
-	    if (ds3231_set_reg_byte(DS3231_A2_DATE, a2m4) != 0)
-	    {
-	        retval = 1;
-	    }
-	}
-
-	return retval;
+    return DS3231_UPDATE_FIELDS(dev, DS3231_F_A2_DAY_DATE, ds3231_encode_BCD(date), DS3231_F_A2_DYDT, 0);
 }
 
 /**
  * @brief Set alarm 2 day. Alarm 2 can only be set to match either date or day. Does not change alarm 2 matching mode.
+ * @param dev DS3231 handle.
  * @param day Days since last Sunday, 1 to 7.
  * @return 0 = success, otherwise = failure
  */
-uint8_t ds3231_set_alarm_2_day(uint8_t day)
+uint8_t ds3231_set_alarm_2_day(ds3231_t *dev, uint8_t day)
 {
-    uint8_t retval = 0;
-	uint8_t temp_day;
-	if (ds3231_get_reg_byte(DS3231_A2_DATE, &temp_day) != 0)
-	{
-	    retval  = 1;
-	}
-	else
-	{
-	    temp_day &= 0x80;
-	    uint8_t a2m4 = temp_day | (0x01 << DS3231_DYDT) | (ds3231_encode_BCD(day) & 0x3f);
-	    if (ds3231_set_reg_byte(DS3231_A2_DATE, a2m4) != 0)
-	    {
-	        retval = 1;
-	    }
-	}
-
-	return retval;
+    return DS3231_UPDATE_FIELDS(dev, DS3231_F_A2_DAY_DATE, ds3231_encode_BCD(day), DS3231_F_A2_DYDT, 1);
 }
 
 /**
- * @brief Set alarm 2 mode.
+ * @brief Set alarm 2 mode. Registers 0x0b to 0x0d are written back in one transaction.
+ * @param dev DS3231 handle.
  * @param alarm_mode Alarm 2 mode, DS3231_A2_EVERY_M, DS3231_A2_MATCH_M, DS3231_A2_MATCH_M_H, DS3231_A2_MATCH_M_H_DATE or DS3231_A2_MATCH_M_H_DAY.
  * @return 0 = success, otherwise = failure
  */
-uint8_t ds3231_set_alarm_2_mode(ds3231_alarm_2_mode alarm_mode)
+uint8_t ds3231_set_alarm_2_mode(ds3231_t *dev, ds3231_alarm_2_mode alarm_mode)
 {
     uint8_t retval = 0;
-	uint8_t temp_alarm_mode;
-	if (ds3231_get_reg_byte(DS3231_A1_MINUTE, &temp_alarm_mode) != 0)
-	{
-	    retval = 1;
-	}
-	else
-	{
-	    temp_alarm_mode &= 0x7f;
-	    if (ds3231_set_reg_byte(DS3231_A2_MINUTE, temp_alarm_mode | (((alarm_mode >> 0) & 0x01) << DS3231_AXMY)) != 0)
-	    {
-	        retval = 1;
-	    }
-	    else
-	    {
-	        uint8_t temp_hour;
-	        if (ds3231_get_reg_byte(DS3231_A1_HOUR, &temp_hour) != 0)
-	        {
-	            retval = 1;
-	        }
-	        else
-	        {
-	            temp_hour &= 0x7f;
-	            if (ds3231_set_reg_byte(DS3231_A2_HOUR, temp_hour | (((alarm_mode >> 1) & 0x01) << DS3231_AXMY)) != 0)
-	            {
-	                retval = 1;
-	            }
-	            else
-	            {
-	                uint8_t temp_date;
-	                if (ds3231_get_reg_byte(DS3231_A1_DATE, &temp_date) != 0)
-	                {
-	                    retval = 1;
-	                }
-	                else
-	                {
-	                    temp_date &= 0x7f;
-	                    if (ds3231_set_reg_byte(DS3231_A2_DATE,
-	                            temp_date |(((alarm_mode >> 2) & 0x01) << DS3231_AXMY) | (alarm_mode & 0x80)) != 0)
-	                    {
-	                        retval = 1;
-	                    }
-	                }
-	            }
-	        }
-	    }
-	}
-
-	return retval;
+    uint8_t regs[3];
+
+    if (ds3231_cfg_read(dev, DS3231_A2_MINUTE, regs, sizeof(regs)) != 0)
+    {
+        retval = 1;
+    }
+    else
+    {
+        regs[0] = DS3231_FIELD_PUT(DS3231_F_A2M2, regs[0], alarm_mode);
+        regs[1] = DS3231_FIELD_PUT(DS3231_F_A2M3, regs[1], alarm_mode >> 1);
+        regs[2] = DS3231_FIELD_PUT(DS3231_F_A2M4, regs[2], alarm_mode >> 2);
+        regs[2] = DS3231_FIELD_PUT(DS3231_F_A2_DYDT, regs[2], alarm_mode >> 7);
+        if (ds3231_cfg_write(dev, DS3231_A2_MINUTE, regs, sizeof(regs)) != 0)
+        {
+            retval = 1;
+        }
+    }
+
+    return retval;
 }
 
 /**
- * @brief Enables alarm 1.
+ * @brief Enables alarm 1 and selects alarm interrupt mode in the same write.
+ *        Enabling is refused while the register mirror is enabled: alarm interrupt mode would
+ *        stop the 1Hz square wave the mirror and the wall clock run on. The alarm flags still
+ *        set on a match without the interrupt, and ds3231_mirror_event() reports them on the
+ *        next edge. Call ds3231_mirror_enable(dev, DS3231_DISABLED) first to get the alarm on
+ *        INT#/SQW instead. Disabling clears A1IE only while the mirror is enabled.
+ * @param dev DS3231 handle.
  * @param enable Enable, DS3231_ENABLED or DS3231_DISABLED.
- * @return 0 = success, otherwise = failure
+ * @return 0 = success, otherwise = failure or mirror enabled
  */
-uint8_t ds3231_enable_alarm_1(ds3231_state enable)
+uint8_t ds3231_enable_alarm_1(ds3231_t *dev, ds3231_state enable)
 {
-    uint8_t retval = 0;
-	uint8_t control;
-	if (ds3231_get_reg_byte(DS3231_REG_CONTROL, &control) != 0)
-	{
-	    retval = 1;
-	}
-	else
-	{
-	    if (ds3231_set_reg_byte(DS3231_REG_CONTROL, (control & 0xfe) | ((enable & 0x01) << DS3231_A1IE)) != 0)
-	    {
-	        retval = 1;
-	    }
-	    else
-	    {
-	        if (ds3231_set_interrupt_mode(DS3231_ALARM_INTERRUPT) != 0)
-	        {
-	            retval = 1;
-	        }
-	    }
-	}
-
-	return retval;
+    uint8_t retval = 1;
+
+    if (dev->mirror_enabled == 0)
+    {
+        retval = DS3231_UPDATE_FIELDS(dev, DS3231_F_A1IE, enable, DS3231_F_INTCN, DS3231_ALARM_INTERRUPT);
+    }
+    else if (enable == DS3231_DISABLED)
+    {
+        retval = DS3231_UPDATE_FIELD(dev, DS3231_F_A1IE, 0);
+    }
+
+    return retval;
 }
 
 /**
  * @brief Clears alarm 1 matched flag. Matched flags must be cleared before the next match or the next interrupt will be masked.
+ * @param dev DS3231 handle.
  * @return 0 = success, otherwise = failure
  */
-uint8_t ds3231_clear_alarm_1_flag(void)
+uint8_t ds3231_clear_alarm_1_flag(ds3231_t *dev)
 {
-    uint8_t retval = 0;
-	uint8_t status;
-	if (ds3231_get_reg_byte(DS3231_REG_STATUS, &status) != 0)
-	{
-	    retval = 1;
-	}
-	else
-	{
-	    status &= 0xfe;
-	    if (ds3231_set_reg_byte(DS3231_REG_STATUS, status & ~(0x01 << DS3231_A1F)) != 0)
-	    {
-	        retval = 1;
-	    }
-	}
-	return retval;
+    return DS3231_UPDATE_FIELD(dev, DS3231_F_A1F, 0);
 }
 
 /**
  * @brief Set alarm 1 second to match. Does not change alarm 1 matching mode.
+ * @param dev DS3231 handle.
  * @param second Second, 0 to 59.
  * @return 0 = success, otherwise = failure
  */
-uint8_t ds3231_set_alarm_1_second(uint8_t second)
+uint8_t ds3231_set_alarm_1_second(ds3231_t *dev, uint8_t second)
 {
-    uint8_t retval = 0;
-	uint8_t temp_second;
-	if (ds3231_get_reg_byte(DS3231_A1_SECOND, &temp_second) != 0)
-	{
-	    retval = 1;
-	}
-	else
-	{
-	    temp_second &= 0x80;
-	    uint8_t a1m1 = temp_second | (ds3231_encode_BCD(second) & 0x3f);
-	    if (ds3231_set_reg_byte(DS3231_A1_SECOND, a1m1) != 0)
-	    {
-	        retval = 1;
-	    }
-	}
-	return retval;
+    return DS3231_UPDATE_FIELD(dev, DS3231_F_A1_SECOND, ds3231_encode_BCD(second));
 }
 
 /**
  * @brief Set alarm 1 minute to match. Does not change alarm 1 matching mode.
+ * @param dev DS3231 handle.
  * @param minute Minute, 0 to 59.
  * @return 0 = success, otherwise = failure
  */
-uint8_t ds3231_set_alarm_1_minute(uint8_t minute)
+uint8_t ds3231_set_alarm_1_minute(ds3231_t *dev, uint8_t minute)
 {
-    uint8_t retval = 0;
-	uint8_t temp_minute;
-	if (ds3231_get_reg_byte(DS3231_A1_MINUTE, &temp_minute) != 0)
-	{
-	    retval = 1;
-	}
-	else
-	{
-	    temp_minute &= 0x80;
-	    uint8_t a1m2 = temp_minute | (ds3231_encode_BCD(minute) & 0x3f);
-	    if (ds3231_set_reg_byte(DS3231_A1_MINUTE, a1m2) != 0)
-	    {
-	        retval = 1;
-	    }
-	}
-	return retval;
+    return DS3231_UPDATE_FIELD(dev, DS3231_F_A1_MINUTE, ds3231_encode_BCD(minute));
 }
 
 /**
  * @brief Set alarm 1 hour to match. Does not change alarm 1 matching mode.
+ * @param dev DS3231 handle.
  * @param hour Hour, 0 to 59.
  * @return 0 = success, otherwise = failure
  */
-uint8_t ds3231_set_alarm_1_hour(uint8_t hour_24mode)
+uint8_t ds3231_set_alarm_1_hour(ds3231_t *dev, uint8_t hour_24mode)
 {
-    uint8_t retval = 0;
-	uint8_t temp_hour;
-	if (ds3231_get_reg_byte(DS3231_A1_HOUR, &temp_hour) != 0)
-	{
-	    retval = 1;
-	}
-	else
-	{
-	    temp_hour &= 0x80;
-	    uint8_t a1m3 = temp_hour | (ds3231_encode_BCD(hour_24mode) & 0x3f);
-	    if (ds3231_set_reg_byte(DS3231_A1_HOUR, a1m3) != 0)
-	    {
-	        retval = 1;
-	    }
-	}
-
-	return retval;
+    return DS3231_UPDATE_FIELDS(dev, DS3231_F_A1_HOUR, ds3231_encode_BCD(hour_24mode), DS3231_F_A1_12_24, 0);
 }
 
 /**
  * @brief Set alarm 1 date. Alarm 1 can only be set to match either date or day. Does not change alarm 1 matching mode.
+ * @param dev DS3231 handle.
  * @param date Date, 0 to 31.
  * @return 0 = success, otherwise = failure
  */
-uint8_t ds3231_set_alarm_1_date(uint8_t date)
+uint8_t ds3231_set_alarm_1_date(ds3231_t *dev, uint8_t date)
 {
-    uint8_t retval = 0;
-	uint8_t temp_date;
-	if (ds3231_get_reg_byte(DS3231_A1_DATE, &temp_date) != 0)
-	{
-	    retval = 1;
-	}
-	else
-	{
-	    temp_date &= 0x80;
-	    uint8_t a1m4 = temp_date | (ds3231_encode_BCD(date) & 0x3f);
-	    if (ds3231_set_reg_byte(DS3231_A1_DATE, a1m4) != 0)
-	    {
-	        retval = 1;
-	    }
-	}
-
-	return retval;
+    return DS3231_UPDATE_FIELDS(dev, DS3231_F_A1_DAY_DATE, ds3231_encode_BCD(date), DS3231_F_A1_DYDT, 0);
 }
 
 /**
  * @brief Set alarm 1 day. Alarm 1 can only be set to match either date or day. Does not change alarm 1 matching mode.
+ * @param dev DS3231 handle.
  * @param day Days since last Sunday, 1 to 7.
  * @return 0 = success, otherwise = failure
  */
-uint8_t ds3231_set_alarm_1_day(uint8_t day)
+uint8_t ds3231_set_alarm_1_day(ds3231_t *dev, uint8_t day)
+{
+    return DS3231_UPDATE_FIELDS(dev, DS3231_F_A1_DAY_DATE, ds3231_encode_BCD(day), DS3231_F_A1_DYDT, 1);
+}
+
+/**
+ * @brief Set alarm 1 mode. Registers 0x07 to 0x0a are written back in one transaction.
+ * @param dev DS3231 handle.
+ * @param alarm_mode Alarm 1 mode, DS3231_A1_EVERY_S, DS3231_A1_MATCH_S, DS3231_A1_MATCH_S_M, DS3231_A1_MATCH_S_M_H, DS3231_A1_MATCH_S_M_H_DATE or DS3231_A1_MATCH_S_M_H_DAY.
+ * @return 0 = success, otherwise = failure
+ */
+uint8_t ds3231_set_alarm_1_mode(ds3231_t *dev, ds3231_alarm_1_mode alarm_mode)
 {
     uint8_t retval = 0;
-	uint8_t temp_day;
-	if (ds3231_get_reg_byte(DS3231_A1_DATE, &temp_day) != 0)
-	{
-	    retval = 1;
-	}
-	else
-	{
-	    temp_day &= 0x80;
-	    uint8_t a1m4 = temp_day | (0x01 << DS3231_DYDT) | (ds3231_encode_BCD(day) & 0x3f);
-	    if (ds3231_set_reg_byte(DS3231_A1_DATE, a1m4) != 0)
-	    {
-	        retval = 1;
-	    }
-	}
+    uint8_t regs[4];
+
+    if (ds3231_cfg_read(dev, DS3231_A1_SECOND, regs, sizeof(regs)) != 0)
+    {
+        retval = 1;
+    }
+    else
+    {
+        regs[0] = DS3231_FIELD_PUT(DS3231_F_A1M1, regs[0], alarm_mode);
+        regs[1] = DS3231_FIELD_PUT(DS3231_F_A1M2, regs[1], alarm_mode >> 1);
+        regs[2] = DS3231_FIELD_PUT(DS3231_F_A1M3, regs[2], alarm_mode >> 2);
+        regs[3] = DS3231_FIELD_PUT(DS3231_F_A1M4, regs[3], alarm_mode >> 3);
+        regs[3] = DS3231_FIELD_PUT(DS3231_F_A1_DYDT, regs[3], alarm_mode >> 7);
+        if (ds3231_cfg_write(dev, DS3231_A1_SECOND, regs, sizeof(regs)) != 0)
+        {
+            retval = 1;
+        }
+    }
+
+    return retval;
+}
 
-	return retval;
+/**
+ * @brief Commit an encoded alarm block without letting the alarm fire on a half-written match pattern.
+ *        The alarm interrupt is masked while the block is written, the alarm flag is cleared, then the
+ *        interrupt enable is restored, also when the block or the flag write fails.
+ * @param dev DS3231 handle.
+ * @param reg_addr First register of the alarm block.
+ * @param regs Encoded alarm registers.
+ * @param len Number of alarm registers.
+ * @param ie_bit Alarm interrupt enable bit in the control register.
+ * @param flag_bit Alarm flag bit in the status register.
+ * @return 0 = success, otherwise = failure
+ */
+static uint8_t ds3231_commit_alarm(ds3231_t *dev, uint8_t reg_addr, const uint8_t *regs, uint8_t len, uint8_t ie_bit, uint8_t flag_bit)
+{
+    uint8_t retval = 0;
+    uint8_t control;
+    uint8_t masked;
+
+    if (ds3231_cfg_read(dev, DS3231_REG_CONTROL, &control, 1) != 0)
+    {
+        retval = 1;
+    }
+    else
+    {
+        masked = control & ~(0x01 << ie_bit);
+        if ((masked != control) && (ds3231_cfg_write(dev, DS3231_REG_CONTROL, &masked, 1) != 0))
+        {
+            retval = 1;
+        }
+        else
+        {
+            if (ds3231_cfg_write(dev, reg_addr, regs, len) != 0)
+            {
+                retval = 1;
+            }
+            else if (ds3231_update_reg(dev, DS3231_REG_STATUS, 0x01 << flag_bit, 0) != 0)
+            {
+                retval = 1;
+            }
+
+            /* Restore the interrupt enable even when the block or the flag write failed */
+            if ((masked != control) && (ds3231_cfg_write(dev, DS3231_REG_CONTROL, &control, 1) != 0))
+            {
+                retval = 1;
+            }
+        }
+    }
+
+    return retval;
 }
 
 /**
- * @brief Set alarm 1 mode.
- * @param alarm_mode Alarm 1 mode, DS3231_A1_EVERY_S, DS3231_A1_MATCH_S, DS3231_A1_MATCH_S_M, DS3231_A1_MATCH_S_M_H, DS3231_A1_MATCH_S_M_H_DATE or DS3231_A1_MATCH_S_M_H_DAY.
+ * @brief Validate an alarm 1 configuration and encode registers 0x07 to 0x0a into config->regs.
+ *        Fields the mode does not match on are not checked and are encoded as 0.
+ * @param config Alarm 1 configuration.
+ * @return 0 = success, otherwise = invalid configuration
+ */
+uint8_t ds3231_stage_alarm_1(ds3231_alarm_1_config *config)
+{
+    uint8_t retval = 0;
+    uint8_t mode = config->mode;
+    uint8_t max_day_date = (mode == DS3231_A1_MATCH_S_M_H_DAY) ? 7 : 31;
+
+    if ((mode != DS3231_A1_EVERY_S) && (mode != DS3231_A1_MATCH_S) && (mode != DS3231_A1_MATCH_S_M) &&
+        (mode != DS3231_A1_MATCH_S_M_H) && (mode != DS3231_A1_MATCH_S_M_H_DATE) && (mode != DS3231_A1_MATCH_S_M_H_DAY))
+    {
+        retval = 1;
+    }
+    else if ((!(mode & 0x01) && (config->second > 59)) ||
+             (!(mode & 0x02) && (config->minute > 59)) ||
+             (!(mode & 0x04) && (config->hour > 23)) ||
+             (!(mode & 0x08) && ((config->day_date < 1) || (config->day_date > max_day_date))))
+    {
+        retval = 1;
+    }
+    else
+    {
+        config->regs[0] = (mode & 0x01) ? DS3231_FIELD_SET(DS3231_F_A1M1, 1) : ds3231_encode_BCD(config->second);
+        config->regs[1] = (mode & 0x02) ? DS3231_FIELD_SET(DS3231_F_A1M2, 1) : ds3231_encode_BCD(config->minute);
+        config->regs[2] = (mode & 0x04) ? DS3231_FIELD_SET(DS3231_F_A1M3, 1) : ds3231_encode_BCD(config->hour);
+        config->regs[3] = (mode & 0x08) ? DS3231_FIELD_SET(DS3231_F_A1M4, 1) : ds3231_encode_BCD(config->day_date);
+        config->regs[3] |= DS3231_FIELD_SET(DS3231_F_A1_DYDT, mode >> 7);
+    }
+
+    return retval;
+}
+
+/**
+ * @brief Write a staged alarm 1 configuration with one burst write of registers 0x07 to 0x0a.
+ * @param dev DS3231 handle.
+ * @param config Alarm 1 configuration encoded by ds3231_stage_alarm_1.
  * @return 0 = success, otherwise = failure
  */
-uint8_t ds3231_set_alarm_1_mode(ds3231_alarm_1_mode alarm_mode)
+uint8_t ds3231_commit_alarm_1(ds3231_t *dev, const ds3231_alarm_1_config *config)
+{
+    return ds3231_commit_alarm(dev, DS3231_A1_SECOND, config->regs, sizeof(config->regs), DS3231_A1IE, DS3231_A1F);
+}
+
+/**
+ * @brief Validate an alarm 2 configuration and encode registers 0x0b to 0x0d into config->regs.
+ *        Fields the mode does not match on are not checked and are encoded as 0.
+ * @param config Alarm 2 configuration.
+ * @return 0 = success, otherwise = invalid configuration
+ */
+uint8_t ds3231_stage_alarm_2(ds3231_alarm_2_config *config)
 {
     uint8_t retval = 0;
-	uint8_t temp_alarm_mode;
-	if (ds3231_get_reg_byte(DS3231_A1_SECOND, &temp_alarm_mode) != 0)
-	{
-	    retval = 1;
-	}
-	else
-	{
-	    temp_alarm_mode &= 0x7f;
-	    if (ds3231_set_reg_byte(DS3231_A1_SECOND, temp_alarm_mode | (((alarm_mode >> 0) & 0x01) << DS3231_AXMY)) != 0)
-	    {
-	        retval = 1;
-	    }
-	    else
-	    {
-	        if (ds3231_get_reg_byte(DS3231_A1_MINUTE, &temp_alarm_mode) != 0)
-	        {
-	            retval = 1;
-	        }
-	        else
-	        {
-	            temp_alarm_mode &= 0x7f;
-	            if (ds3231_set_reg_byte(DS3231_A1_MINUTE, temp_alarm_mode | (((alarm_mode >> 1) & 0x01) << DS3231_AXMY)) != 0)
-	            {
-	                retval = 1;
-	            }
-	            else
-	            {
-	                if (ds3231_get_reg_byte(DS3231_A1_HOUR, &temp_alarm_mode) != 0)
-	                {
-	                    retval = 1;
-	                }
-	                else
-	                {
-	                    temp_alarm_mode &= 0x7f;
-	                    if (ds3231_set_reg_byte(DS3231_A1_HOUR, temp_alarm_mode | (((alarm_mode >> 2) & 0x01) << DS3231_AXMY)) != 0)
-	                    {
-	                        retval = 1;
-	                    }
-	                    else
-	                    {
-	                        if (ds3231_get_reg_byte(DS3231_A1_DATE, &temp_alarm_mode) != 0)
-	                        {
-	                            retval = 1;
-	                        }
-	                        else
-	                        {
-	                            temp_alarm_mode &= 0x7f;
-	                            if (ds3231_set_reg_byte(DS3231_A1_DATE, temp_alarm_mode | (((alarm_mode >> 3) & 0x01) << DS3231_AXMY) | (alarm_mode & 0x80)) != 0)
-	                            {
-	                                retval = 1;
-	                            }
-	                        }
-	                    }
-	                }
-	            }
-	        }
-	    }
-	}
+    uint8_t mode = config->mode;
+    uint8_t max_day_date = (mode == DS3231_A2_MATCH_M_H_DAY) ? 7 : 31;
+
+    if ((mode != DS3231_A2_EVERY_M) && (mode != DS3231_A2_MATCH_M) && (mode != DS3231_A2_MATCH_M_H) &&
+        (mode != DS3231_A2_MATCH_M_H_DATE) && (mode != DS3231_A2_MATCH_M_H_DAY))
+    {
+        retval = 1;
+    }
+    else if ((!(mode & 0x01) && (config->minute > 59)) ||
+             (!(mode & 0x02) && (config->hour > 23)) ||
+             (!(mode & 0x04) && ((config->day_date < 1) || (config->day_date > max_day_date))))
+    {
+        retval = 1;
+    }
+    else
+    {
+        config->regs[0] = (mode & 0x01) ? DS3231_FIELD_SET(DS3231_F_A2M2, 1) : ds3231_encode_BCD(config->minute);
+        config->regs[1] = (mode & 0x02) ? DS3231_FIELD_SET(DS3231_F_A2M3, 1) : ds3231_encode_BCD(config->hour);
+        config->regs[2] = (mode & 0x04) ? DS3231_FIELD_SET(DS3231_F_A2M4, 1) : ds3231_encode_BCD(config->day_date);
+        config->regs[2] |= DS3231_FIELD_SET(DS3231_F_A2_DYDT, mode >> 7);
+    }
+
+    return retval;
+}
 
-	return retval;
+/**
+ * @brief Write a staged alarm 2 configuration with one burst write of registers 0x0b to 0x0d.
+ * @param dev DS3231 handle.
+ * @param config Alarm 2 configuration encoded by ds3231_stage_alarm_2.
+ * @return 0 = success, otherwise = failure
+ */
+uint8_t ds3231_commit_alarm_2(ds3231_t *dev, const ds3231_alarm_2_config *config)
+{
+    return ds3231_commit_alarm(dev, DS3231_A2_MINUTE, config->regs, sizeof(config->regs), DS3231_A2IE, DS3231_A2F);
 }
 
 /**
  * @brief Check whether the clock oscillator is stopped.
+ * @param dev DS3231 handle.
  * @return Oscillator stopped flag (OSF) bit, 0 or 1.
  */
-uint8_t ds3231_is_oscillator_stopped(void)
+uint8_t ds3231_is_oscillator_stopped(ds3231_t *dev)
 {
     uint8_t oscillator_stopped = 0;
-	ds3231_get_reg_byte(DS3231_REG_STATUS, &oscillator_stopped);
-	oscillator_stopped = (oscillator_stopped >> DS3231_OSF) & 0x01;
+	ds3231_get_reg_byte(dev, DS3231_REG_STATUS, &oscillator_stopped);
+	oscillator_stopped = DS3231_FIELD_GET(DS3231_F_OSF, oscillator_stopped);
 
 	return oscillator_stopped;
 }
 
 /**
  * @brief Check whether the 32kHz output is enabled.
+ * @param dev DS3231 handle.
  * @return EN32kHz flag bit, 0 or 1.
  */
-uint8_t ds3231_is_32kHz_enabled(void)
+uint8_t ds3231_is_32kHz_enabled(ds3231_t *dev)
 {
     uint8_t is_32khz_enabled = 0;
 
-	ds3231_get_reg_byte(DS3231_REG_STATUS, &is_32khz_enabled);
-	is_32khz_enabled = (is_32khz_enabled >> DS3231_EN32KHZ) & 0x01;
+    ds3231_cfg_read(dev, DS3231_REG_STATUS, &is_32khz_enabled, 1);
+    is_32khz_enabled = DS3231_FIELD_GET(DS3231_F_EN32KHZ, is_32khz_enabled);
 
-	return is_32khz_enabled;
+    return is_32khz_enabled;
 }
 
 /**
  * @brief Check if alarm 1 is triggered.
+ * @param dev DS3231 handle.
  * @return A1F flag bit, 0 or 1.
  */
-uint8_t ds3231_is_alarm_1_triggered(void)
+uint8_t ds3231_is_alarm_1_triggered(ds3231_t *dev)
 {
     uint8_t is_alarm1_triggered = 0;
 
-	ds3231_get_reg_byte(DS3231_REG_STATUS, &is_alarm1_triggered);
-	is_alarm1_triggered = (is_alarm1_triggered>> DS3231_A1F) & 0x01;
+	ds3231_get_reg_byte(dev, DS3231_REG_STATUS, &is_alarm1_triggered);
+	is_alarm1_triggered = DS3231_FIELD_GET(DS3231_F_A1F, is_alarm1_triggered);
 
 	return is_alarm1_triggered;
 }
 
 /**
  * @brief Check if alarm 2 is triggered.
+ * @param dev DS3231 handle.
  * @return A2F flag bit, 0 or 1.
  */
-uint8_t ds3231_is_alarm_2_triggered(void)
+uint8_t ds3231_is_alarm_2_triggered(ds3231_t *dev)
 {
     uint8_t is_alarm2_triggered = 0;
 
-	ds3231_get_reg_byte(DS3231_REG_STATUS, &is_alarm2_triggered);
-	is_alarm2_triggered = (is_alarm2_triggered >> DS3231_A2F) & 0x01;
+	ds3231_get_reg_byte(dev, DS3231_REG_STATUS, &is_alarm2_triggered);
+	is_alarm2_triggered = DS3231_FIELD_GET(DS3231_F_A2F, is_alarm2_triggered);
 
 	return is_alarm2_triggered;
 }
 
+/**
+ * @brief Report the alarm flags and the time in dev->event_regs, and queue the clearing of the
+ *        raised flags. Runs from the I2C/DMA completion interrupt.
+ * @param dev DS3231 handle.
+ * @param read_ok 1 = dev->event_regs holds registers 0x00 to 0x0f, 0 = they could not be read.
+ */
+static void ds3231_alarm_event_deliver(ds3231_t *dev, uint8_t read_ok)
+{
+    ds3231_request *request = &dev->event_request;
+    uint8_t *status_reg = &dev->event_regs[DS3231_REG_STATUS];
+    uint8_t flags = 0;
+    uint8_t status = 1;
+    ds3231_datetime datetime = { 0 };
+
+    if (read_ok != 0)
+    {
+        flags = *status_reg & (DS3231_FIELD_MASK(DS3231_F_A2F) | DS3231_FIELD_MASK(DS3231_F_A1F));
+        status = ds3231_decode_time_regs(dev->event_regs, &datetime);
+        /* A clearing write still in flight covers these flags too */
+        if ((flags != 0) && (request->status != DS3231_REQUEST_QUEUED) && (request->status != DS3231_REQUEST_BUSY))
+        {
+            /* Only the raised flags are written as 0, the others as 1 so they stay */
+            *status_reg = (*status_reg | DS3231_STATUS_FLAGS) & ~(flags | DS3231_FIELD_MASK(DS3231_F_BSY));
+            request->dir = DS3231_REQUEST_WRITE;
+            request->reg_addr = DS3231_REG_STATUS;
+            request->data = status_reg;
+            request->len = 1;
+            request->callback = ds3231_alarm_event_complete;
+            request->context = dev;
+            request->op = DS3231_OP_WRITE;
+            request->timeout_us = 0;
+            request->priority = DS3231_PRIORITY_URGENT;
+            ds3231_submit(dev, request);
+        }
+    }
+    if (dev->event_callback != NULL)
+    {
+        dev->event_callback(dev, status, flags, &datetime, dev->event_context);
+    }
+}
+
+/**
+ * @brief Advance an alarm event when its read or its flag clearing write completes.
+ *        Runs from the I2C/DMA completion interrupt.
+ * @param request The event request, its context is the DS3231 handle.
+ */
+static void ds3231_alarm_event_complete(ds3231_request *request)
+{
+    ds3231_t *dev = (ds3231_t *)request->context;
+
+    if (request->dir == DS3231_REQUEST_WRITE)
+    {
+        if ((request->status == DS3231_REQUEST_DONE) && (dev->mirror_enabled != 0))
+        {
+            ds3231_mirror_patch(dev, DS3231_REG_STATUS, &dev->event_regs[DS3231_REG_STATUS], 1);
+        }
+    }
+    else
+    {
+        ds3231_alarm_event_deliver(dev, (request->status == DS3231_REQUEST_DONE) ? 1 : 0);
+    }
+}
+
+/**
+ * @brief Queue a read of the time and alarm flags, and the clearing of the raised flags, without
+ *        waiting for the bus. Meant for the INT#/SQW interrupt handler, which must not block on
+ *        the bus while thread context may be in the middle of a transfer.
+ * @param dev DS3231 handle.
+ * @param callback Receives the flags and the time from the I2C completion interrupt, may be NULL.
+ * @param context User data for the callback.
+ * @return 0 = queued, otherwise = the previous event is still in progress
+ */
+uint8_t ds3231_alarm_event(ds3231_t *dev, ds3231_alarm_callback callback, void *context)
+{
+    uint8_t retval = 0;
+    ds3231_request *request = &dev->event_request;
+
+    if ((request->status == DS3231_REQUEST_QUEUED) || (request->status == DS3231_REQUEST_BUSY))
+    {
+        retval = 1;
+    }
+    else
+    {
+        dev->event_callback = callback;
+        dev->event_context = context;
+        request->dir = DS3231_REQUEST_READ;
+        request->reg_addr = DS3231_REG_SECOND;
+        request->data = dev->event_regs;
+        request->len = sizeof(dev->event_regs);
+        request->callback = ds3231_alarm_event_complete;
+        request->context = dev;
+        request->op = DS3231_OP_READ;
+        request->timeout_us = 0;
+        request->priority = DS3231_PRIORITY_URGENT;
+        retval = ds3231_submit(dev, request);
+    }
+
+    return retval;
+}
+
+/**
+ * @brief Gets the complete date and time with one auto-incrementing read of registers 0x00 to 0x06.
+ *        All fields come from the same second, so the result cannot tear across a rollover.
+ * @param dev DS3231 handle.
+ * @param datetime Decoded date and time, hour in 24h format.
+ * @return 0 = success, otherwise = failure (bus error or corrupt register contents)
+ */
+uint8_t ds3231_get_datetime(ds3231_t *dev, ds3231_datetime *datetime)
+{
+    uint8_t retval = 0;
+    uint8_t regs[DS3231_TIME_REG_COUNT];
+
+    if ((ds3231_read_regs(dev, DS3231_REG_SECOND, regs, DS3231_TIME_REG_COUNT) != 0) ||
+        (ds3231_decode_time_regs(regs, datetime) != 0))
+    {
+        retval = 1;
+    }
+
+    return retval;
+}
+
+/**
+ * @brief Read the date, time and temperature with one burst read of registers 0x00 to 0x12,
+ *        so all fields belong to the same instant. Served from the mirror when it is enabled.
+ * @param dev DS3231 handle.
+ * @param snapshot Decoded date and time, hour in 24h format, and the temperature.
+ * @return 0 = success, otherwise = failure (bus error or corrupt register contents)
+ */
+uint8_t ds3231_get_snapshot(ds3231_t *dev, ds3231_snapshot *snapshot)
+{
+    uint8_t retval = 0;
+    uint8_t regs[DS3231_REG_COUNT];
+
+    if ((ds3231_read_regs(dev, DS3231_REG_SECOND, regs, DS3231_REG_COUNT) != 0) ||
+        (ds3231_decode_time_regs(regs, &snapshot->datetime) != 0))
+    {
+        retval = 1;
+    }
+    else
+    {
+        snapshot->temperature = ds3231_decode_temperature(&regs[DS3231_TEMP_MSB]);
+    }
+
+    return retval;
+}
+
 /**
  * @brief Gets the current day of week.
+ * @param dev DS3231 handle.
  * @return Days from last Sunday, 0 to 6.
  */
-uint8_t ds3231_get_day_of_week(void)
+uint8_t ds3231_get_day_of_week(ds3231_t *dev)
 {
     uint8_t day_of_week = 0;
-    ds3231_get_reg_byte(DS3231_REG_DOW, &day_of_week);
+    ds3231_get_reg_byte(dev, DS3231_REG_DOW, &day_of_week);
 	day_of_week = ds3231_decode_BCD(day_of_week);
 
 	return day_of_week;
@@ -759,13 +1506,14 @@ uint8_t ds3231_get_day_of_week(void)
 
 /**
  * @brief Gets the current day of month.
+ * @param dev DS3231 handle.
  * @return Day of month, 1 to 31.
  */
-uint8_t ds3231_get_date(void)
+uint8_t ds3231_get_date(ds3231_t *dev)
 {
     uint8_t day_of_month = 0;
 
-    ds3231_get_reg_byte(DS3231_REG_DATE, &day_of_month);
+    ds3231_get_reg_byte(dev, DS3231_REG_DATE, &day_of_month);
 	day_of_month = ds3231_decode_BCD(day_of_month);
 
 	return day_of_month;
@@ -773,77 +1521,80 @@ uint8_t ds3231_get_date(void)
 
 /**
  * @brief Gets the current month.
+ * @param dev DS3231 handle.
  * @return Month, 1 to 12.
  */
-uint8_t ds3231_get_month(void)
+uint8_t ds3231_get_month(ds3231_t *dev)
 {
     uint8_t month = 0;
 
-    ds3231_get_reg_byte(DS3231_REG_MONTH, &month);
-    month &= 0x7f;
-    month = ds3231_decode_BCD(month);
+    ds3231_get_reg_byte(dev, DS3231_REG_MONTH, &month);
+    month = ds3231_decode_BCD(DS3231_FIELD_GET(DS3231_F_MONTH, month));
 
     return month;
 }
 
 /**
- * @brief Gets the current year.
+ * @brief Gets the current year. Month/century and year registers are read in one transaction.
+ * @param dev DS3231 handle.
  * @return Year, 2000 to 2199.
  */
-uint16_t ds3231_get_year(void)
+uint16_t ds3231_get_year(ds3231_t *dev)
 {
-	uint8_t decYear;
-	ds3231_get_reg_byte(DS3231_REG_YEAR, &decYear);
-	decYear = ds3231_decode_BCD(decYear);
-	uint8_t month;
-	ds3231_get_reg_byte(DS3231_REG_MONTH, &month);
-	uint16_t century = (month >> DS3231_CENTURY) * 100 + 2000;
-	return century + decYear;
+    uint8_t regs[2] = { 0, 0 };
+
+    ds3231_read_regs(dev, DS3231_REG_MONTH, regs, sizeof(regs));
+
+    return 2000 + (DS3231_FIELD_GET(DS3231_F_CENTURY, regs[0]) * 100) + ds3231_decode_BCD(regs[1]);
 }
 
 /**
  * @brief Gets the current hour in 24h format.
+ * @param dev DS3231 handle.
  * @return Hour in 24h format, 0 to 23.
  */
-uint8_t ds3231_get_hour(void)
+uint8_t ds3231_get_hour(ds3231_t *dev)
 {
     uint8_t hour;
-    ds3231_get_reg_byte(DS3231_REG_HOUR, &hour);
+    ds3231_get_reg_byte(dev, DS3231_REG_HOUR, &hour);
 
 	return ds3231_decode_BCD(hour);
 }
 
 /**
  * @brief Gets the current minute.
+ * @param dev DS3231 handle.
  * @return Minute, 0 to 59.
  */
-uint8_t ds3231_get_minute(void)
+uint8_t ds3231_get_minute(ds3231_t *dev)
 {
     uint8_t minute;
-    ds3231_get_reg_byte(DS3231_REG_MINUTE, &minute);
+    ds3231_get_reg_byte(dev, DS3231_REG_MINUTE, &minute);
 	return ds3231_decode_BCD(minute);
 }
 
 /**
  * @brief Gets the current second. Clock halt bit not included.
+ * @param dev DS3231 handle.
  * @return Second, 0 to 59.
  */
-uint8_t ds3231_get_second(void)
+uint8_t ds3231_get_second(ds3231_t *dev)
 {
     uint8_t second;
-    ds3231_get_reg_byte(DS3231_REG_SECOND, &second);
+    ds3231_get_reg_byte(dev, DS3231_REG_SECOND, &second);
 	return ds3231_decode_BCD(second);
 }
 
 /**
  * @brief Set the current day of week.
+ * @param dev DS3231 handle.
  * @param dayOfWeek Days since last Sunday, 1 to 7.
  * @return 0 = success, otherwise = failure
  */
-uint8_t ds3231_set_day_of_week(uint8_t dayOfWeek)
+uint8_t ds3231_set_day_of_week(ds3231_t *dev, uint8_t dayOfWeek)
 {
     uint8_t retval = 0;
-	if (ds3231_set_reg_byte(DS3231_REG_DOW, ds3231_encode_BCD(dayOfWeek)) != 0)
+	if (ds3231_set_reg_byte(dev, DS3231_REG_DOW, ds3231_encode_BCD(dayOfWeek)) != 0)
 	{
 	    retval = 1;
 	}
@@ -853,13 +1604,14 @@ uint8_t ds3231_set_day_of_week(uint8_t dayOfWeek)
 
 /**
  * @brief Set the current day of month.
+ * @param dev DS3231 handle.
  * @param date Day of month, 1 to 31.
  * @return 0 = success, otherwise = failure
  */
-uint8_t ds3231_set_date(uint8_t date)
+uint8_t ds3231_set_date(ds3231_t *dev, uint8_t date)
 {
     uint8_t retval = 0;
-	if (ds3231_set_reg_byte(DS3231_REG_DATE, ds3231_encode_BCD(date)) != 0)
+	if (ds3231_set_reg_byte(dev, DS3231_REG_DATE, ds3231_encode_BCD(date)) != 0)
 	{
 	    retval = 1;
 	}
@@ -869,21 +1621,22 @@ uint8_t ds3231_set_date(uint8_t date)
 
 /**
  * @brief Set the current month.
+ * @param dev DS3231 handle.
  * @param month Month, 1 to 12.
  * @return 0 = success, otherwise = failure
  */
-uint8_t ds3231_set_month(uint8_t month)
+uint8_t ds3231_set_month(ds3231_t *dev, uint8_t month)
 {
     uint8_t retval = 0;
 	uint8_t century;
-	if (ds3231_get_reg_byte(DS3231_REG_MONTH, &century) != 0)
+	if (ds3231_get_reg_byte(dev, DS3231_REG_MONTH, &century) != 0)
 	{
 	    retval = 1;
 	}
 	else
 	{
-	    century &= 0x80;
-	    if (ds3231_set_reg_byte(DS3231_REG_MONTH, ds3231_encode_BCD(month) | century) != 0)
+	    century = DS3231_FIELD_SET(DS3231_F_CENTURY, DS3231_FIELD_GET(DS3231_F_CENTURY, century));
+	    if (ds3231_set_reg_byte(dev, DS3231_REG_MONTH, ds3231_encode_BCD(month) | century) != 0)
 	    {
 	        retval = 1;
 	    }
@@ -893,47 +1646,44 @@ uint8_t ds3231_set_month(uint8_t month)
 }
 
 /**
- * @brief Set the current year.
+ * @brief Set the current year. Month/century and year registers are written in one transaction.
+ * @param dev DS3231 handle.
  * @param year Year, 2000 to 2199.
  * @return 0 = success, otherwise = failure
  */
-uint8_t ds3231_set_year(uint16_t year)
+uint8_t ds3231_set_year(ds3231_t *dev, uint16_t year)
 {
     uint8_t retval = 0;
-	uint8_t century = (year / 100) % 20;
-	uint8_t monthReg;
-	if (ds3231_get_reg_byte(DS3231_REG_MONTH, &monthReg) != 0)
-	{
-	    retval = 1;
-	}
-	else
-	{
-	    monthReg = (monthReg & 0x7f) | (century << DS3231_CENTURY);
-	    if (ds3231_set_reg_byte(DS3231_REG_MONTH, monthReg) != 0)
-	    {
-	        retval = 1;
-	    }
-	    else
-	    {
-	        if (ds3231_set_reg_byte(DS3231_REG_YEAR, ds3231_encode_BCD(year % 100)) != 0)
-	        {
-	            retval = 1;
-	        }
-	    }
-	}
-
-	return retval;
+    uint8_t century = (year / 100) % 20;
+    uint8_t regs[2];
+
+    if (ds3231_get_reg_byte(dev, DS3231_REG_MONTH, &regs[0]) != 0)
+    {
+        retval = 1;
+    }
+    else
+    {
+        regs[0] = DS3231_FIELD_PUT(DS3231_F_CENTURY, regs[0], century);
+        regs[1] = ds3231_encode_BCD(year % 100);
+        if (ds3231_write_regs(dev, DS3231_REG_MONTH, regs, sizeof(regs)) != 0)
+        {
+            retval = 1;
+        }
+    }
+
+    return retval;
 }
 
 /**
  * @brief Set the current hour, in 24h format.
+ * @param dev DS3231 handle.
  * @param hour_24mode Hour in 24h format, 0 to 23.
  * @return 0 = success, otherwise = failure
  */
-uint8_t ds3231_set_hour(uint8_t hour_24mode)
+uint8_t ds3231_set_hour(ds3231_t *dev, uint8_t hour_24mode)
 {
     uint8_t retval = 0;
-	if (ds3231_set_reg_byte(DS3231_REG_HOUR, ds3231_encode_BCD(hour_24mode & 0x3f)) != 0)
+	if (ds3231_set_reg_byte(dev, DS3231_REG_HOUR, DS3231_FIELD_SET(DS3231_F_HOUR_24, ds3231_encode_BCD(hour_24mode))) != 0)
 	{
 	    retval = 1;
 	}
@@ -943,13 +1693,14 @@ uint8_t ds3231_set_hour(uint8_t hour_24mode)
 
 /**
  * @brief Set the current minute.
+ * @param dev DS3231 handle.
  * @param minute Minute, 0 to 59.
  * @return 0 = success, otherwise = failure
  */
-uint8_t ds3231_set_minute(uint8_t minute)
+uint8_t ds3231_set_minute(ds3231_t *dev, uint8_t minute)
 {
     uint8_t retval = 0;
-	if (ds3231_set_reg_byte(DS3231_REG_MINUTE, ds3231_encode_BCD(minute)) != 0)
+	if (ds3231_set_reg_byte(dev, DS3231_REG_MINUTE, ds3231_encode_BCD(minute)) != 0)
 	{
 	    retval = 1;
 	}
@@ -959,13 +1710,14 @@ uint8_t ds3231_set_minute(uint8_t minute)
 
 /**
  * @brief Set the current second.
+ * @param dev DS3231 handle.
  * @param second Second, 0 to 59.
  * @return 0 = success, otherwise = failure
  */
-uint8_t ds3231_set_second(uint8_t second)
+uint8_t ds3231_set_second(ds3231_t *dev, uint8_t second)
 {
     uint8_t retval = 0;
-	if (ds3231_set_reg_byte(DS3231_REG_SECOND, ds3231_encode_BCD(second)) != 0)
+	if (ds3231_set_reg_byte(dev, DS3231_REG_SECOND, ds3231_encode_BCD(second)) != 0)
 	{
 	    retval = 1;
 	}
@@ -974,76 +1726,251 @@ uint8_t ds3231_set_second(uint8_t second)
 }
 
 /**
- * @brief Set the current time.
+ * @brief Decodes a raw time record, registers 0x00 to 0x06, in two 32-bit lanes.
+ *        The register masks are applied per lane, every BCD nibble is checked and the
+ *        fields are converted four at a time, then range checked as a whole.
+ * @param regs Raw register values, DS3231_TIME_REG_COUNT bytes starting at DS3231_REG_SECOND.
+ * @param datetime Decoded date and time, hour in 24h format. Left untouched on failure.
+ * @return 0 = success, otherwise = failure (nibble above 9 or field out of range)
+ */
+uint8_t ds3231_decode_time_regs(const uint8_t *regs, ds3231_datetime *datetime)
+{
+    uint8_t retval = 0;
+    uint8_t is_12h = DS3231_FIELD_GET(DS3231_F_12_24, regs[DS3231_REG_HOUR]);
+    uint8_t is_pm = DS3231_FIELD_GET(DS3231_F_AM_PM, regs[DS3231_REG_HOUR]);
+    /* Lane 0: second, minute, hour, day of week. Lane 1: date, month, year */
+    uint32_t lane0 = (uint32_t)regs[DS3231_REG_SECOND] | ((uint32_t)regs[DS3231_REG_MINUTE] << 8) |
+                     ((uint32_t)regs[DS3231_REG_HOUR] << 16) | ((uint32_t)regs[DS3231_REG_DOW] << 24);
+    uint32_t lane1 = (uint32_t)regs[DS3231_REG_DATE] | ((uint32_t)regs[DS3231_REG_MONTH] << 8) |
+                     ((uint32_t)regs[DS3231_REG_YEAR] << 16);
+    uint32_t tens0;
+    uint32_t tens1;
+    ds3231_datetime decoded;
+
+    /* Strip the 12/24, AM/PM and century flag bits */
+    lane0 &= is_12h ? 0x071f7f7f : 0x073f7f7f;
+    lane1 &= 0x00ff1f3f;
+    tens0 = (lane0 >> 4) & 0x0f0f0f0f;
+    tens1 = (lane1 >> 4) & 0x0f0f0f0f;
+
+    /* A nibble above 9 carries into bit 4 of its byte when 6 is added */
+    if (((((lane0 & 0x0f0f0f0f) + 0x06060606) | (tens0 + 0x06060606) |
+          ((lane1 & 0x0f0f0f0f) + 0x06060606) | (tens1 + 0x06060606)) & 0x10101010) != 0)
+    {
+        retval = 1;
+    }
+    else
+    {
+        /* 16 * tens + units - 6 * tens, no byte can borrow from its neighbour */
+        lane0 -= tens0 * 6;
+        lane1 -= tens1 * 6;
+
+        decoded.second = (uint8_t)lane0;
+        decoded.minute = (uint8_t)(lane0 >> 8);
+        decoded.hour = (uint8_t)(lane0 >> 16);
+        decoded.day_of_week = (uint8_t)(lane0 >> 24);
+        decoded.date = (uint8_t)lane1;
+        decoded.month = (uint8_t)(lane1 >> 8);
+        decoded.year = 2000 + (DS3231_FIELD_GET(DS3231_F_CENTURY, regs[DS3231_REG_MONTH]) * 100) + (uint8_t)(lane1 >> 16);
+
+        if (is_12h)
+        {
+            if ((decoded.hour < 1) || (decoded.hour > 12))
+            {
+                retval = 1;
+            }
+            /* 12 AM is hour 0 */
+            decoded.hour = (decoded.hour % 12) + (is_pm * 12);
+        }
+
+        if ((retval == 0) && (ds3231_is_datetime_valid(&decoded) != 0))
+        {
+            *datetime = decoded;
+        }
+        else
+        {
+            retval = 1;
+        }
+    }
+
+    return retval;
+}
+
+/**
+ * @brief Encode a date and time into registers 0x00 to 0x06.
+ * @param datetime Validated date and time, hour in 24h format.
+ * @param regs Register values, DS3231_TIME_REG_COUNT bytes.
+ */
+static void ds3231_encode_time_regs(const ds3231_datetime *datetime, uint8_t *regs)
+{
+    regs[DS3231_REG_SECOND] = ds3231_encode_BCD(datetime->second);
+    regs[DS3231_REG_MINUTE] = ds3231_encode_BCD(datetime->minute);
+    regs[DS3231_REG_HOUR] = ds3231_encode_BCD(datetime->hour);
+    regs[DS3231_REG_DOW] = ds3231_encode_BCD(datetime->day_of_week);
+    regs[DS3231_REG_DATE] = ds3231_encode_BCD(datetime->date);
+    regs[DS3231_REG_MONTH] = ds3231_encode_BCD(datetime->month) | DS3231_FIELD_SET(DS3231_F_CENTURY, (datetime->year / 100) % 20);
+    regs[DS3231_REG_YEAR] = ds3231_encode_BCD(datetime->year % 100);
+}
+
+/**
+ * @brief Set the complete date and time with one 8-byte I2C transaction.
+ *        The countdown chain restarts once and the clock never holds a half-updated time.
+ * @param dev DS3231 handle.
+ * @param datetime Date and time to set, hour in 24h format.
+ * @return 0 = success, otherwise = failure
+ */
+uint8_t ds3231_set_datetime(ds3231_t *dev, const ds3231_datetime *datetime)
+{
+    uint8_t retval = 0;
+    uint8_t regs[DS3231_TIME_REG_COUNT];
+
+    if (ds3231_is_datetime_valid(datetime) == 0)
+    {
+        retval = 1;
+    }
+    else
+    {
+        ds3231_encode_time_regs(datetime, regs);
+        if (ds3231_write_regs(dev, DS3231_REG_SECOND, regs, DS3231_TIME_REG_COUNT) != 0)
+        {
+            retval = 1;
+        }
+    }
+
+    return retval;
+}
+
+/**
+ * @brief Set the date and time so the seconds register is written at the start of a second.
+ *        Writing the seconds register restarts the countdown chain, so the RTC second then
+ *        begins where the reference second begins instead of at an arbitrary phase.
+ *        The registers are encoded beforehand and written by ds3231_write_at(), which measures
+ *        the software and bus time to the ACK of the seconds byte and leaves early by it.
+ * @param dev DS3231 handle.
+ * @param epoch Reference time at the moment of the call, Unix epoch seconds.
+ * @param micros Reference time at the moment of the call, microseconds 0 to 999999.
+ * @param est_error_us Measured time of the ACK of the seconds byte, where the seconds register
+ *        latches, minus the start of the second.
+ * @return 0 = success, otherwise = failure (invalid time, bus busy or bus error)
+ * @note Thread context only, blocks until the start of the next second (or the one after
+ *       when the next one is too close). The mirror is suspended so no refresh queues ahead
+ *       of the write, and is reloaded by the next SQW edge. Requests queued by interrupt
+ *       handlers during the write wait until it is done.
+ */
+uint8_t ds3231_set_datetime_at(ds3231_t *dev, uint64_t epoch, uint32_t micros, int32_t *est_error_us)
+{
+    uint8_t retval = 0;
+    uint32_t reference = get_cycles();
+    /* Nominal bus time, it only places the guard window; ds3231_write_at() measures the real lead */
+    uint32_t lead = (uint32_t)(((uint64_t)SystemCoreClock * DS3231_SET_LEAD_CLOCKS) / ds3231_get_bus_clock(dev));
+    uint32_t guard = micros_to_cycles(DS3231_SET_GUARD_US);
+    uint32_t target = 0;
+    uint32_t latch = 0;
+    uint8_t mirror_enabled = dev->mirror_enabled;
+    uint8_t regs[DS3231_TIME_REG_COUNT];
+    ds3231_datetime datetime;
+
+    if (micros < 1000000)
+    {
+        epoch++;
+        target = micros_to_cycles(1000000 - micros);
+        if (target < (lead + guard))
+        {
+            epoch++;
+            target += micros_to_cycles(1000000);
+        }
+    }
+
+    if ((micros >= 1000000) || (ds3231_epoch_to_datetime(epoch, &datetime) != 0))
+    {
+        retval = 1;
+    }
+    else
+    {
+        ds3231_encode_time_regs(&datetime, regs);
+        dev->mirror_enabled = 0;
+
+        while ((get_cycles() - reference) < (target - lead - guard))
+        {
+        }
+        retval = ds3231_write_at(dev, DS3231_REG_SECOND, regs, DS3231_TIME_REG_COUNT, reference + target, &latch);
+
+        dev->mirror_valid = 0;
+        dev->mirror_enabled = mirror_enabled;
+
+        if (retval == 0)
+        {
+            /* The seconds register latches at the ACK of the seconds byte */
+            *est_error_us = (int32_t)(latch - (reference + target)) / (int32_t)(SystemCoreClock / 1000000);
+        }
+    }
+
+    return retval;
+}
+
+/**
+ * @brief Set the current time with one I2C transaction to registers 0x00 to 0x02.
+ * @param dev DS3231 handle.
  * @param hour_24mode Hour in 24h format, 0 to 23.
  * @param minute  Minute, 0 to 59.
  * @param second Second, 0 to 59.
  * @return 0 = success, otherwise = failure
  */
-uint8_t ds3231_set_full_time(uint8_t  hour_24mode, uint8_t minute, uint8_t second)
+uint8_t ds3231_set_full_time(ds3231_t *dev, uint8_t  hour_24mode, uint8_t minute, uint8_t second)
 {
     uint8_t retval = 0;
-
-	if (ds3231_set_hour(hour_24mode) != 0)
-	{
-	    retval = 1;
-	}
-	else
-	{
-	    if (ds3231_set_minute(minute) != 0)
-	    {
-	        retval = 1;
-	    }
-	    else
-	    {
-	        if (ds3231_set_second(second) != 0)
-	        {
-	            retval = 1;
-	        }
-	    }
-	}
-
-	return retval;
+    uint8_t regs[3];
+
+    if ((hour_24mode > 23) || (minute > 59) || (second > 59))
+    {
+        retval = 1;
+    }
+    else
+    {
+        regs[0] = ds3231_encode_BCD(second);
+        regs[1] = ds3231_encode_BCD(minute);
+        regs[2] = ds3231_encode_BCD(hour_24mode);
+        if (ds3231_write_regs(dev, DS3231_REG_SECOND, regs, sizeof(regs)) != 0)
+        {
+            retval = 1;
+        }
+    }
+
+    return retval;
 }
 
 /**
- * @brief Set the current date, month, day of week and year.
+ * @brief Set the current date, month, day of week and year with one I2C transaction to registers 0x03 to 0x06.
+ * @param dev DS3231 handle.
  * @param date Date, 0 to 31.
  * @param month Month, 1 to 12.
  * @param dow Days since last Sunday, 1 to 7.
  * @param year Year, 2000 to 2199.
  * @return 0 = success, otherwise = failure
  */
-uint8_t ds3231_set_full_date(uint8_t date, uint8_t month, uint8_t dow, uint16_t year)
+uint8_t ds3231_set_full_date(ds3231_t *dev, uint8_t date, uint8_t month, uint8_t dow, uint16_t year)
 {
     uint8_t retval = 0;
-	if (ds3231_set_date(date) != 0)
-	{
-	    retval = 1;
-	}
-	else
-	{
-	    if (ds3231_set_month(month) != 0)
-	    {
-	        retval = 1;
-	    }
-	    else
-	    {
-	        if (ds3231_set_day_of_week(dow) != 0)
-	        {
-	            retval = 1;
-	        }
-	        else
-	        {
-	            if (ds3231_set_year(year) != 0)
-	            {
-	                retval = 1;
-	            }
-	        }
-	    }
-	}
-
-	return retval;
+    uint8_t regs[4];
+
+    if ((date < 1) || (date > 31) || (month < 1) || (month > 12) ||
+        (dow < 1) || (dow > 7) || (year < 2000) || (year > 2199))
+    {
+        retval = 1;
+    }
+    else
+    {
+        regs[0] = ds3231_encode_BCD(dow);
+        regs[1] = ds3231_encode_BCD(date);
+        regs[2] = ds3231_encode_BCD(month) | DS3231_FIELD_SET(DS3231_F_CENTURY, (year / 100) % 20);
+        regs[3] = ds3231_encode_BCD(year % 100);
+        if (ds3231_write_regs(dev, DS3231_REG_DOW, regs, sizeof(regs)) != 0)
+        {
+            retval = 1;
+        }
+    }
+
+    return retval;
 }
 
 /**
@@ -1053,54 +1980,273 @@ uint8_t ds3231_set_full_date(uint8_t date, uint8_t month, uint8_t dow, uint16_t
  */
 uint8_t ds3231_decode_BCD(uint8_t bin)
 {
-	return (((bin & 0xf0) >> 4) * 10) + (bin & 0x0f);
+	return bin - ((bin >> 4) * 6);
 }
 
 /**
  * @brief Encodes a decimal number to binaty-coded decimal for storage in registers.
+ *        0 to 99 come from a table, larger values keep the old arithmetic result.
  * @param dec Decimal number to encode.
  * @return Encoded binary-coded decimal value.
  */
 uint8_t ds3231_encode_BCD(uint8_t dec)
 {
-	return (dec % 10 + ((dec / 10) << 4));
+    uint8_t bcd;
+
+    if (dec < sizeof(_ds3231_bcd_table))
+    {
+        bcd = _ds3231_bcd_table[dec];
+    }
+    else
+    {
+        bcd = (dec % 10 + ((dec / 10) << 4));
+    }
+
+    return bcd;
 }
 
 /**
  * @brief Enable the 32kHz output.
+ * @param dev DS3231 handle.
  * @param enable Enable, DS3231_ENABLE or DS3231_DISABLE.
  * @return 0 = success, otherwise = failure
  */
-uint8_t ds3231_enable_32kHz_output(ds3231_state enable)
+uint8_t ds3231_enable_32kHz_output(ds3231_t *dev, ds3231_state enable)
+{
+    return DS3231_UPDATE_FIELD(dev, DS3231_F_EN32KHZ, enable);
+}
+
+/**
+ * @brief Decode the temperature registers. The 10-bit two's complement value is left
+ *        aligned across MSB and LSB in units of 0.25 degree.
+ * @param regs Raw register values of DS3231_TEMP_MSB and DS3231_TEMP_LSB.
+ * @return Temperature in hundredths of a degree Celsius, -12800 to 12775.
+ */
+int16_t ds3231_decode_temperature(const uint8_t *regs)
+{
+    int16_t quarters = (int16_t)(((uint16_t)regs[0] << 8) | regs[1]) >> 6;
+
+    return quarters * 25;
+}
+
+/**
+ * @brief Get the temperature with one burst read of registers 0x11 and 0x12, so both
+ *        bytes come from the same conversion.
+ * @param dev DS3231 handle.
+ * @param centi_celsius Temperature in hundredths of a degree Celsius, 0.25 resolution.
+ * @return 0 = success, otherwise = failure
+ */
+uint8_t ds3231_get_temperature(ds3231_t *dev, int16_t *centi_celsius)
 {
     uint8_t retval = 0;
+    uint8_t regs[2];
+
+    if (ds3231_read_regs(dev, DS3231_TEMP_MSB, regs, sizeof(regs)) != 0)
+    {
+        retval = 1;
+    }
+    else
+    {
+        *centi_celsius = ds3231_decode_temperature(regs);
+    }
+
+    return retval;
+}
 
-	uint8_t status;
-	if (ds3231_get_reg_byte(DS3231_REG_STATUS, &status) != 0)
-	{
-	    retval = 1;
-	}
-	else
-	{
-	    status &= 0xfb;
-	    if (ds3231_set_reg_byte(DS3231_REG_STATUS, status | (enable << DS3231_EN32KHZ)) != 0)
-	    {
-	        retval = 1;
-	    }
-	}
+/**
+ * @brief Submit the next transfer of an on-demand conversion.
+ * @param dev DS3231 handle.
+ * @param state DS3231_CONV_CHECK or DS3231_CONV_POLL read registers 0x0e to 0x12,
+ *        DS3231_CONV_START writes the control register value in conv_regs[0].
+ * @return 0 = submitted, otherwise = failure
+ */
+static uint8_t ds3231_conversion_submit(ds3231_t *dev, ds3231_conv_state state)
+{
+    ds3231_request *request = &dev->conv_request;
+
+    dev->conv_state = state;
+    request->dir = (state == DS3231_CONV_START) ? DS3231_REQUEST_WRITE : DS3231_REQUEST_READ;
+    request->reg_addr = DS3231_REG_CONTROL;
+    request->data = dev->conv_regs;
+    request->len = (state == DS3231_CONV_START) ? 1 : sizeof(dev->conv_regs);
+    request->callback = ds3231_conversion_complete;
+    request->context = dev;
+    request->op = (state == DS3231_CONV_START) ? DS3231_OP_WRITE : DS3231_OP_READ;
+    request->timeout_us = 0;
+    request->priority = DS3231_PRIORITY_BACKGROUND;
+
+    return ds3231_submit(dev, request);
+}
 
-	return retval;
+/**
+ * @brief End an on-demand conversion and deliver it. A fresh reading also goes into the
+ *        mirror so snapshots do not wait for the next refresh.
+ * @param dev DS3231 handle.
+ * @param status 0 = conv_regs holds the converted temperature, otherwise = failure.
+ */
+static void ds3231_conversion_finish(ds3231_t *dev, uint8_t status)
+{
+    const uint8_t *temp = &dev->conv_regs[DS3231_TEMP_MSB - DS3231_REG_CONTROL];
+    int16_t centi_celsius = 0;
+    uint32_t primask;
+
+    if (status == 0)
+    {
+        centi_celsius = ds3231_decode_temperature(temp);
+        primask = __get_PRIMASK();
+        __disable_irq();
+        if (dev->mirror_valid != 0)
+        {
+            memcpy(&dev->mirror[DS3231_TEMP_MSB], temp, 2);
+        }
+        __set_PRIMASK(primask);
+    }
+    dev->conv_state = DS3231_CONV_IDLE;
+    if (dev->conv_callback != NULL)
+    {
+        dev->conv_callback(dev, status, centi_celsius, dev->conv_context);
+    }
+}
+
+/**
+ * @brief Advance an on-demand conversion when one of its transfers completes. Runs from the
+ *        I2C/DMA completion interrupt, so the next transfer goes out without a poll.
+ * @param request The conversion request, its context is the DS3231 handle.
+ */
+static void ds3231_conversion_complete(ds3231_request *request)
+{
+    ds3231_t *dev = (ds3231_t *)request->context;
+    uint8_t control = dev->conv_regs[0];
+    uint8_t busy = DS3231_FIELD_GET(DS3231_F_CONV, control) | DS3231_FIELD_GET(DS3231_F_BSY, dev->conv_regs[1]);
+
+    if (request->status != DS3231_REQUEST_DONE)
+    {
+        ds3231_conversion_finish(dev, 1);
+    }
+    else if (dev->conv_state == DS3231_CONV_START)
+    {
+        dev->conv_poll_tick = HAL_GetTick();
+        dev->conv_state = DS3231_CONV_WAIT;
+    }
+    else if (busy != 0)
+    {
+        /* Converting, or an automatic conversion already running: its result is just as fresh */
+        dev->conv_poll_tick = HAL_GetTick();
+        dev->conv_state = DS3231_CONV_WAIT;
+    }
+    else if (dev->conv_state == DS3231_CONV_CHECK)
+    {
+        dev->conv_regs[0] = DS3231_FIELD_PUT(DS3231_F_CONV, control, 1);
+        if (ds3231_conversion_submit(dev, DS3231_CONV_START) != 0)
+        {
+            ds3231_conversion_finish(dev, 1);
+        }
+    }
+    else
+    {
+        ds3231_conversion_finish(dev, 0);
+    }
+}
+
+/**
+ * @brief Start an on-demand temperature conversion without waiting for it. CONV is only set
+ *        while BSY is clear, then BSY is polled from ds3231_conversion_poll() and the fresh
+ *        reading is delivered to the callback.
+ * @param dev DS3231 handle.
+ * @param callback Receives the result, may be NULL when ds3231_is_conversion_busy() is polled.
+ * @param context User data for the callback.
+ * @return 0 = started, otherwise = a conversion is already running or the bus failed
+ * @note The control register is written back as read, so a configuration call must not
+ *       run between the start and the first poll.
+ */
+uint8_t ds3231_start_conversion(ds3231_t *dev, ds3231_temp_callback callback, void *context)
+{
+    uint8_t retval = 0;
+    uint32_t primask = __get_PRIMASK();
+
+    __disable_irq();
+    if (dev->conv_state != DS3231_CONV_IDLE)
+    {
+        retval = 1;
+    }
+    else
+    {
+        dev->conv_state = DS3231_CONV_CHECK;
+    }
+    __set_PRIMASK(primask);
+
+    if (retval == 0)
+    {
+        dev->conv_callback = callback;
+        dev->conv_context = context;
+        dev->conv_start_tick = HAL_GetTick();
+        if (ds3231_conversion_submit(dev, DS3231_CONV_CHECK) != 0)
+        {
+            dev->conv_state = DS3231_CONV_IDLE;
+            retval = 1;
+        }
+    }
+
+    return retval;
+}
+
+/**
+ * @brief Poll BSY of a running on-demand conversion. Call from the main loop or a scheduler tick,
+ *        it submits one read every DS3231_CONV_POLL_MS and never waits on the bus.
+ * @param dev DS3231 handle.
+ */
+void ds3231_conversion_poll(ds3231_t *dev)
+{
+    uint32_t now = HAL_GetTick();
+    uint8_t expired = 0;
+    uint8_t due = 0;
+    uint32_t primask = __get_PRIMASK();
+
+    __disable_irq();
+    if (dev->conv_state == DS3231_CONV_WAIT)
+    {
+        if ((now - dev->conv_start_tick) > DS3231_CONV_TIMEOUT_MS)
+        {
+            expired = 1;
+        }
+        else if ((now - dev->conv_poll_tick) >= DS3231_CONV_POLL_MS)
+        {
+            due = 1;
+        }
+        if ((expired != 0) || (due != 0))
+        {
+            dev->conv_state = DS3231_CONV_POLL;
+        }
+    }
+    __set_PRIMASK(primask);
+
+    if ((expired != 0) || ((due != 0) && (ds3231_conversion_submit(dev, DS3231_CONV_POLL) != 0)))
+    {
+        ds3231_conversion_finish(dev, 1);
+    }
+}
+
+/**
+ * @brief Check whether an on-demand conversion is running.
+ * @param dev DS3231 handle.
+ * @return 1 = running, 0 = idle
+ */
+uint8_t ds3231_is_conversion_busy(ds3231_t *dev)
+{
+    return (dev->conv_state != DS3231_CONV_IDLE) ? 1 : 0;
 }
 
 /**
- * @brief Get the integer part of the temperature.
+ * @brief Get the integer part of the temperature. Together with ds3231_get_temperature_fraction
+ *        it may straddle a conversion, ds3231_get_temperature reads both bytes at once.
+ * @param dev DS3231 handle.
  * @param temp_whole - Integer part of the temperature, -127 to 127.
  * @return 0 = success, otherwise = failure
  */
-int8_t ds3231_get_temperature_integer(uint8_t *temp_whole)
+int8_t ds3231_get_temperature_integer(ds3231_t *dev, uint8_t *temp_whole)
 {
     uint8_t retval = 0;
-	if (ds3231_get_reg_byte(DS3231_TEMP_MSB, temp_whole) != 0)
+	if (ds3231_get_reg_byte(dev, DS3231_TEMP_MSB, temp_whole) != 0)
 	{
 	    retval = 1;
 	}
@@ -1108,14 +2254,15 @@ int8_t ds3231_get_temperature_integer(uint8_t *temp_whole)
 }
 
 /**
- * @brief Get the fractional part of the temperature to 2 decimal places.
+ * @brief Get the fractional part of the temperature to 2 decimal places, see ds3231_get_temperature.
+ * @param dev DS3231 handle.
  * @param Fractional part of the temperature, 0, 25, 50 or 75.
  */
-uint8_t ds3231_get_temperature_fraction(uint8_t *temp_frac)
+uint8_t ds3231_get_temperature_fraction(ds3231_t *dev, uint8_t *temp_frac)
 {
     uint8_t retval = 0;
 
-	if (ds3231_get_reg_byte(DS3231_TEMP_LSB, temp_frac) != 0)
+	if (ds3231_get_reg_byte(dev, DS3231_TEMP_LSB, temp_frac) != 0)
 	{
 	    retval = 1;
 	}
@@ -0,0 +1,1619 @@
+/**
+  ******************************************************************************
+  * @file           : ds3231_async.c
+  * @brief          : Non-blocking interrupt/DMA driven register transfers for the DS3231
+  * @note           : STM32CubeIDE Environment
+  ******************************************************************************
+  * @attention
+  *
+  * MIT License
+  *
+  * Copyright (c) 2024 Elray's Software LLC, elrays@sbcglobal.net
+  *
+  * Permission is hereby granted, free of charge, to any person obtaining a copy
+  * of this software and associated documentation files (the "Software"), to deal
+  * in the Software without restriction, including without limitation the rights
+  * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  * copies of the Software, and to permit persons to whom the Software is
+  * furnished to do so, subject to the following conditions:
+  *
+  * The above copyright notice and this permission notice shall be included in all
+  * copies or substantial portions of the Software.
+  *
+  * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  * SOFTWARE.
+  ******************************************************************************
+  */
+#include "get_time.h"
+#include "stm32f4xx_hal.h"
+
+
+#include <string.h>
+#include "ds3231_async.h"
+#include "main.h"
+#include "i2c.h"
+#include "stm32f4xx_ll_i2c.h"
+
+/* Initialized devices, the HAL callbacks find theirs by the I2C handle */
+static ds3231_t *_ds3231_instances[DS3231_MAX_INSTANCES];
+
+static uint32_t ds3231_deadline_cycles(const ds3231_request *request);
+static HAL_StatusTypeDef ds3231_ll_transfer(ds3231_t *dev, ds3231_request *request, uint32_t *marks);
+static void ds3231_bus_recover(ds3231_t *dev);
+
+/*
+ * Find the device on an I2C bus
+ * @param hi2c - I2C handle of the callback
+ * @return - DS3231 handle, NULL when no device is on that bus
+ */
+static ds3231_t *ds3231_find(I2C_HandleTypeDef *hi2c)
+{
+    ds3231_t *dev = NULL;
+    uint8_t i;
+
+    for (i = 0; (i < DS3231_MAX_INSTANCES) && (dev == NULL); i++)
+    {
+        if ((_ds3231_instances[i] != NULL) && (_ds3231_instances[i]->bus.hi2c == hi2c))
+        {
+            dev = _ds3231_instances[i];
+        }
+    }
+
+    return dev;
+}
+
+#if (DS3231_BUS_POLICY == DS3231_BUS_SIM)
+/*
+ * Put the simulated device in its power-on state
+ * @param dev - DS3231 handle
+ * @return - none
+ * @note - 2000-01-01 00:00:00, 25.00 C; control and status hold their datasheet
+ *         reset values, so OSF reports the stopped oscillator like a new device
+ */
+static void ds3231_sim_reset(ds3231_t *dev)
+{
+    memset(dev->sim_regs, 0, sizeof(dev->sim_regs));
+    dev->sim_regs[DS3231_REG_DOW] = 0x01;
+    dev->sim_regs[DS3231_REG_DATE] = 0x01;
+    dev->sim_regs[DS3231_REG_MONTH] = 0x01;
+    dev->sim_regs[DS3231_REG_CONTROL] = DS3231_FIELD_SET(DS3231_F_INTCN, 1) | DS3231_FIELD_SET(DS3231_F_RS, DS3231_8192HZ);
+    dev->sim_regs[DS3231_REG_STATUS] = DS3231_FIELD_SET(DS3231_F_OSF, 1) | DS3231_FIELD_SET(DS3231_F_EN32KHZ, 1);
+    dev->sim_regs[DS3231_TEMP_MSB] = 25;
+}
+
+/*
+ * Run one request against the simulated register file of a device
+ * @param dev - DS3231 handle
+ * @param request - request on the bus
+ * @return - HAL_OK, HAL_ERROR for a register address the device does not have
+ * @note - the register pointer wraps from 0x12 to 0x00 like the device's. Status flags
+ *         written as 1 keep their value and BSY is read only. A conversion finishes at
+ *         once, so CONV never reads back as set. The time does not advance.
+ */
+static HAL_StatusTypeDef ds3231_sim_transfer(ds3231_t *dev, ds3231_request *request)
+{
+    HAL_StatusTypeDef status = HAL_OK;
+    uint8_t *sim = dev->sim_regs;
+    uint8_t reg = request->reg_addr;
+    uint8_t val;
+    uint16_t i;
+
+    if (reg >= DS3231_REG_COUNT)
+    {
+        status = HAL_ERROR;
+    }
+    for (i = 0; (i < request->len) && (status == HAL_OK); i++)
+    {
+        val = request->data[i];
+        if (request->dir == DS3231_REQUEST_READ)
+        {
+            request->data[i] = sim[reg];
+        }
+        else if (reg == DS3231_REG_STATUS)
+        {
+            sim[reg] = (sim[reg] & val & DS3231_STATUS_FLAGS) | (sim[reg] & DS3231_FIELD_MASK(DS3231_F_BSY)) |
+                       (val & ~(DS3231_STATUS_FLAGS | DS3231_FIELD_MASK(DS3231_F_BSY)));
+        }
+        else if (reg == DS3231_REG_CONTROL)
+        {
+            sim[reg] = DS3231_FIELD_PUT(DS3231_F_CONV, val, 0);
+        }
+        else if (reg < DS3231_TEMP_MSB)
+        {
+            sim[reg] = val;
+        }
+        reg = (reg + 1) % DS3231_REG_COUNT;
+    }
+
+    return status;
+}
+#endif /* DS3231_BUS_SIM */
+
+/*
+ * Start the transfer of one request on the bus
+ * @param dev - DS3231 handle
+ * @param request - request to start
+ * @return - HAL status of the start, with DS3231_BUS_SYNC of the whole transfer
+ */
+static HAL_StatusTypeDef ds3231_start_transfer(ds3231_t *dev, ds3231_request *request)
+{
+    HAL_StatusTypeDef status;
+
+#if (DS3231_BUS_POLICY == DS3231_BUS_SIM)
+    status = ds3231_sim_transfer(dev, request);
+#elif (DS3231_BUS_POLICY == DS3231_BUS_LL)
+    status = ds3231_ll_transfer(dev, request, NULL);
+#elif (DS3231_BUS_POLICY == DS3231_BUS_HAL_POLL)
+    /* HAL timeouts count HAL_GetTick() milliseconds, rounded up from the deadline */
+    if (request->dir == DS3231_REQUEST_READ)
+    {
+        status = HAL_I2C_Mem_Read(dev->bus.hi2c, DS3231_I2C_ADDR << 1, request->reg_addr, I2C_MEMADD_SIZE_8BIT,
+                                  request->data, request->len, (cycles_to_micros(ds3231_deadline_cycles(request)) / 1000) + 1);
+    }
+    else
+    {
+        status = HAL_I2C_Mem_Write(dev->bus.hi2c, DS3231_I2C_ADDR << 1, request->reg_addr, I2C_MEMADD_SIZE_8BIT,
+                                   request->data, request->len, (cycles_to_micros(ds3231_deadline_cycles(request)) / 1000) + 1);
+    }
+#elif defined(DS3231_ASYNC_DMA)
+    if (request->dir == DS3231_REQUEST_READ)
+    {
+        status = HAL_I2C_Mem_Read_DMA(dev->bus.hi2c, DS3231_I2C_ADDR << 1, request->reg_addr,
+                                      I2C_MEMADD_SIZE_8BIT, request->data, request->len);
+    }
+    else
+    {
+        status = HAL_I2C_Mem_Write_DMA(dev->bus.hi2c, DS3231_I2C_ADDR << 1, request->reg_addr,
+                                       I2C_MEMADD_SIZE_8BIT, request->data, request->len);
+    }
+#else
+    if (request->dir == DS3231_REQUEST_READ)
+    {
+        status = HAL_I2C_Mem_Read_IT(dev->bus.hi2c, DS3231_I2C_ADDR << 1, request->reg_addr,
+                                     I2C_MEMADD_SIZE_8BIT, request->data, request->len);
+    }
+    else
+    {
+        status = HAL_I2C_Mem_Write_IT(dev->bus.hi2c, DS3231_I2C_ADDR << 1, request->reg_addr,
+                                      I2C_MEMADD_SIZE_8BIT, request->data, request->len);
+    }
+#endif
+
+    return status;
+}
+
+/*
+ * Deadline of a request in core clock cycles
+ * @param request - request
+ * @return - cycles allowed on the bus
+ */
+static uint32_t ds3231_deadline_cycles(const ds3231_request *request)
+{
+    return micros_to_cycles((request->timeout_us != 0) ? request->timeout_us : DS3231_TIMEOUT_US);
+}
+
+/*
+ * Wait for an SR1 event of a register level transfer
+ * @param i2c - I2C peripheral
+ * @param flag - LL_I2C_SR1_xxx event to wait for
+ * @param request - request on the bus, its deadline bounds the wait
+ * @return - HAL_OK, HAL_ERROR on a NACK, bus error or lost arbitration, HAL_TIMEOUT past the deadline
+ */
+static HAL_StatusTypeDef ds3231_ll_wait(I2C_TypeDef *i2c, uint32_t flag, const ds3231_request *request)
+{
+    HAL_StatusTypeDef status = HAL_BUSY;
+    uint32_t deadline = ds3231_deadline_cycles(request);
+    uint32_t sr1;
+
+    while (status == HAL_BUSY)
+    {
+        sr1 = READ_REG(i2c->SR1);
+        if ((sr1 & (LL_I2C_SR1_AF | LL_I2C_SR1_BERR | LL_I2C_SR1_ARLO)) != 0)
+        {
+            status = HAL_ERROR;
+        }
+        else if ((sr1 & flag) == flag)
+        {
+            status = HAL_OK;
+        }
+        else if ((get_cycles() - request->start_cycles) > deadline)
+        {
+            status = HAL_TIMEOUT;
+        }
+    }
+
+    return status;
+}
+
+/*
+ * Receive the data phase of a register read, after the register pointer has been sent
+ * @param i2c - I2C peripheral
+ * @param request - read request on the bus
+ * @return - HAL status of the transfer
+ * @note - the ACK, POS and STOP handling of the 1, 2 and more byte cases follows the
+ *         reference manual, RM0390 "Master receiver". The STOP must be set before the
+ *         last byte is clocked in, so those steps run with interrupts masked.
+ */
+static HAL_StatusTypeDef ds3231_ll_read(I2C_TypeDef *i2c, const ds3231_request *request)
+{
+    HAL_StatusTypeDef status;
+    uint8_t *data = request->data;
+    uint16_t left = request->len;
+    uint32_t primask;
+
+    /* Register pointer is out once BTF is set */
+    status = ds3231_ll_wait(i2c, LL_I2C_SR1_BTF, request);
+    if (status == HAL_OK)
+    {
+        LL_I2C_GenerateStartCondition(i2c);
+        status = ds3231_ll_wait(i2c, LL_I2C_SR1_SB, request);
+    }
+    if (status == HAL_OK)
+    {
+        LL_I2C_AcknowledgeNextData(i2c, (left > 2) ? LL_I2C_ACK : LL_I2C_NACK);
+        if (left == 2)
+        {
+            LL_I2C_EnableBitPOS(i2c);
+        }
+        LL_I2C_TransmitData8(i2c, (DS3231_I2C_ADDR << 1) | 0x01);
+        status = ds3231_ll_wait(i2c, LL_I2C_SR1_ADDR, request);
+    }
+    if (status == HAL_OK)
+    {
+        if (left == 1)
+        {
+            primask = __get_PRIMASK();
+            __disable_irq();
+            LL_I2C_ClearFlag_ADDR(i2c);
+            LL_I2C_GenerateStopCondition(i2c);
+            __set_PRIMASK(primask);
+            status = ds3231_ll_wait(i2c, LL_I2C_SR1_RXNE, request);
+            if (status == HAL_OK)
+            {
+                *data = LL_I2C_ReceiveData8(i2c);
+            }
+        }
+        else if (left == 2)
+        {
+            LL_I2C_ClearFlag_ADDR(i2c);
+            /* Both bytes are in once the first is in DR and the second in the shift register */
+            status = ds3231_ll_wait(i2c, LL_I2C_SR1_BTF, request);
+            if (status == HAL_OK)
+            {
+                primask = __get_PRIMASK();
+                __disable_irq();
+                LL_I2C_GenerateStopCondition(i2c);
+                data[0] = LL_I2C_ReceiveData8(i2c);
+                __set_PRIMASK(primask);
+                data[1] = LL_I2C_ReceiveData8(i2c);
+            }
+            LL_I2C_DisableBitPOS(i2c);
+        }
+        else
+        {
+            LL_I2C_ClearFlag_ADDR(i2c);
+            while ((left > 3) && (status == HAL_OK))
+            {
+                status = ds3231_ll_wait(i2c, LL_I2C_SR1_RXNE, request);
+                if (status == HAL_OK)
+                {
+                    *data++ = LL_I2C_ReceiveData8(i2c);
+                    left--;
+                }
+            }
+            /* Last three bytes: byte N-2 in DR and N-1 in the shift register stretch the
+             * clock while the NACK for byte N is set up */
+            if (status == HAL_OK)
+            {
+                status = ds3231_ll_wait(i2c, LL_I2C_SR1_BTF, request);
+            }
+            if (status == HAL_OK)
+            {
+                LL_I2C_AcknowledgeNextData(i2c, LL_I2C_NACK);
+                *data++ = LL_I2C_ReceiveData8(i2c);
+                status = ds3231_ll_wait(i2c, LL_I2C_SR1_BTF, request);
+            }
+            if (status == HAL_OK)
+            {
+                primask = __get_PRIMASK();
+                __disable_irq();
+                LL_I2C_GenerateStopCondition(i2c);
+                *data++ = LL_I2C_ReceiveData8(i2c);
+                __set_PRIMASK(primask);
+                *data = LL_I2C_ReceiveData8(i2c);
+            }
+        }
+    }
+
+    return status;
+}
+
+/*
+ * Run one request to completion with register level accesses to the I2C peripheral,
+ * without the HAL state machine and without interrupts
+ * @param dev - DS3231 handle
+ * @param request - request on the bus, start_cycles set
+ * @param marks - NULL, or for a write 2 + request->len cycle counts: START on the bus, ACK of
+ *                the register pointer, ACK of each data byte
+ * @return - HAL_OK, HAL_ERROR when the device did not answer, HAL_TIMEOUT past the deadline
+ * @note - a failed transfer ends with a STOP and the error flags cleared. With marks each
+ *         byte is held back until the previous one is acknowledged (BTF), so the stamps
+ *         are the ACKs and not the moves into the shift register.
+ */
+static HAL_StatusTypeDef ds3231_ll_transfer(ds3231_t *dev, ds3231_request *request, uint32_t *marks)
+{
+    I2C_TypeDef *i2c = dev->bus.hi2c->Instance;
+    HAL_StatusTypeDef status = HAL_OK;
+    const uint8_t *data = request->data;
+    uint16_t left = request->len;
+
+    while ((LL_I2C_IsActiveFlag_BUSY(i2c) != 0) && (status == HAL_OK))
+    {
+        if ((get_cycles() - request->start_cycles) > ds3231_deadline_cycles(request))
+        {
+            status = HAL_TIMEOUT;
+        }
+    }
+
+    /* START, address for writing, register pointer */
+    if (status == HAL_OK)
+    {
+        LL_I2C_DisableBitPOS(i2c);
+        LL_I2C_GenerateStartCondition(i2c);
+        status = ds3231_ll_wait(i2c, LL_I2C_SR1_SB, request);
+    }
+    if (status == HAL_OK)
+    {
+        if (marks != NULL)
+        {
+            marks[0] = get_cycles();
+        }
+        LL_I2C_TransmitData8(i2c, DS3231_I2C_ADDR << 1);
+        status = ds3231_ll_wait(i2c, LL_I2C_SR1_ADDR, request);
+    }
+    if (status == HAL_OK)
+    {
+        LL_I2C_ClearFlag_ADDR(i2c);
+        status = ds3231_ll_wait(i2c, LL_I2C_SR1_TXE, request);
+    }
+    if (status == HAL_OK)
+    {
+        LL_I2C_TransmitData8(i2c, request->reg_addr);
+        if (request->dir == DS3231_REQUEST_READ)
+        {
+            status = ds3231_ll_read(i2c, request);
+        }
+        else
+        {
+            if (marks != NULL)
+            {
+                status = ds3231_ll_wait(i2c, LL_I2C_SR1_BTF, request);
+                marks[1] = get_cycles();
+            }
+            while ((left > 0) && (status == HAL_OK))
+            {
+                status = ds3231_ll_wait(i2c, LL_I2C_SR1_TXE, request);
+                if (status == HAL_OK)
+                {
+                    LL_I2C_TransmitData8(i2c, *data++);
+                    left--;
+                }
+                if ((marks != NULL) && (status == HAL_OK))
+                {
+                    status = ds3231_ll_wait(i2c, LL_I2C_SR1_BTF, request);
+                    marks[1 + request->len - left] = get_cycles();
+                }
+            }
+            if (status == HAL_OK)
+            {
+                status = ds3231_ll_wait(i2c, LL_I2C_SR1_BTF, request);
+            }
+            if (status == HAL_OK)
+            {
+                LL_I2C_GenerateStopCondition(i2c);
+            }
+        }
+    }
+
+    if (status != HAL_OK)
+    {
+        LL_I2C_GenerateStopCondition(i2c);
+        LL_I2C_ClearFlag_AF(i2c);
+        LL_I2C_ClearFlag_BERR(i2c);
+        LL_I2C_ClearFlag_ARLO(i2c);
+        LL_I2C_DisableBitPOS(i2c);
+    }
+
+    return status;
+}
+
+/*
+ * Add the bus time of a finished request to the statistics of its operation type
+ * @param dev - DS3231 handle
+ * @param request - finished request
+ * @param status - DS3231_REQUEST_DONE or DS3231_REQUEST_ERROR
+ * @return - none
+ * @note - called with the request already removed from the bus, from interrupt
+ *         context or with interrupts masked
+ */
+static void ds3231_record_latency(ds3231_t *dev, const ds3231_request *request, ds3231_request_status status)
+{
+    ds3231_latency_stats *stats = &dev->stats[(request->op < DS3231_OP_COUNT) ? request->op : DS3231_OP_READ];
+    uint32_t us = cycles_to_micros(get_cycles() - request->start_cycles);
+    uint32_t wait_us = cycles_to_micros(request->start_cycles - request->submit_cycles);
+    uint32_t bucket = 31 - __CLZ(us | 1);
+
+    stats->count++;
+    if (status != DS3231_REQUEST_DONE)
+    {
+        stats->errors++;
+    }
+    if (us > stats->max_us)
+    {
+        stats->max_us = us;
+    }
+    stats->total_us += us;
+    stats->histogram[(bucket < DS3231_LATENCY_BUCKETS) ? bucket : (DS3231_LATENCY_BUCKETS - 1)]++;
+    if (wait_us > stats->wait_max_us)
+    {
+        stats->wait_max_us = wait_us;
+    }
+    stats->wait_total_us += wait_us;
+}
+
+/*
+ * Cycles left until a queued request misses its deadline
+ * @param request - queued request
+ * @param now - current cycle count
+ * @return - cycles left, 0 once the deadline has passed
+ */
+static uint32_t ds3231_queue_slack(const ds3231_request *request, uint32_t now)
+{
+    uint32_t waited = now - request->submit_cycles;
+    uint32_t deadline = ds3231_deadline_cycles(request);
+
+    return (waited < deadline) ? (deadline - waited) : 0;
+}
+
+/*
+ * Finish the active request and report it to its owner
+ * @param dev - DS3231 handle
+ * @param status - DS3231_REQUEST_DONE or DS3231_REQUEST_ERROR
+ * @return - none
+ */
+static void ds3231_finish_active(ds3231_t *dev, ds3231_request_status status)
+{
+    ds3231_request *request = dev->active;
+
+    if (request != NULL)
+    {
+        dev->active = NULL;
+        ds3231_record_latency(dev, request, status);
+        request->status = status;
+        if (request->callback != NULL)
+        {
+            request->callback(request);
+        }
+    }
+}
+
+/*
+ * Start queued requests until one is on the bus or the queue is empty. Runs from the
+ * completion interrupt of the previous transfer, so queued requests go out back to back.
+ * @param dev - DS3231 handle
+ * @return - none
+ * @note - the HAL start functions are called with interrupts enabled because
+ *         they wait on the BUSY flag with a HAL_GetTick() timeout. A request whose
+ *         deadline passed while it was queued fails without reaching the bus.
+ *         With a DS3231_BUS_SYNC policy each transfer runs to completion here.
+ */
+static void ds3231_start_next(ds3231_t *dev)
+{
+    ds3231_request *request;
+    HAL_StatusTypeDef status;
+    uint8_t expired;
+    uint32_t primask;
+
+    do
+    {
+        request = NULL;
+        expired = 0;
+
+        primask = __get_PRIMASK();
+        __disable_irq();
+        if ((dev->active == NULL) && (dev->recover_pending == 0) && (dev->queue_head != NULL))
+        {
+            request = dev->queue_head;
+            dev->queue_head = request->next;
+            if (dev->queue_head == NULL)
+            {
+                dev->queue_tail = NULL;
+            }
+            dev->queue_depth--;
+            request->next = NULL;
+            request->start_cycles = get_cycles();
+            if (ds3231_queue_slack(request, request->start_cycles) == 0)
+            {
+                expired = 1;
+                dev->stats[(request->op < DS3231_OP_COUNT) ? request->op : DS3231_OP_READ].timeouts++;
+                request->status = DS3231_REQUEST_ERROR;
+            }
+            else
+            {
+                request->status = DS3231_REQUEST_BUSY;
+                dev->active = request;
+            }
+        }
+        __set_PRIMASK(primask);
+
+        if (expired != 0)
+        {
+            if (request->callback != NULL)
+            {
+                request->callback(request);
+            }
+        }
+        else if (request != NULL)
+        {
+            status = ds3231_start_transfer(dev, request);
+#ifdef DS3231_BUS_SYNC
+            if (status == HAL_TIMEOUT)
+            {
+                dev->stats[(request->op < DS3231_OP_COUNT) ? request->op : DS3231_OP_READ].timeouts++;
+                if (__get_IPSR() != 0)
+                {
+                    /* Recovered from thread context, see ds3231_check_deadline() */
+                    dev->recover_pending = 1;
+                }
+                else
+                {
+                    ds3231_bus_recover(dev);
+                }
+            }
+            ds3231_finish_active(dev, (status == HAL_OK) ? DS3231_REQUEST_DONE : DS3231_REQUEST_ERROR);
+#else
+            if (status != HAL_OK)
+            {
+                ds3231_finish_active(dev, DS3231_REQUEST_ERROR);
+            }
+#endif
+        }
+    } while ((request != NULL) && (dev->active == NULL));
+}
+
+/*
+ * Program the I2C peripheral for the current speed profile
+ * @param dev - DS3231 handle
+ * @return - HAL status of the initialization
+ * @note - the bus must be idle; HAL_I2C_Init() leaves the GPIO, DMA and NVIC setup alone
+ *         once the handle has been initialized
+ */
+static HAL_StatusTypeDef ds3231_apply_bus_profile(ds3231_t *dev)
+{
+    dev->bus.hi2c->Init.ClockSpeed = (dev->bus_profile == DS3231_BUS_STANDARD) ? 100000 : 400000;
+    dev->bus.hi2c->Init.DutyCycle = (dev->bus_profile == DS3231_BUS_FAST_16_9) ? I2C_DUTYCYCLE_16_9 : I2C_DUTYCYCLE_2;
+
+    return HAL_I2C_Init(dev->bus.hi2c);
+}
+
+/*
+ * Event and error interrupts of the I2C peripheral a device is on
+ * @param dev - DS3231 handle
+ * @param ev_irqn - event interrupt number
+ * @param er_irqn - error interrupt number
+ * @return - none
+ */
+static void ds3231_i2c_irqn(const ds3231_t *dev, IRQn_Type *ev_irqn, IRQn_Type *er_irqn)
+{
+    if (dev->bus.hi2c->Instance == I2C1)
+    {
+        *ev_irqn = I2C1_EV_IRQn;
+        *er_irqn = I2C1_ER_IRQn;
+    }
+    else if (dev->bus.hi2c->Instance == I2C2)
+    {
+        *ev_irqn = I2C2_EV_IRQn;
+        *er_irqn = I2C2_ER_IRQn;
+    }
+    else
+    {
+        *ev_irqn = I2C3_EV_IRQn;
+        *er_irqn = I2C3_ER_IRQn;
+    }
+}
+
+/*
+ * Busy wait on the cycle counter
+ * @param cycles - number of core clock cycles
+ * @return - none
+ */
+static void ds3231_delay_cycles(uint32_t cycles)
+{
+    uint32_t start = get_cycles();
+
+    while ((get_cycles() - start) < cycles)
+    {
+    }
+}
+
+/*
+ * Free a stuck bus and initialize the I2C peripheral again
+ * @param dev - DS3231 handle
+ * @return - none
+ * @note - a slave that lost clocks in the middle of a read holds SDA low until it
+ *         has shifted out its byte; nine clocks finish any byte and the STOP resets
+ *         its interface. The peripheral itself may hold a stale BUSY flag, so it is
+ *         de-initialized and brought up again with the CubeMX initialization.
+ *         Only the I2C and DMA interrupt lines are masked meanwhile: the de-initialization
+ *         and the CubeMX initialization wait on HAL_GetTick(), which needs SysTick, so
+ *         this runs in thread context only. The caller keeps dev->active set, or
+ *         dev->recover_pending, so no transfer starts until the bus is back.
+ */
+static void ds3231_bus_recover(ds3231_t *dev)
+{
+    GPIO_InitTypeDef gpio = { 0 };
+    /* 100 kHz clock */
+    uint32_t half_period = micros_to_cycles(5);
+    IRQn_Type ev_irqn;
+    IRQn_Type er_irqn;
+    uint32_t primask;
+    uint8_t i;
+
+    /* Keep the interrupts of the stuck transfer away from the handle while it is reset */
+    ds3231_i2c_irqn(dev, &ev_irqn, &er_irqn);
+    primask = __get_PRIMASK();
+    __disable_irq();
+    NVIC_DisableIRQ(ev_irqn);
+    NVIC_DisableIRQ(er_irqn);
+#ifdef DS3231_ASYNC_DMA
+    NVIC_DisableIRQ(dev->bus.dma_rx_irqn);
+    NVIC_DisableIRQ(dev->bus.dma_tx_irqn);
+#endif
+    __set_PRIMASK(primask);
+
+    HAL_I2C_DeInit(dev->bus.hi2c);
+
+    /* Take both lines over as open-drain outputs, released */
+    HAL_GPIO_WritePin(dev->bus.scl_port, dev->bus.scl_pin, GPIO_PIN_SET);
+    HAL_GPIO_WritePin(dev->bus.sda_port, dev->bus.sda_pin, GPIO_PIN_SET);
+    gpio.Mode = GPIO_MODE_OUTPUT_OD;
+    gpio.Pull = GPIO_NOPULL;
+    gpio.Speed = GPIO_SPEED_FREQ_LOW;
+    gpio.Pin = dev->bus.scl_pin;
+    HAL_GPIO_Init(dev->bus.scl_port, &gpio);
+    gpio.Pin = dev->bus.sda_pin;
+    HAL_GPIO_Init(dev->bus.sda_port, &gpio);
+    ds3231_delay_cycles(half_period);
+
+    for (i = 0; i < 9; i++)
+    {
+        HAL_GPIO_WritePin(dev->bus.scl_port, dev->bus.scl_pin, GPIO_PIN_RESET);
+        ds3231_delay_cycles(half_period);
+        HAL_GPIO_WritePin(dev->bus.scl_port, dev->bus.scl_pin, GPIO_PIN_SET);
+        ds3231_delay_cycles(half_period);
+    }
+
+    /* STOP: SDA rises while SCL is high */
+    HAL_GPIO_WritePin(dev->bus.scl_port, dev->bus.scl_pin, GPIO_PIN_RESET);
+    ds3231_delay_cycles(half_period);
+    HAL_GPIO_WritePin(dev->bus.sda_port, dev->bus.sda_pin, GPIO_PIN_RESET);
+    ds3231_delay_cycles(half_period);
+    HAL_GPIO_WritePin(dev->bus.scl_port, dev->bus.scl_pin, GPIO_PIN_SET);
+    ds3231_delay_cycles(half_period);
+    HAL_GPIO_WritePin(dev->bus.sda_port, dev->bus.sda_pin, GPIO_PIN_SET);
+    ds3231_delay_cycles(half_period);
+
+    /* Pins back to the I2C alternate function, DMA and NVIC set up again */
+    dev->bus.bus_reinit();
+    if (dev->bus_profile != DS3231_BUS_STANDARD)
+    {
+        ds3231_apply_bus_profile(dev);
+    }
+
+    /* Drop interrupts raised by the stuck transfer before the re-initialization */
+    primask = __get_PRIMASK();
+    __disable_irq();
+    NVIC_ClearPendingIRQ(ev_irqn);
+    NVIC_ClearPendingIRQ(er_irqn);
+    NVIC_EnableIRQ(ev_irqn);
+    NVIC_EnableIRQ(er_irqn);
+#ifdef DS3231_ASYNC_DMA
+    NVIC_ClearPendingIRQ(dev->bus.dma_rx_irqn);
+    NVIC_ClearPendingIRQ(dev->bus.dma_tx_irqn);
+    NVIC_EnableIRQ(dev->bus.dma_rx_irqn);
+    NVIC_EnableIRQ(dev->bus.dma_tx_irqn);
+#endif
+    dev->recoveries++;
+    __set_PRIMASK(primask);
+}
+
+/*
+ * Fail the active request and recover the bus if it is past its deadline
+ * @param dev - DS3231 handle
+ * @return - none
+ * @note - the recovery waits on HAL_GetTick(), which does not advance inside an interrupt
+ *         handler (all NVIC priorities are equal). From a handler the request is only failed
+ *         and dev->recover_pending holds the queue; the next call from thread context, e.g.
+ *         ds3231_wait() or ds3231_poll(), recovers the bus and restarts the queue.
+ */
+static void ds3231_check_deadline(ds3231_t *dev)
+{
+    ds3231_request *request;
+    uint8_t expired = 0;
+    uint8_t recover = 0;
+    uint8_t thread = (__get_IPSR() == 0) ? 1 : 0;
+    uint32_t primask;
+
+    primask = __get_PRIMASK();
+    __disable_irq();
+    request = dev->active;
+    if ((request != NULL) && (dev->recovering == 0) &&
+        ((get_cycles() - request->start_cycles) > ds3231_deadline_cycles(request)))
+    {
+        expired = 1;
+        dev->stats[(request->op < DS3231_OP_COUNT) ? request->op : DS3231_OP_READ].timeouts++;
+        if (thread != 0)
+        {
+            /* The expired request stays active, so the bus is ours until it is finished */
+            dev->recovering = 1;
+            recover = 1;
+        }
+        else
+        {
+            dev->recover_pending = 1;
+            ds3231_finish_active(dev, DS3231_REQUEST_ERROR);
+        }
+    }
+    else if ((thread != 0) && (dev->recover_pending != 0) && (dev->recovering == 0))
+    {
+        dev->recovering = 1;
+        recover = 1;
+    }
+    __set_PRIMASK(primask);
+
+    if (recover != 0)
+    {
+        ds3231_bus_recover(dev);
+
+        primask = __get_PRIMASK();
+        __disable_irq();
+        dev->recovering = 0;
+        dev->recover_pending = 0;
+        if (expired != 0)
+        {
+            ds3231_finish_active(dev, DS3231_REQUEST_ERROR);
+        }
+        __set_PRIMASK(primask);
+
+        ds3231_start_next(dev);
+    }
+}
+
+/*
+ * Take a request that has not reached the bus out of the queue
+ * @param dev - DS3231 handle
+ * @param request - queued request
+ * @return - 0 = removed and failed, otherwise = not in the queue
+ */
+static uint8_t ds3231_cancel(ds3231_t *dev, ds3231_request *request)
+{
+    uint8_t retval = 1;
+    ds3231_request *prev = NULL;
+    ds3231_request *curr;
+    uint32_t primask;
+
+    primask = __get_PRIMASK();
+    __disable_irq();
+    for (curr = dev->queue_head; (curr != NULL) && (curr != request); curr = curr->next)
+    {
+        prev = curr;
+    }
+    if (curr != NULL)
+    {
+        if (prev == NULL)
+        {
+            dev->queue_head = curr->next;
+        }
+        else
+        {
+            prev->next = curr->next;
+        }
+        if (dev->queue_tail == curr)
+        {
+            dev->queue_tail = prev;
+        }
+        curr->next = NULL;
+        dev->queue_depth--;
+        dev->stats[(curr->op < DS3231_OP_COUNT) ? curr->op : DS3231_OP_READ].timeouts++;
+        curr->status = DS3231_REQUEST_ERROR;
+        retval = 0;
+    }
+    __set_PRIMASK(primask);
+
+    if ((retval == 0) && (request->callback != NULL))
+    {
+        request->callback(request);
+    }
+
+    return retval;
+}
+
+/*
+ * Check whether an interrupt would preempt the code that is running now
+ * @param irqn - interrupt number
+ * @return - 1 = it preempts, 0 = it is masked until the current context returns
+ */
+static uint8_t ds3231_irq_can_preempt(IRQn_Type irqn)
+{
+    uint8_t retval = 0;
+    uint32_t ipsr = __get_IPSR();
+
+    if (__get_PRIMASK() != 0)
+    {
+        retval = 0;
+    }
+    else if (ipsr == 0)
+    {
+        retval = 1;
+    }
+    else
+    {
+        retval = (NVIC_GetPriority(irqn) < NVIC_GetPriority((IRQn_Type)((int32_t)ipsr - 16))) ? 1 : 0;
+    }
+
+    return retval;
+}
+
+/*
+ * Run a pending interrupt handler by hand
+ * @param dev - DS3231 handle
+ * @param irqn - interrupt number
+ * @param handler - function that services the interrupt
+ * @return - none
+ */
+static void ds3231_service_pending(ds3231_t *dev, IRQn_Type irqn, void (*handler)(ds3231_t *dev))
+{
+    if (NVIC_GetPendingIRQ(irqn) != 0)
+    {
+        NVIC_ClearPendingIRQ(irqn);
+        handler(dev);
+    }
+}
+
+static void ds3231_i2c_ev_handler(ds3231_t *dev)
+{
+    HAL_I2C_EV_IRQHandler(dev->bus.hi2c);
+}
+
+static void ds3231_i2c_er_handler(ds3231_t *dev)
+{
+    HAL_I2C_ER_IRQHandler(dev->bus.hi2c);
+}
+
+#ifdef DS3231_ASYNC_DMA
+static void ds3231_dma_rx_handler(ds3231_t *dev)
+{
+    HAL_DMA_IRQHandler(dev->bus.hi2c->hdmarx);
+}
+
+static void ds3231_dma_tx_handler(ds3231_t *dev)
+{
+    HAL_DMA_IRQHandler(dev->bus.hi2c->hdmatx);
+}
+#endif
+
+/*
+ * Register a device so the HAL completion callbacks of its bus reach it
+ * @param dev - DS3231 handle, its bus must not be in use by another device
+ * @return - 0 = success, otherwise = bus already taken or no free instance slot
+ * @note - called by ds3231_init(), registering the same handle again is allowed. With
+ *         DS3231_BUS_SIM a newly registered device starts from its power-on registers.
+ */
+uint8_t ds3231_attach(ds3231_t *dev)
+{
+    uint8_t retval = 1;
+    ds3231_t *owner;
+    uint8_t i;
+    uint32_t primask;
+
+    primask = __get_PRIMASK();
+    __disable_irq();
+    owner = ds3231_find(dev->bus.hi2c);
+    if (owner == dev)
+    {
+        retval = 0;
+    }
+    else if (owner == NULL)
+    {
+        for (i = 0; (i < DS3231_MAX_INSTANCES) && (retval != 0); i++)
+        {
+            if (_ds3231_instances[i] == NULL)
+            {
+                _ds3231_instances[i] = dev;
+#if (DS3231_BUS_POLICY == DS3231_BUS_SIM)
+                ds3231_sim_reset(dev);
+#endif
+                retval = 0;
+            }
+        }
+    }
+    __set_PRIMASK(primask);
+
+    return retval;
+}
+
+/*
+ * Submit a register transfer. Returns at once, the transfer runs from interrupts.
+ * @param dev - DS3231 handle
+ * @param request - filled in by the caller: dir, reg_addr, data, len, callback, context, op, timeout_us, priority
+ * @return - 0 = queued, otherwise = request is already in use
+ * @note - safe from interrupt handlers, which should submit instead of waiting. The request
+ *         goes behind those of higher or equal priority with an earlier deadline. A transfer
+ *         stuck on the bus past its deadline is failed here, so the bus recovers even when
+ *         nobody waits on it.
+ */
+uint8_t ds3231_submit(ds3231_t *dev, ds3231_request *request)
+{
+    uint8_t retval = 0;
+    ds3231_request *prev = NULL;
+    ds3231_request *curr;
+    uint32_t slack;
+    uint32_t primask;
+
+    if ((request->status == DS3231_REQUEST_QUEUED) || (request->status == DS3231_REQUEST_BUSY))
+    {
+        retval = 1;
+    }
+    else
+    {
+        ds3231_check_deadline(dev);
+
+        request->status = DS3231_REQUEST_QUEUED;
+        request->next = NULL;
+        request->submit_cycles = get_cycles();
+
+        primask = __get_PRIMASK();
+        __disable_irq();
+        slack = ds3231_queue_slack(request, request->submit_cycles);
+        for (curr = dev->queue_head; curr != NULL; curr = curr->next)
+        {
+            if ((request->priority > curr->priority) ||
+                ((request->priority == curr->priority) && (slack < ds3231_queue_slack(curr, request->submit_cycles))))
+            {
+                break;
+            }
+            prev = curr;
+        }
+        request->next = curr;
+        if (prev == NULL)
+        {
+            dev->queue_head = request;
+        }
+        else
+        {
+            prev->next = request;
+        }
+        if (curr == NULL)
+        {
+            dev->queue_tail = request;
+        }
+        dev->queue_depth++;
+        if (dev->queue_depth > dev->queue_depth_max)
+        {
+            dev->queue_depth_max = dev->queue_depth;
+        }
+        __set_PRIMASK(primask);
+
+        ds3231_start_next(dev);
+    }
+
+    return retval;
+}
+
+/*
+ * Poll a request for completion
+ * @param request - submitted request
+ * @return - 1 = DONE or ERROR, 0 = still queued or on the bus
+ */
+uint8_t ds3231_is_done(const ds3231_request *request)
+{
+    return ((request->status == DS3231_REQUEST_DONE) || (request->status == DS3231_REQUEST_ERROR)) ? 1 : 0;
+}
+
+/*
+ * Wait until a submitted request completes or misses its deadline
+ * @param dev - DS3231 handle
+ * @param request - submitted request
+ * @return - 0 = DONE, otherwise = ERROR or timeout
+ * @note - safe from an ISR that masks the I2C interrupts: their handlers are then run from here.
+ *         A transfer past its deadline on the bus triggers bus recovery, deferred to thread
+ *         context when waiting from an ISR. A request still queued
+ *         behind other transfers when its deadline has passed since submit is taken out of the queue.
+ */
+uint8_t ds3231_wait(ds3231_t *dev, ds3231_request *request)
+{
+    IRQn_Type ev_irqn;
+    IRQn_Type er_irqn;
+    uint8_t poll;
+
+    ds3231_i2c_irqn(dev, &ev_irqn, &er_irqn);
+    poll = (ds3231_irq_can_preempt(ev_irqn) == 0) ? 1 : 0;
+
+    while (ds3231_is_done(request) == 0)
+    {
+        if (poll != 0)
+        {
+            ds3231_service_pending(dev, ev_irqn, ds3231_i2c_ev_handler);
+            ds3231_service_pending(dev, er_irqn, ds3231_i2c_er_handler);
+#ifdef DS3231_ASYNC_DMA
+            ds3231_service_pending(dev, dev->bus.dma_rx_irqn, ds3231_dma_rx_handler);
+            ds3231_service_pending(dev, dev->bus.dma_tx_irqn, ds3231_dma_tx_handler);
+#endif
+        }
+
+        ds3231_check_deadline(dev);
+        if ((request->status == DS3231_REQUEST_QUEUED) &&
+            ((get_cycles() - request->submit_cycles) > ds3231_deadline_cycles(request)))
+        {
+            ds3231_cancel(dev, request);
+        }
+    }
+
+    return (request->status == DS3231_REQUEST_DONE) ? 0 : 1;
+}
+
+/*
+ * Check whether the driver has nothing queued or on the bus
+ * @param dev - DS3231 handle
+ * @return - 1 = idle, 0 = busy
+ */
+uint8_t ds3231_is_bus_idle(ds3231_t *dev)
+{
+    return ((dev->active == NULL) && (dev->queue_head == NULL) && (dev->recover_pending == 0)) ? 1 : 0;
+}
+
+/*
+ * Run the bus work deferred from interrupt handlers: a recovery after a deadline missed
+ * there, and a transfer on the bus past its deadline nobody waits for
+ * @param dev - DS3231 handle
+ * @return - none
+ * @note - thread context only, call it from the main loop
+ */
+void ds3231_poll(ds3231_t *dev)
+{
+    ds3231_check_deadline(dev);
+}
+
+/*
+ * Switch the I2C speed profile once the bus is idle
+ * @param dev - DS3231 handle
+ * @param profile - DS3231_BUS_STANDARD, DS3231_BUS_FAST_2 or DS3231_BUS_FAST_16_9
+ * @return - 0 = success, otherwise = failure
+ * @note - thread context only, it waits for the queue to drain
+ */
+uint8_t ds3231_set_bus_profile(ds3231_t *dev, ds3231_bus_profile profile)
+{
+    uint8_t retval = 1;
+    uint8_t done = 0;
+    uint32_t primask;
+
+    if (profile < DS3231_BUS_PROFILE_COUNT)
+    {
+        while (done == 0)
+        {
+            primask = __get_PRIMASK();
+            __disable_irq();
+            if (ds3231_is_bus_idle(dev) != 0)
+            {
+                dev->bus_profile = profile;
+                retval = (ds3231_apply_bus_profile(dev) == HAL_OK) ? 0 : 1;
+                done = 1;
+            }
+            __set_PRIMASK(primask);
+
+            if (done == 0)
+            {
+                ds3231_check_deadline(dev);
+            }
+        }
+    }
+
+    return retval;
+}
+
+/*
+ * Current I2C speed profile
+ * @param dev - DS3231 handle
+ * @return - active profile
+ */
+ds3231_bus_profile ds3231_get_bus_profile(ds3231_t *dev)
+{
+    return dev->bus_profile;
+}
+
+/*
+ * Nominal SCL frequency of the current speed profile
+ * @param dev - DS3231 handle
+ * @return - SCL frequency in Hz, from PCLK1 and the CCR divider HAL_I2C_Init() programs
+ * @note - the SCL rise time is not included
+ */
+uint32_t ds3231_get_bus_clock(ds3231_t *dev)
+{
+    uint32_t pclk1 = HAL_RCC_GetPCLK1Freq();
+    uint32_t ccr;
+    uint32_t clock_hz;
+
+    if (dev->bus_profile == DS3231_BUS_STANDARD)
+    {
+        ccr = pclk1 / (100000 * 2);
+        clock_hz = pclk1 / (((ccr < 4) ? 4 : ccr) * 2);
+    }
+    else if (dev->bus_profile == DS3231_BUS_FAST_2)
+    {
+        ccr = pclk1 / (400000 * 3);
+        clock_hz = pclk1 / (((ccr < 1) ? 1 : ccr) * 3);
+    }
+    else
+    {
+        ccr = pclk1 / (400000 * 25);
+        clock_hz = pclk1 / (((ccr < 1) ? 1 : ccr) * 25);
+    }
+
+    return clock_hz;
+}
+
+/*
+ * Copy the bus time statistics of one operation type
+ * @param dev - DS3231 handle
+ * @param op - operation type
+ * @param stats - copy of the statistics
+ * @return - 0 = success, otherwise = unknown operation type
+ */
+uint8_t ds3231_get_latency_stats(ds3231_t *dev, ds3231_op op, ds3231_latency_stats *stats)
+{
+    uint8_t retval = 1;
+    uint32_t primask;
+
+    if (op < DS3231_OP_COUNT)
+    {
+        primask = __get_PRIMASK();
+        __disable_irq();
+        *stats = dev->stats[op];
+        __set_PRIMASK(primask);
+        retval = 0;
+    }
+
+    return retval;
+}
+
+/*
+ * Clear the bus time statistics of all operation types and the maximum queue depth
+ * @param dev - DS3231 handle
+ * @return - none
+ */
+void ds3231_reset_latency_stats(ds3231_t *dev)
+{
+    uint32_t primask;
+
+    primask = __get_PRIMASK();
+    __disable_irq();
+    memset(dev->stats, 0, sizeof(dev->stats));
+    dev->queue_depth_max = dev->queue_depth;
+    __set_PRIMASK(primask);
+}
+
+/*
+ * Number of bus recoveries since start up
+ * @param dev - DS3231 handle
+ * @return - count of missed deadlines that reset the bus
+ */
+uint32_t ds3231_get_bus_recoveries(ds3231_t *dev)
+{
+    return dev->recoveries;
+}
+
+/*
+ * Number of requests waiting for the bus
+ * @param dev - DS3231 handle
+ * @param depth - requests queued now
+ * @param max_depth - deepest the queue has been since start up or ds3231_reset_latency_stats()
+ * @return - none
+ */
+void ds3231_get_queue_depth(ds3231_t *dev, uint32_t *depth, uint32_t *max_depth)
+{
+    uint32_t primask;
+
+    primask = __get_PRIMASK();
+    __disable_irq();
+    *depth = dev->queue_depth;
+    *max_depth = dev->queue_depth_max;
+    __set_PRIMASK(primask);
+}
+
+/*
+ * Spin until a request completes, counting the loop iterations
+ * @param request - submitted request
+ * @param limit - most iterations to spin
+ * @return - iterations spun
+ * @note - the same loop calibrates the idle time in ds3231_benchmark_backends()
+ */
+static uint32_t ds3231_bench_spin(const ds3231_request *request, uint32_t limit)
+{
+    uint32_t spins = 0;
+
+    while ((ds3231_is_done(request) == 0) && (spins < limit))
+    {
+        spins++;
+    }
+
+    return spins;
+}
+
+/*
+ * Take the bus away from the request queue once it is idle
+ * @param dev - DS3231 handle
+ * @param claim - placeholder made the active request, long deadline
+ * @return - none
+ * @note - requests submitted meanwhile stay queued until ds3231_bus_release()
+ */
+static void ds3231_bus_claim(ds3231_t *dev, ds3231_request *claim)
+{
+    uint8_t done = 0;
+    uint32_t primask;
+
+    while (done == 0)
+    {
+        primask = __get_PRIMASK();
+        __disable_irq();
+        if (ds3231_is_bus_idle(dev) != 0)
+        {
+            claim->status = DS3231_REQUEST_BUSY;
+            claim->start_cycles = get_cycles();
+            dev->active = claim;
+            done = 1;
+        }
+        __set_PRIMASK(primask);
+
+        if (done == 0)
+        {
+            ds3231_check_deadline(dev);
+        }
+    }
+}
+
+/*
+ * Give the bus back to the request queue
+ * @param dev - DS3231 handle
+ * @return - none
+ */
+static void ds3231_bus_release(ds3231_t *dev)
+{
+    uint32_t primask;
+
+    primask = __get_PRIMASK();
+    __disable_irq();
+    dev->active = NULL;
+    __set_PRIMASK(primask);
+
+    ds3231_start_next(dev);
+}
+
+/*
+ * Time DS3231_BENCH_READS full register file reads on each I2C backend: the blocking HAL
+ * driver, the register level transfer and the driver's request queue as built
+ * @param dev - DS3231 handle
+ * @param report - cycles per read of each backend and the nominal bus time of one read
+ * @return - 0 = success, otherwise = some reads failed
+ * @note - thread context only, not reentrant. The mirror is suspended for the run. The
+ *         polled backends keep the CPU for the whole transfer; the queue leaves it free
+ *         while the transfer runs, cpu_cycles counts only the time it did not spin idle.
+ */
+uint8_t ds3231_benchmark_backends(ds3231_t *dev, ds3231_backend_report *report)
+{
+    static const char *backend_name[DS3231_BACKEND_COUNT] =
+    {
+        "HAL polled", "LL polled",
+#if (DS3231_BUS_POLICY == DS3231_BUS_SIM)
+        "queue, sim"
+#elif (DS3231_BUS_POLICY == DS3231_BUS_LL)
+        "queue, LL"
+#elif (DS3231_BUS_POLICY == DS3231_BUS_HAL_POLL)
+        "queue, poll"
+#elif defined(DS3231_ASYNC_DMA)
+        "queue, DMA"
+#else
+        "queue, IT"
+#endif
+    };
+    static ds3231_request requests[DS3231_BENCH_READS];
+    static uint8_t regs[DS3231_BENCH_READS][DS3231_REG_COUNT];
+    ds3231_request claim = { 0 };
+    ds3231_request calib = { 0 };
+    uint32_t wall[DS3231_BACKEND_COUNT];
+    uint32_t cpu[DS3231_BACKEND_COUNT];
+    uint8_t mirror_enabled = dev->mirror_enabled;
+    uint8_t retval = 0;
+    HAL_StatusTypeDef status;
+    uint32_t calib_cycles;
+    uint32_t spins;
+    uint32_t start;
+    uint8_t backend;
+    uint8_t i;
+
+    memset(report, 0, sizeof(*report));
+    memset(requests, 0, sizeof(requests));
+    /* START, address, register pointer, repeated START, address, data, STOP */
+    report->clock_hz = ds3231_get_bus_clock(dev);
+    report->bus_cycles = (uint32_t)(((uint64_t)(3 + 9 * (3 + DS3231_REG_COUNT)) * SystemCoreClock) / report->clock_hz);
+
+    dev->mirror_enabled = 0;
+    claim.timeout_us = 1000000;
+    ds3231_bus_claim(dev, &claim);
+
+    /* Blocking HAL driver */
+    start = get_cycles();
+    for (i = 0; i < DS3231_BENCH_READS; i++)
+    {
+        if (HAL_I2C_Mem_Read(dev->bus.hi2c, DS3231_I2C_ADDR << 1, DS3231_REG_SECOND, I2C_MEMADD_SIZE_8BIT,
+                             regs[i], DS3231_REG_COUNT, (dev->timeout_us / 1000) + 1) != HAL_OK)
+        {
+            report->backend[0].errors++;
+        }
+    }
+    wall[0] = get_cycles() - start;
+    cpu[0] = wall[0];
+
+    /* Register level transfer */
+    start = get_cycles();
+    for (i = 0; i < DS3231_BENCH_READS; i++)
+    {
+        requests[i].dir = DS3231_REQUEST_READ;
+        requests[i].reg_addr = DS3231_REG_SECOND;
+        requests[i].data = regs[i];
+        requests[i].len = DS3231_REG_COUNT;
+        requests[i].timeout_us = dev->timeout_us;
+        requests[i].start_cycles = get_cycles();
+        status = ds3231_ll_transfer(dev, &requests[i], NULL);
+        if (status != HAL_OK)
+        {
+            report->backend[1].errors++;
+            if (status == HAL_TIMEOUT)
+            {
+                ds3231_bus_recover(dev);
+            }
+        }
+    }
+    wall[1] = get_cycles() - start;
+    cpu[1] = wall[1];
+
+    ds3231_bus_release(dev);
+
+    /* Cycles of one idle spin, on a request that never completes */
+    calib.status = DS3231_REQUEST_BUSY;
+    start = get_cycles();
+    ds3231_bench_spin(&calib, 1024);
+    calib_cycles = get_cycles() - start;
+
+    /* Request queue, all reads submitted at once and run back to back */
+    memset(requests, 0, sizeof(requests));
+    start = get_cycles();
+    for (i = 0; i < DS3231_BENCH_READS; i++)
+    {
+        requests[i].dir = DS3231_REQUEST_READ;
+        requests[i].reg_addr = DS3231_REG_SECOND;
+        requests[i].data = regs[i];
+        requests[i].len = DS3231_REG_COUNT;
+        requests[i].op = DS3231_OP_READ;
+        requests[i].timeout_us = dev->timeout_us * DS3231_BENCH_READS;
+        requests[i].priority = DS3231_PRIORITY_NORMAL;
+        ds3231_submit(dev, &requests[i]);
+    }
+    spins = ds3231_bench_spin(&requests[DS3231_BENCH_READS - 1], micros_to_cycles(dev->timeout_us * DS3231_BENCH_READS));
+    wall[2] = get_cycles() - start;
+    cpu[2] = wall[2] - (uint32_t)(((uint64_t)spins * calib_cycles) / 1024);
+    for (i = 0; i < DS3231_BENCH_READS; i++)
+    {
+        if (ds3231_wait(dev, &requests[i]) != 0)
+        {
+            report->backend[2].errors++;
+        }
+    }
+
+    dev->mirror_enabled = mirror_enabled;
+
+    for (backend = 0; backend < DS3231_BACKEND_COUNT; backend++)
+    {
+        report->backend[backend].name = backend_name[backend];
+        report->backend[backend].wall_cycles = wall[backend] / DS3231_BENCH_READS;
+        report->backend[backend].cpu_cycles = ((int32_t)cpu[backend] > 0) ? (cpu[backend] / DS3231_BENCH_READS) : 0;
+        report->backend[backend].gap_cycles = (report->backend[backend].wall_cycles > report->bus_cycles) ?
+                                              (report->backend[backend].wall_cycles - report->bus_cycles) : 0;
+        if (report->backend[backend].errors != 0)
+        {
+            retval = 1;
+        }
+    }
+
+    return retval;
+}
+
+/*
+ * Write consecutive registers so the ACK of the first data byte lands on a given cycle count,
+ * and timestamp that ACK
+ * @param dev - DS3231 handle
+ * @param reg_addr - first register address
+ * @param vals - values to write
+ * @param len - number of registers, 1 to DS3231_REG_COUNT
+ * @param at - get_cycles() value the ACK of the first data byte is aimed at
+ * @param ack_cycles - get_cycles() value at which that ACK was seen, set on success
+ * @return - 0 = success, otherwise = bus not idle before at, too late or bus error
+ * @note - thread context only. The bus is taken from the request queue for the whole call,
+ *         so requests submitted meanwhile, from interrupt handlers too, stay queued behind the
+ *         write. A register pointer write first measures the time from the issue of a START to
+ *         the ACK of the pointer, software included, and the write leaves early by that plus
+ *         one byte. Register level transfers whatever DS3231_BUS_POLICY is, like the benchmark.
+ */
+uint8_t ds3231_write_at(ds3231_t *dev, uint8_t reg_addr, const uint8_t *vals, uint16_t len, uint32_t at, uint32_t *ack_cycles)
+{
+    uint8_t retval = 0;
+    uint8_t claimed = 0;
+    ds3231_request claim = { 0 };
+    ds3231_request request = { 0 };
+    uint32_t marks[2 + DS3231_REG_COUNT];
+    HAL_StatusTypeDef status = HAL_BUSY;
+    uint32_t lead = 0;
+    uint32_t primask;
+
+    if ((len == 0) || (len > DS3231_REG_COUNT))
+    {
+        retval = 1;
+    }
+
+    while ((retval == 0) && (claimed == 0))
+    {
+        primask = __get_PRIMASK();
+        __disable_irq();
+        if (ds3231_is_bus_idle(dev) != 0)
+        {
+            claim.status = DS3231_REQUEST_BUSY;
+            claim.timeout_us = 1000000;
+            claim.start_cycles = get_cycles();
+            dev->active = &claim;
+            claimed = 1;
+        }
+        __set_PRIMASK(primask);
+
+        if (claimed == 0)
+        {
+            if ((int32_t)(at - get_cycles()) <= 0)
+            {
+                retval = 1;
+            }
+            else
+            {
+                ds3231_check_deadline(dev);
+            }
+        }
+    }
+
+    if (retval == 0)
+    {
+        request.dir = DS3231_REQUEST_WRITE;
+        request.reg_addr = reg_addr;
+        request.timeout_us = dev->timeout_us;
+        request.start_cycles = get_cycles();
+        status = ds3231_ll_transfer(dev, &request, marks);
+        if (status == HAL_OK)
+        {
+            /* The data byte takes about as long as the address and the pointer bytes each did */
+            lead = (marks[1] - request.start_cycles) + (marks[1] - marks[0]) / 2;
+            if ((int32_t)(at - lead - get_cycles()) <= 0)
+            {
+                retval = 1;
+            }
+        }
+    }
+
+    if ((retval == 0) && (status == HAL_OK))
+    {
+        while ((int32_t)(at - lead - get_cycles()) > 0)
+        {
+        }
+        request.data = (uint8_t *)vals;
+        request.len = len;
+        request.start_cycles = get_cycles();
+        status = ds3231_ll_transfer(dev, &request, marks);
+        if (status == HAL_OK)
+        {
+            *ack_cycles = marks[2];
+        }
+    }
+
+    if (status == HAL_TIMEOUT)
+    {
+        ds3231_bus_recover(dev);
+    }
+    if (status != HAL_OK)
+    {
+        retval = 1;
+    }
+    if (claimed != 0)
+    {
+        ds3231_bus_release(dev);
+    }
+
+    return retval;
+}
+
+/*
+ * HAL_I2C_MemTxCpltCallback
+ * @brief I2C memory write complete
+ * @param hi2c [IN] - I2C handle instance
+ * @retval - none
+ */
+void HAL_I2C_MemTxCpltCallback(I2C_HandleTypeDef *hi2c)
+{
+    ds3231_t *dev = ds3231_find(hi2c);
+
+    if (dev != NULL)
+    {
+        ds3231_finish_active(dev, DS3231_REQUEST_DONE);
+        ds3231_start_next(dev);
+    }
+}
+
+/*
+ * HAL_I2C_MemRxCpltCallback
+ * @brief I2C memory read complete
+ * @param hi2c [IN] - I2C handle instance
+ * @retval - none
+ */
+void HAL_I2C_MemRxCpltCallback(I2C_HandleTypeDef *hi2c)
+{
+    ds3231_t *dev = ds3231_find(hi2c);
+
+    if (dev != NULL)
+    {
+        ds3231_finish_active(dev, DS3231_REQUEST_DONE);
+        ds3231_start_next(dev);
+    }
+}
+
+/*
+ * HAL_I2C_ErrorCallback
+ * @brief I2C transfer failed (NACK, bus error, arbitration lost)
+ * @param hi2c [IN] - I2C handle instance
+ * @retval - none
+ */
+void HAL_I2C_ErrorCallback(I2C_HandleTypeDef *hi2c)
+{
+    ds3231_t *dev = ds3231_find(hi2c);
+
+    if (dev != NULL)
+    {
+        ds3231_finish_active(dev, DS3231_REQUEST_ERROR);
+        ds3231_start_next(dev);
+    }
+}
+
+/*
+ * HAL_I2C_AbortCpltCallback
+ * @brief I2C transfer aborted
+ * @param hi2c [IN] - I2C handle instance
+ * @retval - none
+ */
+void HAL_I2C_AbortCpltCallback(I2C_HandleTypeDef *hi2c)
+{
+    ds3231_t *dev = ds3231_find(hi2c);
+
+    if (dev != NULL)
+    {
+        ds3231_finish_active(dev, DS3231_REQUEST_ERROR);
+        ds3231_start_next(dev);
+    }
+}
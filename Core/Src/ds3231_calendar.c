@@ -0,0 +1,152 @@
+/**
+  ******************************************************************************
+  * @file           : ds3231_calendar.c
+  * @brief          : Date and time validation and Unix epoch conversions for the DS3231
+  *                 : No HAL calls, so tools/calendar_test.c can build it on a PC
+  * @note           : STM32CubeIDE Environment
+  ******************************************************************************
+  * @attention
+  *
+  * MIT License
+  *
+  * Copyright (c) 2024 Elray's Software LLC, elrays@sbcglobal.net
+  *
+  * Permission is hereby granted, free of charge, to any person obtaining a copy
+  * of this software and associated documentation files (the "Software"), to deal
+  * in the Software without restriction, including without limitation the rights
+  * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  * copies of the Software, and to permit persons to whom the Software is
+  * furnished to do so, subject to the following conditions:
+  *
+  * The above copyright notice and this permission notice shall be included in all
+  * copies or substantial portions of the Software.
+  *
+  * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  * SOFTWARE.
+  ******************************************************************************
+  */
+#include "ds3231.h"
+
+/**
+ * @brief Check a date and time against the ranges the DS3231 can hold.
+ * @param datetime Date and time, hour in 24h format.
+ * @return 1 = valid, 0 = invalid
+ */
+uint8_t ds3231_is_datetime_valid(const ds3231_datetime *datetime)
+{
+    static const uint8_t days_in_month[12] = { 31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+    uint8_t valid = 0;
+    uint16_t year = datetime->year;
+
+    if ((datetime->second < 60) && (datetime->minute < 60) && (datetime->hour < 24) &&
+        (datetime->day_of_week >= 1) && (datetime->day_of_week <= 7) &&
+        (datetime->month >= 1) && (datetime->month <= 12) &&
+        (datetime->date >= 1) && (datetime->date <= days_in_month[datetime->month - 1]) &&
+        (year >= 2000) && (year <= 2199))
+    {
+        /* February 29th only in Gregorian leap years */
+        if ((datetime->month != 2) || (datetime->date != 29) ||
+            (((year % 4) == 0) && (((year % 100) != 0) || ((year % 400) == 0))))
+        {
+            valid = 1;
+        }
+    }
+
+    return valid;
+}
+
+/**
+ * @brief Converts a date and time to Unix epoch seconds.
+ * @param datetime Date and time, hour in 24h format, year 2000 to 2199.
+ * @param epoch Seconds since 1970-01-01 00:00:00.
+ * @return 0 = success, otherwise = failure (invalid date and time)
+ */
+uint8_t ds3231_datetime_to_epoch(const ds3231_datetime *datetime, uint64_t *epoch)
+{
+    uint8_t retval = 0;
+
+    if (ds3231_is_datetime_valid(datetime) == 0)
+    {
+        retval = 1;
+    }
+    else
+    {
+        *epoch = (uint64_t)ds3231_days_from_civil(datetime->year, datetime->month, datetime->date) * 86400
+                 + (uint32_t)datetime->hour * 3600 + (uint32_t)datetime->minute * 60 + datetime->second;
+    }
+
+    return retval;
+}
+
+/**
+ * @brief Converts a date and time to 32-bit Unix epoch seconds.
+ * @param datetime Date and time, hour in 24h format, year 2000 to 2106-02-07 06:28:15.
+ * @param epoch Seconds since 1970-01-01 00:00:00.
+ * @return 0 = success, otherwise = failure (invalid date and time or past the 32-bit range)
+ */
+uint8_t ds3231_datetime_to_epoch32(const ds3231_datetime *datetime, uint32_t *epoch)
+{
+    uint8_t retval = 0;
+    uint64_t epoch64;
+
+    if ((ds3231_datetime_to_epoch(datetime, &epoch64) != 0) || (epoch64 > UINT32_MAX))
+    {
+        retval = 1;
+    }
+    else
+    {
+        *epoch = (uint32_t)epoch64;
+    }
+
+    return retval;
+}
+
+/**
+ * @brief Converts Unix epoch seconds to a date and time, including the day of week.
+ * @param epoch Seconds since 1970-01-01 00:00:00, DS3231_EPOCH_MIN to DS3231_EPOCH_MAX.
+ * @param datetime Date and time, hour in 24h format, day of week 1 (Monday) to 7.
+ * @return 0 = success, otherwise = failure (outside the DS3231 calendar)
+ */
+uint8_t ds3231_epoch_to_datetime(uint64_t epoch, ds3231_datetime *datetime)
+{
+    uint8_t retval = 0;
+    uint32_t days;
+    uint32_t secs;
+
+    if ((epoch < DS3231_EPOCH_MIN) || (epoch > DS3231_EPOCH_MAX))
+    {
+        retval = 1;
+    }
+    else
+    {
+        /* 86400 = 128 * 675 and the range fits 33 bits, so one 32-bit division splits it */
+        days = (uint32_t)(epoch >> 7) / 675;
+        secs = (uint32_t)(epoch - (uint64_t)days * 86400);
+
+        ds3231_civil_from_days((int32_t)days, &datetime->year, &datetime->month, &datetime->date);
+        /* 1970-01-01 was a Thursday */
+        datetime->day_of_week = (uint8_t)((days + 3) % 7 + 1);
+        datetime->hour = (uint8_t)(secs / 3600);
+        secs -= datetime->hour * 3600;
+        datetime->minute = (uint8_t)(secs / 60);
+        datetime->second = (uint8_t)(secs - datetime->minute * 60);
+    }
+
+    return retval;
+}
+
+/**
+ * @brief Converts 32-bit Unix epoch seconds to a date and time.
+ * @param epoch Seconds since 1970-01-01 00:00:00, DS3231_EPOCH_MIN or later.
+ * @param datetime Date and time, hour in 24h format, day of week 1 (Monday) to 7.
+ * @return 0 = success, otherwise = failure (before 2000)
+ */
+uint8_t ds3231_epoch32_to_datetime(uint32_t epoch, ds3231_datetime *datetime)
+{
+    return ds3231_epoch_to_datetime(epoch, datetime);
+}
@@ -71,3 +71,37 @@ uint32_t get_micros_isr(void)
     uint32_t range = (SysTick->LOAD + 1);
     return (ms * 1000) + ((range - st) / (range / 1000));
 }
+
+/**
+ * @brief Start the DWT cycle counter
+ * @note Unlike get_micros() it keeps counting while interrupts are masked
+ */
+void cycle_counter_init(void)
+{
+    if ((DWT->CTRL & DWT_CTRL_CYCCNTENA_Msk) == 0)
+    {
+        CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+        DWT->CYCCNT = 0;
+        DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+    }
+}
+
+/**
+ * @brief Convert core clock cycles to microseconds
+ * @param cycles Number of cycles
+ * @return Number of microseconds, rounded down
+ */
+uint32_t cycles_to_micros(uint32_t cycles)
+{
+    return cycles / (SystemCoreClock / 1000000);
+}
+
+/**
+ * @brief Convert microseconds to core clock cycles
+ * @param micros Number of microseconds, below 2^32 cycles
+ * @return Number of cycles
+ */
+uint32_t micros_to_cycles(uint32_t micros)
+{
+    return micros * (SystemCoreClock / 1000000);
+}
@@ -21,7 +21,12 @@
 #include "i2c.h"
 
 /* USER CODE BEGIN 0 */
+#include "ds3231.h"
 
+#ifdef DS3231_ASYNC_DMA
+DMA_HandleTypeDef hdma_i2c3_rx;
+DMA_HandleTypeDef hdma_i2c3_tx;
+#endif
 /* USER CODE END 0 */
 
 I2C_HandleTypeDef hi2c3;
@@ -89,7 +94,56 @@ void HAL_I2C_MspInit(I2C_HandleTypeDef* i2cHandle)
     /* I2C3 clock enable */
     __HAL_RCC_I2C3_CLK_ENABLE();
   /* USER CODE BEGIN I2C3_MspInit 1 */
-
+#ifdef DS3231_ASYNC_DMA
+    /* I2C3 DMA Init */
+    __HAL_RCC_DMA1_CLK_ENABLE();
+
+    /* I2C3_RX Init */
+    hdma_i2c3_rx.Instance = DMA1_Stream2;
+    hdma_i2c3_rx.Init.Channel = DMA_CHANNEL_3;
+    hdma_i2c3_rx.Init.Direction = DMA_PERIPH_TO_MEMORY;
+    hdma_i2c3_rx.Init.PeriphInc = DMA_PINC_DISABLE;
+    hdma_i2c3_rx.Init.MemInc = DMA_MINC_ENABLE;
+    hdma_i2c3_rx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+    hdma_i2c3_rx.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+    hdma_i2c3_rx.Init.Mode = DMA_NORMAL;
+    hdma_i2c3_rx.Init.Priority = DMA_PRIORITY_LOW;
+    hdma_i2c3_rx.Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+    if (HAL_DMA_Init(&hdma_i2c3_rx) != HAL_OK)
+    {
+      Error_Handler();
+    }
+    __HAL_LINKDMA(i2cHandle, hdmarx, hdma_i2c3_rx);
+
+    /* I2C3_TX Init */
+    hdma_i2c3_tx.Instance = DMA1_Stream4;
+    hdma_i2c3_tx.Init.Channel = DMA_CHANNEL_3;
+    hdma_i2c3_tx.Init.Direction = DMA_MEMORY_TO_PERIPH;
+    hdma_i2c3_tx.Init.PeriphInc = DMA_PINC_DISABLE;
+    hdma_i2c3_tx.Init.MemInc = DMA_MINC_ENABLE;
+    hdma_i2c3_tx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+    hdma_i2c3_tx.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+    hdma_i2c3_tx.Init.Mode = DMA_NORMAL;
+    hdma_i2c3_tx.Init.Priority = DMA_PRIORITY_LOW;
+    hdma_i2c3_tx.Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+    if (HAL_DMA_Init(&hdma_i2c3_tx) != HAL_OK)
+    {
+      Error_Handler();
+    }
+    __HAL_LINKDMA(i2cHandle, hdmatx, hdma_i2c3_tx);
+
+    /* DMA interrupt init */
+    HAL_NVIC_SetPriority(DS3231_DMA_RX_IRQn, 0, 0);
+    HAL_NVIC_EnableIRQ(DS3231_DMA_RX_IRQn);
+    HAL_NVIC_SetPriority(DS3231_DMA_TX_IRQn, 0, 0);
+    HAL_NVIC_EnableIRQ(DS3231_DMA_TX_IRQn);
+#endif
+
+    /* I2C3 interrupt Init */
+    HAL_NVIC_SetPriority(I2C3_EV_IRQn, 0, 0);
+    HAL_NVIC_EnableIRQ(I2C3_EV_IRQn);
+    HAL_NVIC_SetPriority(I2C3_ER_IRQn, 0, 0);
+    HAL_NVIC_EnableIRQ(I2C3_ER_IRQn);
   /* USER CODE END I2C3_MspInit 1 */
   }
 }
@@ -114,7 +168,16 @@ void HAL_I2C_MspDeInit(I2C_HandleTypeDef* i2cHandle)
     HAL_GPIO_DeInit(GPIOA, GPIO_PIN_8);
 
   /* USER CODE BEGIN I2C3_MspDeInit 1 */
-
+    /* I2C3 interrupt Deinit */
+    HAL_NVIC_DisableIRQ(I2C3_EV_IRQn);
+    HAL_NVIC_DisableIRQ(I2C3_ER_IRQn);
+#ifdef DS3231_ASYNC_DMA
+    /* I2C3 DMA DeInit */
+    HAL_DMA_DeInit(i2cHandle->hdmarx);
+    HAL_DMA_DeInit(i2cHandle->hdmatx);
+    HAL_NVIC_DisableIRQ(DS3231_DMA_RX_IRQn);
+    HAL_NVIC_DisableIRQ(DS3231_DMA_TX_IRQn);
+#endif
   /* USER CODE END I2C3_MspDeInit 1 */
   }
 }
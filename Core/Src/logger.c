@@ -37,15 +37,620 @@
 #include <string.h>
 #include "get_time.h"
 #include "ds3231.h"
+#include "wall_clock.h"
 
 /* Deactivate this code for Release Configurations */
 #ifdef DEBUG_LOG
+/* Ring buffer drained by UART2 TX DMA. Indexes run free and are masked on access:
+ * bytes [_log_tail, _log_tail + _log_dma_len) are on the wire, [_log_tail + _log_dma_len,
+ * _log_head) wait for the next transfer. */
+static uint8_t _log_ring[LOGGER_RING_SIZE];
+static volatile uint32_t _log_head = 0;
+static volatile uint32_t _log_tail = 0;
+static volatile uint32_t _log_dma_len = 0;
+static volatile t_log_overflow _log_overflow = LOGGER_OVERFLOW_DEFAULT;
+static volatile t_log_stats _log_stats = { 0 };
+#ifdef LOG_BINARY
+/* First record boundary at or after _log_tail, kept up to date as the DMA releases bytes
+ * so logger_drop_oldest() can walk whole records from it */
+static volatile uint32_t _log_record = 0;
+
+/*
+ * logger_record_end
+ * @brief End of the binary record starting at a ring index, from its length byte
+ * @param start - free running index of the sync byte
+ * @retval - free running index after the record
+ */
+static uint32_t logger_record_end(uint32_t start)
+{
+    return start + 2 + _log_ring[(start + 1) & (LOGGER_RING_SIZE - 1)];
+}
+#endif /* LOG_BINARY */
+
+/* Runtime mask of each module, one word load in LOG() */
+uint32_t logger_module_mask[MAX_LOG_MODULE] =
+{
+    [0 ... (MAX_LOG_MODULE - 1)] = LOG_MODULE_MASK_DEFAULT
+};
+
+/*
+ * logger_start_dma
+ * @brief Start the next UART2 TX DMA transfer when none is running, up to the ring wrap point
+ * @param - none
+ * @retval - none
+ * @note - called after an append and from the transfer complete callback, so transfers
+ *         chain across the wrap point until the ring is empty
+ */
+static void logger_start_dma(void)
+{
+    uint32_t start = 0;
+    uint32_t len = 0;
+    uint32_t primask;
+
+    primask = __get_PRIMASK();
+    __disable_irq();
+    if ((_log_dma_len == 0) && (_log_head != _log_tail))
+    {
+        start = _log_tail & (LOGGER_RING_SIZE - 1);
+        len = _log_head - _log_tail;
+        if (len > (LOGGER_RING_SIZE - start))
+        {
+            len = LOGGER_RING_SIZE - start;
+        }
+        _log_dma_len = len;
+    }
+    __set_PRIMASK(primask);
+
+    if (len != 0)
+    {
+        if (HAL_UART_Transmit_DMA(&huart2, &_log_ring[start], len) != HAL_OK)
+        {
+            errorHandler(ERR_CODE_SYS);
+        }
+    }
+}
+
+/*
+ * logger_irq_can_preempt
+ * @brief Check whether an interrupt would preempt the code that is running now
+ * @param irqn - interrupt number
+ * @retval - 1 = it preempts, 0 = it is masked until the current context returns
+ */
+static uint8_t logger_irq_can_preempt(IRQn_Type irqn)
+{
+    uint8_t retval = 0;
+    uint32_t ipsr = __get_IPSR();
+
+    if (__get_PRIMASK() != 0)
+    {
+        retval = 0;
+    }
+    else if (ipsr == 0)
+    {
+        retval = 1;
+    }
+    else
+    {
+        retval = (NVIC_GetPriority(irqn) < NVIC_GetPriority((IRQn_Type)((int32_t)ipsr - 16))) ? 1 : 0;
+    }
+
+    return retval;
+}
+
+/*
+ * logger_wait_space
+ * @brief Wait until the ring has room for a line, for LOGGER_OVERFLOW_BLOCK
+ * @param len - line length
+ * @retval - none
+ * @note - when the DMA and UART interrupts cannot preempt the caller, e.g. a LOG() from
+ *         an interrupt handler, their handlers are run from here
+ */
+static void logger_wait_space(uint32_t len)
+{
+    uint8_t poll = ((logger_irq_can_preempt(DMA1_Stream6_IRQn) == 0) ||
+                    (logger_irq_can_preempt(USART2_IRQn) == 0)) ? 1 : 0;
+
+    while ((LOGGER_RING_SIZE - (_log_head - _log_tail)) < len)
+    {
+        if (poll != 0)
+        {
+            if (NVIC_GetPendingIRQ(DMA1_Stream6_IRQn) != 0)
+            {
+                NVIC_ClearPendingIRQ(DMA1_Stream6_IRQn);
+                HAL_DMA_IRQHandler(&hdma_usart2_tx);
+            }
+            if (NVIC_GetPendingIRQ(USART2_IRQn) != 0)
+            {
+                NVIC_ClearPendingIRQ(USART2_IRQn);
+                HAL_UART_IRQHandler(&huart2);
+            }
+        }
+    }
+}
+
+/*
+ * logger_drop_oldest
+ * @brief Discard the oldest whole lines that are not on the wire yet until len bytes are free
+ * @param len - bytes needed
+ * @retval - 0 = room made, otherwise = not enough queued lines to discard
+ * @note - called with interrupts masked; the lines after the discarded ones are moved down
+ *         onto them, so the cost is at most one ring copy. The line or binary record partly
+ *         on the wire is kept whole; binary records are walked by their length byte.
+ */
+static uint8_t logger_drop_oldest(uint32_t len)
+{
+    uint8_t retval = 0;
+    uint32_t queued = _log_tail + _log_dma_len;
+#ifdef LOG_BINARY
+    uint32_t keep = _log_record;
+#else
+    uint32_t keep = queued;
+#endif
+    uint32_t drop;
+    uint32_t lines = 0;
+    uint32_t i;
+
+#ifdef LOG_BINARY
+    /* First record boundary at or after the bytes handed to the DMA */
+    while ((int32_t)(queued - keep) > 0)
+    {
+        keep = logger_record_end(keep);
+    }
+#else
+    /* A transfer stopped at the ring wrap point may end inside a line, keep its rest */
+    if ((queued != _log_tail) && (_log_ring[(queued - 1) & (LOGGER_RING_SIZE - 1)] != '\n'))
+    {
+        while ((keep != _log_head) && (_log_ring[keep++ & (LOGGER_RING_SIZE - 1)] != '\n'))
+        {
+        }
+    }
+#endif
+    drop = keep;
+
+    while (((LOGGER_RING_SIZE - (_log_head - _log_tail)) + (drop - keep)) < len)
+    {
+        if (drop == _log_head)
+        {
+            retval = 1;
+            break;
+        }
+#ifdef LOG_BINARY
+        /* Skip to the end of the next record */
+        drop = logger_record_end(drop);
+#else
+        /* Skip to the end of the next line */
+        while ((drop != _log_head) && (_log_ring[drop++ & (LOGGER_RING_SIZE - 1)] != '\n'))
+        {
+        }
+#endif
+        lines++;
+    }
+
+    if (retval == 0)
+    {
+        for (i = 0; (drop + i) != _log_head; i++)
+        {
+            _log_ring[(keep + i) & (LOGGER_RING_SIZE - 1)] = _log_ring[(drop + i) & (LOGGER_RING_SIZE - 1)];
+        }
+        _log_stats.dropped_bytes += drop - keep;
+        _log_stats.dropped_lines += lines;
+        _log_head = keep + i;
+    }
+
+    return retval;
+}
+
+/*
+ * logger_append
+ * @brief Copy a formatted line into the ring and start the DMA if it is idle
+ * @param line - characters to send
+ * @param len - number of characters
+ * @retval - none
+ * @note - a line goes in whole or not at all, the overflow policy decides which
+ */
+static void logger_append(const char *line, uint32_t len)
+{
+    uint8_t stored = 0;
+    uint32_t used;
+    uint32_t head;
+    uint32_t first;
+    uint32_t primask;
+
+    if ((_log_overflow == LOGGER_OVERFLOW_BLOCK) && (len <= LOGGER_RING_SIZE))
+    {
+        logger_wait_space(len);
+    }
+
+    primask = __get_PRIMASK();
+    __disable_irq();
+    if ((len > (LOGGER_RING_SIZE - (_log_head - _log_tail))) &&
+        ((_log_overflow != LOGGER_OVERFLOW_DROP_OLDEST) || (logger_drop_oldest(len) != 0)))
+    {
+        _log_stats.dropped_bytes += len;
+        _log_stats.dropped_lines++;
+    }
+    else
+    {
+        head = _log_head & (LOGGER_RING_SIZE - 1);
+        first = ((LOGGER_RING_SIZE - head) < len) ? (LOGGER_RING_SIZE - head) : len;
+        memcpy(&_log_ring[head], line, first);
+        memcpy(&_log_ring[0], line + first, len - first);
+        _log_head += len;
+        used = _log_head - _log_tail;
+        if (used > _log_stats.high_water)
+        {
+            _log_stats.high_water = used;
+        }
+        stored = 1;
+    }
+    __set_PRIMASK(primask);
+
+    if (stored != 0)
+    {
+        logger_start_dma();
+    }
+}
+
+/*
+ * logger_set_overflow
+ * @brief Select what LOG() does when the ring buffer is full
+ * @param policy - LOGGER_OVERFLOW_DROP_NEWEST, LOGGER_OVERFLOW_DROP_OLDEST or LOGGER_OVERFLOW_BLOCK
+ * @retval - None
+ */
+void logger_set_overflow(t_log_overflow policy)
+{
+    _log_overflow = policy;
+}
+
+/*
+ * logger_get_stats
+ * @brief Copy the overflow counters of the ring buffer
+ * @param [out] stats - dropped bytes and lines, most bytes ever queued
+ * @retval - None
+ */
+void logger_get_stats(t_log_stats *stats)
+{
+    uint32_t primask;
+
+    primask = __get_PRIMASK();
+    __disable_irq();
+    stats->dropped_bytes = _log_stats.dropped_bytes;
+    stats->dropped_lines = _log_stats.dropped_lines;
+    stats->high_water = _log_stats.high_water;
+    __set_PRIMASK(primask);
+}
+
+/*
+ * logger_flush
+ * @brief Wait until every queued line has been sent
+ * @param - None
+ * @retval - None
+ */
+void logger_flush(void)
+{
+    logger_wait_space(LOGGER_RING_SIZE);
+}
+
+/*
+ * logger_set_module_mask
+ * @brief Select the log types a module sends
+ * @param module - source module
+ * @param mask - bit n enables t_log_type n
+ * @retval - None
+ */
+void logger_set_module_mask(t_log_module module, uint32_t mask)
+{
+    if (module < MAX_LOG_MODULE)
+    {
+        logger_module_mask[module] = mask & LOG_MASK_ALL;
+    }
+}
+
+/*
+ * logger_get_module_mask
+ * @brief Read the log types a module sends
+ * @param module - source module
+ * @retval - mask, 0 for an unknown module
+ */
+uint32_t logger_get_module_mask(t_log_module module)
+{
+    uint32_t retval = 0;
+
+    if (module < MAX_LOG_MODULE)
+    {
+        retval = logger_module_mask[module];
+    }
+
+    return retval;
+}
+
+/*
+ * logger_module_name
+ * @brief Name of a module for display
+ * @param module - source module
+ * @retval - name, "?" for an unknown module
+ */
+const char *logger_module_name(t_log_module module)
+{
+    static const char *name[MAX_LOG_MODULE] = { "OTHER", "MAIN", "IRQ", "MENU" };
+
+    return (module < MAX_LOG_MODULE) ? name[module] : "?";
+}
+
+/*
+ * logger_type_name
+ * @brief Name of a log type for display
+ * @param type - log type
+ * @retval - name, "?" for an unknown type
+ */
+const char *logger_type_name(t_log_type type)
+{
+    static const char *name[MAX_LOG_TYPE] = { "CRITICAL", "ERROR", "WARNING", "MSG", "DEBUG" };
+
+    return (type < MAX_LOG_TYPE) ? name[type] : "?";
+}
+
+/*
+ * logger_release
+ * @brief Release the bytes of the finished transfer and chain the next one
+ * @param - none
+ * @retval - none
+ * @note - runs from the UART2 TX DMA interrupts
+ */
+static void logger_release(void)
+{
+    _log_tail += _log_dma_len;
+    _log_dma_len = 0;
+#ifdef LOG_BINARY
+    /* The sent bytes are still intact until the next append */
+    while ((int32_t)(_log_tail - _log_record) > 0)
+    {
+        _log_record = logger_record_end(_log_record);
+    }
+#endif
+    logger_start_dma();
+}
+
+/*
+ * HAL_UART_TxCpltCallback
+ * @brief UART transmit complete: release the sent bytes and chain the next transfer
+ * @param huart [IN] - UART handle instance
+ * @retval - none
+ */
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart)
+{
+    if (huart->Instance == USART2)
+    {
+        logger_release();
+    }
+}
+
+/*
+ * HAL_UART_ErrorCallback
+ * @brief UART error: a failed TX DMA transfer is counted as dropped and the ring moves on,
+ *        otherwise the transfer would stay pending and the ring would never drain
+ * @param huart [IN] - UART handle instance
+ * @retval - none
+ * @note - the HAL has ended the transmission when gState is back to ready
+ */
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart)
+{
+    if ((huart->Instance == USART2) && (huart->gState == HAL_UART_STATE_READY) && (_log_dma_len != 0))
+    {
+        _log_stats.dropped_bytes += _log_dma_len;
+        _log_stats.dropped_lines++;
+        logger_release();
+    }
+}
+
+#ifdef HAVE_DS3231_RTC
+/*
+ * logger_timestamp
+ * @brief Time of a log line from the wall clock, which extrapolates between RTC reads:
+ *        seconds and microseconds come from one coherent sample and no I2C access is made
+ * @param [out] seconds - seconds since 1970-01-01, or since start up when not synchronized
+ * @param [out] micros - microseconds in the second
+ * @retval - none
+ */
+static void logger_timestamp(uint32_t *seconds, uint32_t *micros)
+{
+    wall_clock_time now;
+    uint32_t local_us;
+
+    if (wall_clock_now(&now) == 0)
+    {
+        *seconds = now.seconds;
+        *micros = now.micros;
+    }
+    else
+    {
+        /* Inside an ISR get_micros() would miss a pending SysTick */
+        local_us = (__get_IPSR() != 0) ? get_micros_isr() : get_micros();
+        *seconds = local_us / 1000000;
+        *micros = local_us % 1000000;
+    }
+}
+#endif /* HAVE_DS3231_RTC */
+
+#ifdef LOG_BINARY
+/*
+ * logger_crc8
+ * @brief CRC-8, polynomial 0x07, initial value 0, that closes a binary record so the
+ *        decoder can tell a record from a sync byte inside another one
+ * @param data - bytes to cover
+ * @param len - number of bytes
+ * @retval - CRC
+ */
+static uint8_t logger_crc8(const uint8_t *data, uint32_t len)
+{
+    uint8_t crc = 0;
+    uint32_t i;
+    uint8_t bit;
+
+    for (i = 0; i < len; i++)
+    {
+        crc ^= data[i];
+        for (bit = 0; bit < 8; bit++)
+        {
+            crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1);
+        }
+    }
+
+    return crc;
+}
+
+/*
+ * logger_bin_put
+ * @brief Append bytes to a binary record, in the little endian byte order of the core
+ * @param rec - record being built
+ * @param data - bytes to append
+ * @param len - number of bytes
+ * @retval - none
+ */
+static void logger_bin_put(t_log_record *rec, const void *data, uint32_t len)
+{
+    /* The last byte is kept for the CRC */
+    if ((rec->len + len) > (sizeof(rec->data) - 1))
+    {
+        rec->overflow = 1;
+    }
+    else
+    {
+        memcpy(&rec->data[rec->len], data, len);
+        rec->len += len;
+    }
+}
+
+/*
+ * logger_bin_begin
+ * @brief Start a binary record: sync, call site ID and timestamp
+ * @param rec - record to build
+ * @param site - address of the call site in the .logfmt section, the section starts at 0
+ * @retval - none
+ */
+void logger_bin_begin(t_log_record *rec, uint32_t site)
+{
+    uint16_t id = (uint16_t)site;
+    uint32_t epoch = 0;
+    uint32_t micros;
+
+#ifdef HAVE_DS3231_RTC
+    logger_timestamp(&epoch, &micros);
+#else
+    micros = get_micros();
+#endif
+
+    rec->data[0] = LOGGER_BIN_SYNC;
+    rec->len = 2;
+    rec->overflow = 0;
+    logger_bin_put(rec, &id, sizeof(id));
+    logger_bin_put(rec, &epoch, sizeof(epoch));
+    logger_bin_put(rec, &micros, sizeof(micros));
+}
+
+void logger_bin_u32(t_log_record *rec, uint32_t value)
+{
+    logger_bin_put(rec, &value, sizeof(value));
+}
+
+void logger_bin_u64(t_log_record *rec, uint64_t value)
+{
+    logger_bin_put(rec, &value, sizeof(value));
+}
+
+void logger_bin_f64(t_log_record *rec, double value)
+{
+    logger_bin_put(rec, &value, sizeof(value));
+}
+
+void logger_bin_ptr(t_log_record *rec, const void *value)
+{
+    uint32_t address = (uint32_t)(uintptr_t)value;
+
+    logger_bin_put(rec, &address, sizeof(address));
+}
+
+/*
+ * logger_bin_str
+ * @brief Append a string argument as a length byte and its characters
+ * @param rec - record being built
+ * @param value - string, NULL is sent as "(null)"
+ * @retval - none
+ * @note - strings are cut to the room left in the record
+ */
+void logger_bin_str(t_log_record *rec, const char *value)
+{
+    const char *str = (value == NULL) ? "(null)" : value;
+    uint32_t room = sizeof(rec->data) - 1 - rec->len;
+    uint32_t len = strlen(str);
+    uint8_t len8;
+
+    if (room == 0)
+    {
+        rec->overflow = 1;
+    }
+    else
+    {
+        if (len > (room - 1))
+        {
+            len = room - 1;
+        }
+        if (len > 255)
+        {
+            len = 255;
+        }
+        len8 = (uint8_t)len;
+        logger_bin_put(rec, &len8, sizeof(len8));
+        logger_bin_put(rec, str, len);
+    }
+}
+
+/*
+ * logger_bin_end
+ * @brief Fill in the record length and the CRC and queue the record
+ * @param rec - record built by LOG()
+ * @retval - none
+ * @note - a record whose arguments did not fit is counted as a dropped line
+ */
+void logger_bin_end(t_log_record *rec)
+{
+    uint32_t primask;
+
+    if (rec->overflow != 0)
+    {
+        primask = __get_PRIMASK();
+        __disable_irq();
+        _log_stats.dropped_bytes += rec->len;
+        _log_stats.dropped_lines++;
+        __set_PRIMASK(primask);
+    }
+    else
+    {
+        rec->data[1] = (uint8_t)(rec->len + 1 - 2);
+        rec->data[rec->len] = logger_crc8(&rec->data[1], rec->len - 1);
+        rec->len++;
+        logger_append((const char *)rec->data, rec->len);
+    }
+}
+#endif /* LOG_BINARY */
+
+/*
+ * logger_clamp
+ * @brief Limit the length of a line being formatted after a truncated snprintf()
+ * @param buf_loc - characters formatted so far, snprintf() returns the untruncated length
+ * @retval - buf_loc, at most what leaves room for the CR LF and the '\0' of snprintf()
+ */
+static unsigned int logger_clamp(unsigned int buf_loc)
+{
+    return (buf_loc > (LOGGER_MAX_BUF_LENGTH - 3)) ? (LOGGER_MAX_BUF_LENGTH - 3) : buf_loc;
+}
+
 /*
  * logger_printf_fn
  * @brief Logger printf function
  * @param [ in] type - log type
  * @param [ in] typestring - string corresponding to log type
- * @param [ in] file - name of file logging the buffer
+ * @param [ in] file - base name of file logging the buffer, LOG() resolves it at compile time
  * @param [ in] line - file line number logging the buffer
  * @param [ in] format - printf like format string
  * @param [ in ] ... - printf like arguments
@@ -60,72 +665,58 @@ void logger_printf_fn(t_log_type type,
     char buf[LOGGER_MAX_BUF_LENGTH];
     unsigned int buf_loc = 0;
     va_list args;
-    char const * filename = file;
-    char * pt_c;
 
     va_start(args, format);
 
-    /* Separate UNIX path from file name */
-    if (file != NULL)
+#ifdef HAVE_DS3231_RTC
+    /* Cached wall clock time, no I2C access */
+    ds3231_datetime now = { 0 };
+    uint32_t seconds;
+    uint32_t micros;
+    logger_timestamp(&seconds, &micros);
+    if (ds3231_epoch32_to_datetime(seconds, &now) != 0)
     {
-        pt_c = (char *)file;
-
-        while ((pt_c = strchr(pt_c, (int)'/')) != NULL)
-        {
-            pt_c++;
-            filename = pt_c;
-        }
-
-        /* UNIX path not found? */
-        if ((filename == pt_c) && (NULL != pt_c))
-        {
-            /* Try DOS path */
-            while ((pt_c = strchr(pt_c, (int)'\\')) != NULL)
-            {
-                pt_c++;
-                filename = pt_c;
-            }
-        }
+        /* Not synchronized yet: time since start up with a zero date */
+        now.hour = seconds / 3600;
+        now.minute = (seconds / 60) % 60;
+        now.second = seconds % 60;
     }
 
-#ifdef HAVE_DS3231_RTC
     /* Format the timestamp */
     buf_loc += snprintf(buf + buf_loc, sizeof(buf) - buf_loc - 1,
-                         "%04u-%02u-%02u-%02u:%02u:%02u:%012lu: ",
-                         ds3231_get_year(),
-                         ds3231_get_month(),
-                         ds3231_get_date(),
-                         ds3231_get_hour(),
-                         ds3231_get_minute(),
-                         ds3231_get_second(),
-                         get_micros());
+                         "%04u-%02u-%02u-%02u:%02u:%02u.%06lu: ",
+                         now.year,
+                         now.month,
+                         now.date,
+                         now.hour,
+                         now.minute,
+                         now.second,
+                         micros);
+    buf_loc = logger_clamp(buf_loc);
 #endif
 
     /* Format the log header */
     buf_loc += snprintf(buf + buf_loc, sizeof(buf) - buf_loc - 1,
                        "%-8s: %-16s:%d ",
-                       typestring, (filename == NULL ? "" : filename), line);
+                       typestring, (file == NULL ? "" : file), line);
+    buf_loc = logger_clamp(buf_loc);
 
     /* Format the user's format string and args adding to the output buffer */
     buf_loc += vsnprintf(buf + buf_loc, sizeof(buf) - buf_loc - 1,
                          format, args);
+    buf_loc = logger_clamp(buf_loc);
 
     /* If no newline, add it */
-    if (buf[buf_loc -1] != '\n')
+    if ((buf_loc == 0) || (buf[buf_loc - 1] != '\n'))
     {
         buf[buf_loc] = '\r';
         buf_loc++;
         buf[buf_loc] = '\n';
         buf_loc++;
-        buf[buf_loc] = '\0';
-        buf_loc++;
     }
 
-    /* Call logger output function (Transmit out a Serial UART) */
-    if (HAL_UART_Transmit(&huart2, (uint8_t *)buf, buf_loc - 1, HAL_MAX_DELAY) != HAL_OK)
-    {
-        errorHandler(ERR_CODE_SYS);
-    }
+    /* Queue the line without a terminator, UART2 TX DMA sends it in the background */
+    logger_append(buf, buf_loc);
 
     va_end(args);
 }
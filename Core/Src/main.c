@@ -25,9 +25,12 @@
 /* Private includes ----------------------------------------------------------*/
 /* USER CODE BEGIN Includes */
 #ifdef DEBUG_LOG
+#define LOG_MODULE LOG_MODULE_MAIN
 #include "logger.h"
 #endif
 #include "ds3231.h"
+#include "ds3231_async.h"
+#include "wall_clock.h"
 #include "serial_menu.h"
 /* USER CODE END Includes */
 
@@ -49,6 +52,13 @@
 /* Private variables ---------------------------------------------------------*/
 
 /* USER CODE BEGIN PV */
+/* On-board RTC on I2C3 */
+ds3231_t hds3231;
+static const ds3231_bus_config hds3231_bus =
+{
+    &hi2c3, DS3231_SCL_PORT, DS3231_SCL_PIN, DS3231_SDA_PORT, DS3231_SDA_PIN, MX_I2C3_Init,
+    DS3231_DMA_RX_IRQn, DS3231_DMA_TX_IRQn
+};
 
 /* USER CODE END PV */
 
@@ -105,46 +115,51 @@ int main(void)
       LOG(LOG_MSG, "DS3241 RTC Example by Elray's Software LLC");
 #endif
       /* Initialize the RTC */
-      ds3231_init(&hi2c3);
+      ds3231_init(&hds3231, &hds3231_bus);
+      /* Keep a RAM mirror of the RTC registers, refreshed on every 1Hz SQW edge */
+      ds3231_mirror_enable(&hds3231, DS3231_ENABLED);
+      /* Wall clock extrapolated between RTC reads, anchored on the SQW edges */
+      wall_clock_init(&hds3231);
 
 //      /* Disable interrupts while RTC is configured */
 //      __disable_irq();
 //      /* Initialize the RTC Interrupt mode to Alarm mode */
 //      ds3231_set_interruptMode(DS3231_ALARM_INTERRUPT);
 //      /* Enable the Alarms */
-//      ds3231_enable_alarm_1(DS3231_ENABLED);
-//      ds3231_enable_alarm_2(DS3231_ENABLED);
+//      ds3231_enable_alarm_1(&hds3231, DS3231_ENABLED);
+//      ds3231_enable_alarm_2(&hds3231, DS3231_ENABLED);
 //      /* Set the Alarm 1 */
-//      ds3231_set_alarm_1_mode(DS3231_A1_MATCH_S_M_H);
-//      ds3231_set_alarm_1_second(3);
-//      ds3231_set_alarm_1_minute(30);
-//      ds3231_set_alarm_1_hour(13);
-//      ds3231_set_alarm_1_date(2);
+//      ds3231_alarm_1_config alarm_1 = { DS3231_A1_MATCH_S_M_H, 3, 30, 13, 2 };
+//      if (ds3231_stage_alarm_1(&alarm_1) == 0)
+//      {
+//          ds3231_commit_alarm_1(&hds3231, &alarm_1);
+//      }
 //
-//      /* Set the Alarm 2 Mode */
-//      ds3231_set_alarm_2_mode(DS3231_A2_MATCH_M_H);
-//      ds3231_set_alarm_2_minute(31);
-//      ds3231_set_alarm_2_hour(13);
-//      ds3231_set_alarm_2_day(2);
+//      /* Set the Alarm 2 */
+//      ds3231_alarm_2_config alarm_2 = { DS3231_A2_MATCH_M_H, 31, 13, 2 };
+//      if (ds3231_stage_alarm_2(&alarm_2) == 0)
+//      {
+//          ds3231_commit_alarm_2(&hds3231, &alarm_2);
+//      }
 //
 //      /* Set time */
-//      ds3231_set_full_time(13, 30, 0);
+//      ds3231_set_full_time(&hds3231, 13, 30, 0);
 //      /* Set date */
-//      ds3231_set_full_date(2, 9, 1, 2024);
+//      ds3231_set_full_date(&hds3231, 2, 9, 1, 2024);
 //      /* Enable interrupts after configured */
 //      __enable_irq();
 
 //      char *day[7] = { "MON", "TUE", "WED", "THU", "FRI", "SAT", "SUN" };
 //      LOG(LOG_MSG, "ISO8601 FORMAT: %04d-%02d-%02dT%02d:%02d:%02d %s %d.%02d",
-//          ds3231_get_year(),
-//          ds3231_get_month(),
-//          ds3231_get_date(),
-//          ds3231_get_hour(),
-//          ds3231_get_minute(),
-//          ds3231_get_second(),
-//          day[ds3231_get_day_of_week()-1],
-//          ds3231_get_temperature_integer(),
-//          ds3231_get_temperature_fraction());
+//          ds3231_get_year(&hds3231),
+//          ds3231_get_month(&hds3231),
+//          ds3231_get_date(&hds3231),
+//          ds3231_get_hour(&hds3231),
+//          ds3231_get_minute(&hds3231),
+//          ds3231_get_second(&hds3231),
+//          day[ds3231_get_day_of_week(&hds3231)-1],
+//          ds3231_get_temperature_integer(&hds3231),
+//          ds3231_get_temperature_fraction(&hds3231));
 
   /* USER CODE END 2 */
 
@@ -153,6 +168,9 @@ int main(void)
   while (1)
   {
       rs_232_menu();
+      wall_clock_poll();
+      ds3231_conversion_poll(&hds3231);
+      ds3231_poll(&hds3231);
       HAL_Delay(10);
       LOG(LOG_MSG, "Tick");
     /* USER CODE END WHILE */
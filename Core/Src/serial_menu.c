@@ -36,7 +36,10 @@
 #include "serial_menu.h"
 #include "usart.h"
 #include "ds3231.h"
+#include "ds3231_async.h"
+#include "wall_clock.h"
 #ifdef DEBUG_LOG
+#define LOG_MODULE LOG_MODULE_MENU
 #include "logger.h"
 #endif /* DEBUG_LOG */
 
@@ -49,6 +52,14 @@ rs_232_menu_state_t curr_menu_state = MAIN_MENU_STATE;
 
 void rs_232_main_menu(void);
 void rs_232_rtc_menu(void);
+#ifdef DEBUG_LOG
+void rs_232_log_menu(void);
+void rs_232_print_log_masks(void);
+#endif /* DEBUG_LOG */
+void rs_232_print_conversion(void);
+void rs_232_print_latency(void);
+void rs_232_print_bus_profiles(void);
+void rs_232_print_backends(void);
 void rs_232_menu_start(char *menu_title);
 void rs_232_menu_item(char menu_item_selector, char *menu_item_string);
 void rs_232_menu_end(char *list_of_selectors);
@@ -76,6 +87,13 @@ void rs_232_menu(void)
     case RTC_MENU_STATE_WAITING:
         rs_232_rtc_menu();
         break;
+#ifdef DEBUG_LOG
+    case LOG_MENU_STATE:
+        /* intentional fall through */
+    case LOG_MENU_STATE_WAITING:
+        rs_232_log_menu();
+        break;
+#endif /* DEBUG_LOG */
     }
 }
 
@@ -93,9 +111,16 @@ void rs_232_main_menu(void)
         rs_232_menu_start("Main Menu");
 
         rs_232_menu_item('r', "RTC Menu");
+#ifdef DEBUG_LOG
+        rs_232_menu_item('L', "Log Menu");
+#endif /* DEBUG_LOG */
         rs_232_menu_item('q', "Quit Menu");
 
+#ifdef DEBUG_LOG
+        rs_232_menu_end("rLq");
+#else
         rs_232_menu_end("rq");
+#endif /* DEBUG_LOG */
 
         /* now in waiting state */
         curr_menu_state = MAIN_MENU_STATE_WAITING;
@@ -115,6 +140,11 @@ void rs_232_main_menu(void)
         case 'r':
             curr_menu_state = RTC_MENU_STATE;
             break;
+#ifdef DEBUG_LOG
+        case 'L':
+            curr_menu_state = LOG_MENU_STATE;
+            break;
+#endif /* DEBUG_LOG */
         default:
             rs_232_printf("\r\nUnknown selection: %c\r\n", ch);
             curr_menu_state = MAIN_MENU_STATE;
@@ -144,9 +174,14 @@ void rs_232_rtc_menu(void)
         rs_232_menu_item('H', "Set hour (0-23)");
         rs_232_menu_item('M', "Set Minute (0-59)");
         rs_232_menu_item('S', "Set Second (0-59)");
+        rs_232_menu_item('E', "Set Unix time, send it on a second boundary");
+        rs_232_menu_item('t', "Convert temperature now");
+        rs_232_menu_item('l', "I2C latency histograms");
+        rs_232_menu_item('b', "I2C bus time per API at each speed");
+        rs_232_menu_item('B', "I2C backend benchmark (HAL, LL, queue)");
         rs_232_menu_item('q', "Quit Menu");
 
-        rs_232_menu_end("gDdmyHMSq");
+        rs_232_menu_end("gDdmyHMSEtlbBq");
 
         /* now in waiting state */
         curr_menu_state = RTC_MENU_STATE_WAITING;
@@ -166,105 +201,150 @@ void rs_232_rtc_menu(void)
         case 'g':
             curr_menu_state = RTC_MENU_STATE;
             char *day[7] = { "MON", "TUE", "WED", "THU", "FRI", "SAT", "SUN" };
-            uint8_t temp_whole;
-            uint8_t temp_frac;
-            ds3231_get_temperature_integer(&temp_whole);
-            ds3231_get_temperature_fraction(&temp_frac);
-            rs_232_printf("%04d-%02d-%02dT%02d:%02d:%02d %s %d.%02dC\r\n",
-                            ds3231_get_year(),
-                            ds3231_get_month(),
-                            ds3231_get_date(),
-                            ds3231_get_hour(),
-                            ds3231_get_minute(),
-                            ds3231_get_second(),
-                            day[ds3231_get_day_of_week()-1],
-                            temp_whole,
-                            temp_frac);
+            ds3231_snapshot now;
+            uint16_t temp_abs;
+            if (ds3231_get_snapshot(&hds3231, &now) != 0)
+            {
+                rs_232_printf("Get Time/Date FAILED\r\n");
+                break;
+            }
+            temp_abs = (now.temperature < 0) ? -now.temperature : now.temperature;
+            rs_232_printf("%04d-%02d-%02dT%02d:%02d:%02d %s %s%d.%02dC\r\n",
+                            now.datetime.year,
+                            now.datetime.month,
+                            now.datetime.date,
+                            now.datetime.hour,
+                            now.datetime.minute,
+                            now.datetime.second,
+                            day[(now.datetime.day_of_week + 6) % 7],
+                            (now.temperature < 0) ? "-" : "",
+                            temp_abs / 100,
+                            temp_abs % 100);
             break;
         case 'D':
             curr_menu_state = RTC_MENU_STATE;
             uint8_t day_of_week = atoi(&rs_232_input_line[2]);
-            if (ds3231_set_day_of_week(day_of_week) != 0)
+            if (ds3231_set_day_of_week(&hds3231, day_of_week) != 0)
             {
                 rs_232_printf("Set Day of Week %d FAILED\r\n", day_of_week);
             }
             else
             {
+                wall_clock_invalidate();
                 rs_232_printf("Set Day of Week %d PASSED\r\n", day_of_week);
             }
             break;
         case 'd':
             curr_menu_state = RTC_MENU_STATE;
             uint8_t day_of_month = atoi(&rs_232_input_line[2]);
-            if (ds3231_set_date(day_of_month) != 0)
+            if (ds3231_set_date(&hds3231, day_of_month) != 0)
             {
                 rs_232_printf("Set Day of Month %d FAILED\r\n", day_of_month);
             }
             else
             {
+                wall_clock_invalidate();
                 rs_232_printf("Set Day of Month %d Passed\r\n", day_of_month);
             }
             break;
         case 'm':
             curr_menu_state = RTC_MENU_STATE;
             uint8_t month_of_year = atoi(&rs_232_input_line[2]);
-            if (ds3231_set_month(month_of_year) != 0)
+            if (ds3231_set_month(&hds3231, month_of_year) != 0)
             {
                 rs_232_printf("Set Month of Year %d FAILED\r\n", month_of_year);
             }
             else
             {
+                wall_clock_invalidate();
                 rs_232_printf("Set Month of Year %d Passed\r\n", month_of_year);
             }
             break;
         case 'y':
             curr_menu_state = RTC_MENU_STATE;
             uint8_t year = atoi(&rs_232_input_line[2]);
-            if (ds3231_set_year(year) != 0)
+            if (ds3231_set_year(&hds3231, year) != 0)
             {
                 rs_232_printf("Set Year %d FAILED\r\n", year);
             }
             else
             {
+                wall_clock_invalidate();
                 rs_232_printf("Set Year %d Passed\r\n", year);
             }
             break;
         case 'H':
             curr_menu_state = RTC_MENU_STATE;
             uint8_t hour = atoi(&rs_232_input_line[2]);
-            if (ds3231_set_hour(hour) != 0)
+            if (ds3231_set_hour(&hds3231, hour) != 0)
             {
                 rs_232_printf("Set Hour %d FAILED\r\n", hour);
             }
             else
             {
+                wall_clock_invalidate();
                 rs_232_printf("Set Hour %d Passed\r\n", hour);
             }
             break;
         case 'M':
             curr_menu_state = RTC_MENU_STATE;
             uint8_t minute = atoi(&rs_232_input_line[2]);
-            if (ds3231_set_minute(minute) != 0)
+            if (ds3231_set_minute(&hds3231, minute) != 0)
             {
                 rs_232_printf("Set Minute %d FAILED\r\n", minute);
             }
             else
             {
+                wall_clock_invalidate();
                 rs_232_printf("Set Minute %d Passed\r\n", minute);
             }
             break;
         case 'S':
             curr_menu_state = RTC_MENU_STATE;
             uint8_t second = atoi(&rs_232_input_line[2]);
-            if (ds3231_set_second(second) != 0)
+            if (ds3231_set_second(&hds3231, second) != 0)
             {
                 rs_232_printf("Set Second %d FAILED\r\n", second);
             }
             else
             {
+                wall_clock_invalidate();
                 rs_232_printf("Set Second %d Passed\r\n", second);
             }
             break;
+        case 'E':
+            curr_menu_state = RTC_MENU_STATE;
+            /* The epoch is the reference time when the line arrived, with micros 0: the host
+             * must send the line at the start of that second, any phase it is late by goes
+             * straight into the RTC */
+            uint32_t epoch = strtoul(&rs_232_input_line[2], NULL, 10);
+            int32_t error_us;
+            if (ds3231_set_datetime_at(&hds3231, epoch, 0, &error_us) != 0)
+            {
+                rs_232_printf("Set Unix Time %lu FAILED\r\n", epoch);
+            }
+            else
+            {
+                wall_clock_invalidate();
+                rs_232_printf("Set Unix Time %lu Passed, measured alignment error %ld us\r\n", epoch, error_us);
+            }
+            break;
+        case 't':
+            curr_menu_state = RTC_MENU_STATE;
+            rs_232_print_conversion();
+            break;
+        case 'l':
+            curr_menu_state = RTC_MENU_STATE;
+            rs_232_print_latency();
+            break;
+        case 'b':
+            curr_menu_state = RTC_MENU_STATE;
+            rs_232_print_bus_profiles();
+            break;
+        case 'B':
+            curr_menu_state = RTC_MENU_STATE;
+            rs_232_print_backends();
+            break;
         default:
             rs_232_printf("\r\nUnknown selection: %c\r\n", ch);
             curr_menu_state = RTC_MENU_STATE;
@@ -273,6 +353,277 @@ void rs_232_rtc_menu(void)
     }
 }
 
+#ifdef DEBUG_LOG
+/*
+ * RS-232 Log Menu
+ */
+void rs_232_log_menu(void)
+{
+    uint32_t chars_read;
+    char ch;
+
+    /* print the menu */
+    if (curr_menu_state == LOG_MENU_STATE)
+    {
+        rs_232_menu_start("Log Menu");
+
+        rs_232_menu_item('s', "Show module masks and log buffer counters");
+        rs_232_menu_item('m', "Set module mask (module number, hex mask)");
+        rs_232_menu_item('a', "Set all module masks (hex mask)");
+        rs_232_menu_item('q', "Quit Menu");
+
+        rs_232_menu_end("smaq");
+
+        /* now in waiting state */
+        curr_menu_state = LOG_MENU_STATE_WAITING;
+    }
+    /* wait for user input */
+    chars_read = get_rs_232_input(rs_232_input_line, MAX_RS_232_INPUT_LINE);
+
+    if (chars_read > 0)
+    {
+        ch = rs_232_input_line[0];
+
+        switch (ch)
+        {
+        case 'q':
+            curr_menu_state = MAIN_MENU_STATE;
+            break;
+        case 's':
+            curr_menu_state = LOG_MENU_STATE;
+            rs_232_print_log_masks();
+            break;
+        case 'm':
+            curr_menu_state = LOG_MENU_STATE;
+            char *mask_text;
+            uint32_t module = strtoul(&rs_232_input_line[2], &mask_text, 10);
+            uint32_t mask = strtoul(mask_text, NULL, 16);
+            if (module >= MAX_LOG_MODULE)
+            {
+                rs_232_printf("Set Module %lu Mask FAILED\r\n", module);
+            }
+            else
+            {
+                logger_set_module_mask((t_log_module)module, mask);
+                rs_232_printf("Set Module %s Mask 0x%02lx Passed\r\n",
+                              logger_module_name((t_log_module)module),
+                              logger_get_module_mask((t_log_module)module));
+            }
+            break;
+        case 'a':
+            curr_menu_state = LOG_MENU_STATE;
+            uint32_t all_mask = strtoul(&rs_232_input_line[2], NULL, 16);
+            for (module = 0; module < MAX_LOG_MODULE; module++)
+            {
+                logger_set_module_mask((t_log_module)module, all_mask);
+            }
+            rs_232_printf("Set All Module Masks 0x%02lx Passed\r\n", all_mask & LOG_MASK_ALL);
+            break;
+        default:
+            rs_232_printf("\r\nUnknown selection: %c\r\n", ch);
+            curr_menu_state = LOG_MENU_STATE;
+            break;
+        }
+    }
+}
+#endif /* DEBUG_LOG */
+
+/*
+ * Store the result of an on-demand conversion
+ * @param - dev - DS3231 handle
+ * @param - status - 0 = success
+ * @param - centi_celsius - temperature in hundredths of a degree
+ * @param - context - int32_t result, left at INT32_MIN on failure
+ * @return - none
+ */
+static void rs_232_conversion_done(ds3231_t *dev, uint8_t status, int16_t centi_celsius, void *context)
+{
+    if (status == 0)
+    {
+        *(int32_t *)context = centi_celsius;
+    }
+}
+
+/*
+ * Run an on-demand temperature conversion and print the fresh reading
+ * @param - none
+ * @return - none
+ */
+void rs_232_print_conversion(void)
+{
+    uint32_t start = HAL_GetTick();
+    int32_t result = INT32_MIN;
+    uint16_t temp_abs;
+
+    if (ds3231_start_conversion(&hds3231, rs_232_conversion_done, &result) == 0)
+    {
+        while (ds3231_is_conversion_busy(&hds3231) != 0)
+        {
+            ds3231_conversion_poll(&hds3231);
+        }
+    }
+    if (result == INT32_MIN)
+    {
+        rs_232_printf("Temperature conversion FAILED\r\n");
+    }
+    else
+    {
+        temp_abs = (result < 0) ? -result : result;
+        rs_232_printf("%s%d.%02dC after %lu ms\r\n", (result < 0) ? "-" : "",
+                      temp_abs / 100, temp_abs % 100, HAL_GetTick() - start);
+    }
+}
+
+/*
+ * Print the I2C bus time statistics of the RTC driver, one histogram per operation type
+ * @param - none
+ * @return - none
+ */
+void rs_232_print_latency(void)
+{
+    static const char *op_name[DS3231_OP_COUNT] = { "read", "write", "mirror" };
+    ds3231_latency_stats stats;
+    uint32_t depth;
+    uint32_t max_depth;
+    uint32_t op;
+    uint32_t bucket;
+
+    ds3231_get_queue_depth(&hds3231, &depth, &max_depth);
+    rs_232_printf("Deadline %lu us, bus recoveries %lu, queue depth %lu max %lu\r\n",
+                  ds3231_get_timeout(&hds3231),
+                  ds3231_get_bus_recoveries(&hds3231),
+                  depth,
+                  max_depth);
+    for (op = 0; op < DS3231_OP_COUNT; op++)
+    {
+        ds3231_get_latency_stats(&hds3231, (ds3231_op)op, &stats);
+        rs_232_printf("%-6s count %lu errors %lu timeouts %lu mean %lu us max %lu us\r\n",
+                      op_name[op],
+                      stats.count,
+                      stats.errors,
+                      stats.timeouts,
+                      (stats.count != 0) ? (uint32_t)(stats.total_us / stats.count) : 0,
+                      stats.max_us);
+        rs_232_printf("       queue wait mean %lu us max %lu us\r\n",
+                      (stats.count != 0) ? (uint32_t)(stats.wait_total_us / stats.count) : 0,
+                      stats.wait_max_us);
+        for (bucket = 0; bucket < DS3231_LATENCY_BUCKETS; bucket++)
+        {
+            if (stats.histogram[bucket] == 0)
+            {
+                continue;
+            }
+            if (bucket == DS3231_LATENCY_BUCKETS - 1)
+            {
+                rs_232_printf("    %5lu us and up: %lu\r\n", 1ul << bucket, stats.histogram[bucket]);
+            }
+            else
+            {
+                rs_232_printf("    %5lu - %5lu us: %lu\r\n",
+                              (bucket == 0) ? 0ul : (1ul << bucket),
+                              (1ul << (bucket + 1)) - 1,
+                              stats.histogram[bucket]);
+            }
+        }
+    }
+}
+
+/*
+ * Print the measured bus time of the RTC driver APIs at every I2C speed profile
+ * @param - none
+ * @return - none
+ */
+void rs_232_print_bus_profiles(void)
+{
+    static const char *profile_name[DS3231_BUS_PROFILE_COUNT] = { "Standard", "Fast 2:1", "Fast 16:9" };
+    ds3231_bus_report report;
+    uint32_t profile;
+    uint32_t api;
+
+    rs_232_printf("Active profile: %s\r\n", profile_name[ds3231_get_bus_profile(&hds3231)]);
+    for (profile = 0; profile < DS3231_BUS_PROFILE_COUNT; profile++)
+    {
+        if (ds3231_measure_bus_profile(&hds3231, (ds3231_bus_profile)profile, &report) != 0)
+        {
+            rs_232_printf("%s: FAILED\r\n", profile_name[profile]);
+            continue;
+        }
+        rs_232_printf("%s, SCL %lu Hz\r\n", profile_name[profile], report.clock_hz);
+        for (api = 0; api < DS3231_BUS_API_COUNT; api++)
+        {
+            rs_232_printf("    %-20s mean %5lu us max %5lu us errors %lu\r\n",
+                          report.api[api].name,
+                          report.api[api].mean_us,
+                          report.api[api].max_us,
+                          report.api[api].errors);
+        }
+    }
+}
+
+/*
+ * Print the CPU cycles and bus idle gaps of a full register read on each I2C backend
+ * @param - none
+ * @return - none
+ */
+void rs_232_print_backends(void)
+{
+    ds3231_backend_report report;
+    uint32_t backend;
+
+    if (ds3231_benchmark_backends(&hds3231, &report) != 0)
+    {
+        rs_232_printf("Some reads FAILED\r\n");
+    }
+    rs_232_printf("%u reads of %u registers, SCL %lu Hz, bus time %lu cycles per read\r\n",
+                  DS3231_BENCH_READS, DS3231_REG_COUNT, report.clock_hz, report.bus_cycles);
+    for (backend = 0; backend < DS3231_BACKEND_COUNT; backend++)
+    {
+        rs_232_printf("    %-12s wall %7lu cpu %7lu gap %7lu cycles errors %lu\r\n",
+                      report.backend[backend].name,
+                      report.backend[backend].wall_cycles,
+                      report.backend[backend].cpu_cycles,
+                      report.backend[backend].gap_cycles,
+                      report.backend[backend].errors);
+    }
+}
+
+#ifdef DEBUG_LOG
+/*
+ * Print the log types each module sends and the log ring buffer counters
+ * @param - none
+ * @return - none
+ */
+void rs_232_print_log_masks(void)
+{
+    t_log_stats stats;
+    uint32_t module;
+    uint32_t type;
+    uint32_t mask;
+
+    rs_232_printf("Compiled in down to %s\r\n", logger_type_name(LOG_COMPILE_LEVEL));
+    for (module = 0; module < MAX_LOG_MODULE; module++)
+    {
+        mask = logger_get_module_mask((t_log_module)module);
+        rs_232_printf("    %lu %-6s 0x%02lx", module, logger_module_name((t_log_module)module), mask);
+        for (type = 0; type < MAX_LOG_TYPE; type++)
+        {
+            if ((mask & (1ul << type)) != 0)
+            {
+                rs_232_printf(" %s", logger_type_name((t_log_type)type));
+            }
+        }
+        rs_232_printf("\r\n");
+    }
+
+    logger_get_stats(&stats);
+    rs_232_printf("Dropped lines %lu bytes %lu, most bytes queued %lu of %u\r\n",
+                  stats.dropped_lines,
+                  stats.dropped_bytes,
+                  stats.high_water,
+                  LOGGER_RING_SIZE);
+}
+#endif /* DEBUG_LOG */
+
 /*
  * Menu Start - print the start of the menu
  * @param - menu_title
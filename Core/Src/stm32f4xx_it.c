@@ -22,9 +22,13 @@
 #include "stm32f4xx_it.h"
 /* Private includes ----------------------------------------------------------*/
 /* USER CODE BEGIN Includes */
+#include "i2c.h"
 #include "ds3231.h"
+#include "wall_clock.h"
 #ifdef DEBUG_LOG
+#define LOG_MODULE LOG_MODULE_IRQ
 #include "logger.h"
+#include "usart.h"
 #endif
 /* USER CODE END Includes */
 
@@ -55,6 +59,49 @@
 
 /* Private user code ---------------------------------------------------------*/
 /* USER CODE BEGIN 0 */
+/*
+ * rtc_alarm_event
+ * @brief Report an RTC interrupt once its registers have been read, runs from the I2C interrupt
+ * @param dev - DS3231 handle
+ * @param status - 0 = registers read
+ * @param flags - alarm flags that were set, the driver clears them
+ * @param datetime - time read together with the flags
+ * @param context - unused
+ * @return - none
+ */
+static void rtc_alarm_event(ds3231_t *dev, uint8_t status, uint8_t flags, const ds3231_datetime *datetime, void *context)
+{
+    /* Day of week array */
+    char *day[7] = { "MON", "TUE", "WED", "THU", "FRI", "SAT", "SUN" };
+
+    if (status != 0)
+    {
+        LOG(LOG_MSG, "RTC event read FAILED");
+    }
+    else
+    {
+        if (ds3231_is_mirror_enabled(dev) == 0)
+        {
+            /* ISO8601 format */
+            LOG(LOG_MSG, "ISO8601 FORMAT: %04d-%02d-%02dT%02d:%02d:%02d %s",
+                datetime->year,
+                datetime->month,
+                datetime->date,
+                datetime->hour,
+                datetime->minute,
+                datetime->second,
+                day[(datetime->day_of_week + 6) % 7]);
+        }
+        if (flags & (0x01 << DS3231_A1F))
+        {
+            LOG(LOG_MSG, "Alarm 1 triggered");
+        }
+        if (flags & (0x01 << DS3231_A2F))
+        {
+            LOG(LOG_MSG, "Alarm 2 triggered");
+        }
+    }
+}
 
 /* USER CODE END 0 */
 
@@ -208,31 +255,20 @@ void SysTick_Handler(void)
 void EXTI0_IRQHandler(void)
 {
   /* USER CODE BEGIN EXTI0_IRQn 0 */
-    /* Day of week array */
-    char *day[7] = { "MON", "TUE", "WED", "THU", "FRI", "SAT", "SUN" };
-    /* ISO8601 format */
-    LOG(LOG_MSG, "ISO8601 FORMAT: %04d-%02d-%02dT%02d:%02d:%02d %s",
-        ds3231_get_year(),
-        ds3231_get_month(),
-        ds3231_get_date(),
-        ds3231_get_hour(),
-        ds3231_get_minute(),
-        ds3231_get_second(),
-        day[ds3231_get_day_of_week()-1]);
-    /* Check if any alarm is triggered */
-    if (ds3231_is_alarm_1_triggered())
+    if (ds3231_is_mirror_enabled(&hds3231))
     {
-        ds3231_clear_alarm_1_flag();
-        LOG(LOG_MSG, "Alarm 1 triggered");
+        /* 1Hz square wave edge: the seconds just changed, anchor the wall clock to it
+         * and refresh the register mirror in the background; the alarm flags and the
+         * time come from that same read */
+        wall_clock_on_sqw();
+        ds3231_mirror_event(&hds3231, rtc_alarm_event, NULL);
     }
-    else if(ds3231_is_alarm_2_triggered())
+    else
     {
-        ds3231_clear_alarm_2_flag();
-        LOG(LOG_MSG, "Alarm 2 triggered");
+        /* Read the time and the alarm flags and clear the raised ones from the I2C interrupts,
+         * queued so a transfer the main loop has on the bus is never disturbed */
+        ds3231_alarm_event(&hds3231, rtc_alarm_event, NULL);
     }
-    /* For demonstration purpose, clear all flags */
-    ds3231_clear_alarm_1_flag();
-    ds3231_clear_alarm_2_flag();
 
   /* USER CODE END EXTI0_IRQn 0 */
   HAL_GPIO_EXTI_IRQHandler(GPIO_EXTI0_RTC_Pin);
@@ -257,4 +293,56 @@ void USART3_IRQHandler(void)
 
 /* USER CODE BEGIN 1 */
 
+/**
+  * @brief This function handles I2C3 event interrupt.
+  */
+void I2C3_EV_IRQHandler(void)
+{
+  HAL_I2C_EV_IRQHandler(&hi2c3);
+}
+
+/**
+  * @brief This function handles I2C3 error interrupt.
+  */
+void I2C3_ER_IRQHandler(void)
+{
+  HAL_I2C_ER_IRQHandler(&hi2c3);
+}
+
+#ifdef DS3231_ASYNC_DMA
+/**
+  * @brief This function handles DMA1 stream2 global interrupt (I2C3_RX).
+  */
+void DMA1_Stream2_IRQHandler(void)
+{
+  HAL_DMA_IRQHandler(&hdma_i2c3_rx);
+}
+
+/**
+  * @brief This function handles DMA1 stream4 global interrupt (I2C3_TX).
+  */
+void DMA1_Stream4_IRQHandler(void)
+{
+  HAL_DMA_IRQHandler(&hdma_i2c3_tx);
+}
+#endif
+
+#ifdef DEBUG_LOG
+/**
+  * @brief This function handles DMA1 stream6 global interrupt (USART2_TX, logger output).
+  */
+void DMA1_Stream6_IRQHandler(void)
+{
+  HAL_DMA_IRQHandler(&hdma_usart2_tx);
+}
+
+/**
+  * @brief This function handles USART2 global interrupt (logger output).
+  */
+void USART2_IRQHandler(void)
+{
+  HAL_UART_IRQHandler(&huart2);
+}
+#endif
+
 /* USER CODE END 1 */
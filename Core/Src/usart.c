@@ -30,6 +30,10 @@ uint16_t rs_232_tail = 0;                   // tail pointer for reading
 uint8_t rs_232_rx_index = 0;                // data index
 uint8_t rs_232_rx_data[RS_232_RXBUFLENGTH]; // receive data
 
+#ifdef DEBUG_LOG
+/* Logger output, drains the logger ring buffer */
+DMA_HandleTypeDef hdma_usart2_tx;
+#endif
 /* USER CODE END 0 */
 
 UART_HandleTypeDef huart2;
@@ -119,7 +123,33 @@ void HAL_UART_MspInit(UART_HandleTypeDef* uartHandle)
     HAL_GPIO_Init(GPIOA, &GPIO_InitStruct);
 
   /* USER CODE BEGIN USART2_MspInit 1 */
-
+#ifdef DEBUG_LOG
+    /* USART2 DMA Init */
+    __HAL_RCC_DMA1_CLK_ENABLE();
+
+    /* USART2_TX Init */
+    hdma_usart2_tx.Instance = DMA1_Stream6;
+    hdma_usart2_tx.Init.Channel = DMA_CHANNEL_4;
+    hdma_usart2_tx.Init.Direction = DMA_MEMORY_TO_PERIPH;
+    hdma_usart2_tx.Init.PeriphInc = DMA_PINC_DISABLE;
+    hdma_usart2_tx.Init.MemInc = DMA_MINC_ENABLE;
+    hdma_usart2_tx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+    hdma_usart2_tx.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+    hdma_usart2_tx.Init.Mode = DMA_NORMAL;
+    hdma_usart2_tx.Init.Priority = DMA_PRIORITY_LOW;
+    hdma_usart2_tx.Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+    if (HAL_DMA_Init(&hdma_usart2_tx) != HAL_OK)
+    {
+      Error_Handler();
+    }
+    __HAL_LINKDMA(uartHandle, hdmatx, hdma_usart2_tx);
+
+    /* DMA and USART2 interrupt Init, the transfer completes on the USART TC interrupt */
+    HAL_NVIC_SetPriority(DMA1_Stream6_IRQn, 0, 0);
+    HAL_NVIC_EnableIRQ(DMA1_Stream6_IRQn);
+    HAL_NVIC_SetPriority(USART2_IRQn, 0, 0);
+    HAL_NVIC_EnableIRQ(USART2_IRQn);
+#endif
   /* USER CODE END USART2_MspInit 1 */
   }
   else if(uartHandle->Instance==USART3)
@@ -177,7 +207,12 @@ void HAL_UART_MspDeInit(UART_HandleTypeDef* uartHandle)
     HAL_GPIO_DeInit(GPIOA, USART_TX_Pin|USART_RX_Pin);
 
   /* USER CODE BEGIN USART2_MspDeInit 1 */
-
+#ifdef DEBUG_LOG
+    /* USART2 DMA and interrupt DeInit */
+    HAL_DMA_DeInit(uartHandle->hdmatx);
+    HAL_NVIC_DisableIRQ(DMA1_Stream6_IRQn);
+    HAL_NVIC_DisableIRQ(USART2_IRQn);
+#endif
   /* USER CODE END USART2_MspDeInit 1 */
   }
   else if(uartHandle->Instance==USART3)
@@ -0,0 +1,352 @@
+/**
+  ******************************************************************************
+  * @file           : wall_clock.c
+  * @brief          : Wall clock extrapolated from the DS3231 without I2C on the read path
+  * @note           : STM32CubeIDE Environment
+  ******************************************************************************
+  * @attention
+  *
+  * MIT License
+  *
+  * Copyright (c) 2024 Elray's Software LLC, elrays@sbcglobal.net
+  *
+  * Permission is hereby granted, free of charge, to any person obtaining a copy
+  * of this software and associated documentation files (the "Software"), to deal
+  * in the Software without restriction, including without limitation the rights
+  * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  * copies of the Software, and to permit persons to whom the Software is
+  * furnished to do so, subject to the following conditions:
+  *
+  * The above copyright notice and this permission notice shall be included in all
+  * copies or substantial portions of the Software.
+  *
+  * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  * SOFTWARE.
+  ******************************************************************************
+  */
+
+#include "wall_clock.h"
+#include "get_time.h"
+#include "ds3231.h"
+#include "stm32f4xx_hal.h"
+
+/* Keep an edge anchor without edges only while its error stays below half a second
+ * and its age stays well inside the wrap of get_micros() */
+#define WALL_CLOCK_MAX_ANCHOR_ERROR_US  500000
+#define WALL_CLOCK_MAX_ANCHOR_AGE_US    1800000000
+
+/* Point in local time where the wall clock is known */
+typedef struct
+{
+    uint32_t seconds;           /* wall clock seconds at the anchor */
+    uint32_t micros;            /* wall clock microseconds at the anchor */
+    uint32_t local_us;          /* get_micros() at the anchor */
+    uint32_t error_us;          /* uncertainty at the anchor */
+    wall_clock_source source;
+} wall_clock_anchor;
+
+/* Written by the SQW edge interrupt and the thread, always under PRIMASK in the thread */
+static volatile wall_clock_anchor _wc_anchor = { 0, 0, 0, 0, WALL_CLOCK_UNSYNCED };
+/* get_micros() before the register read of a WALL_CLOCK_SYNC_READ anchor */
+static volatile uint32_t _wc_read_start_us = 0;
+/* Set by the edge interrupt when it could not place an edge */
+static volatile uint8_t _wc_resync_pending = 0;
+/* RTC the wall clock follows, its SQW output drives wall_clock_on_sqw() */
+static ds3231_t *_wc_dev = NULL;
+/* HAL tick of the last register read */
+static uint32_t _wc_sync_tick = 0;
+/* HAL tick of the last read attempt of wall_clock_poll() */
+static uint32_t _wc_attempt_tick = 0;
+
+/* Measured SysTick microseconds per RTC second, and its inverse as Q31 */
+static volatile uint32_t _wc_local_per_sec = 1000000;
+static volatile uint32_t _wc_scale_q31 = 0x80000000;
+static volatile uint8_t _wc_calibrated = 0;
+/* Running rate measurement */
+static uint32_t _wc_cal_local_sum = 0;
+static uint32_t _wc_cal_count = 0;
+
+/*
+ * wall_clock_drift_us
+ * @brief Error bound accumulated over a local time interval
+ * @param - elapsed_us - local microseconds since the anchor
+ * @return - error bound in microseconds, rounded up
+ */
+static uint32_t wall_clock_drift_us(uint32_t elapsed_us)
+{
+    /* ppm * 4295 is ppm / 1e6 as Q32, rounded up */
+    uint32_t ppm = _wc_calibrated ? WALL_CLOCK_DRIFT_PPM_CAL : WALL_CLOCK_DRIFT_PPM_UNCAL;
+
+    return (uint32_t)(((uint64_t)elapsed_us * (ppm * 4295u)) >> 32) + 1;
+}
+
+/*
+ * wall_clock_extrapolate
+ * @brief Advance an anchor to a local time
+ * @param - anchor - anchor to start from
+ * @param - local_us - get_micros() value to extrapolate to
+ * @param - now - extrapolated time
+ * @return - none
+ */
+static void wall_clock_extrapolate(const wall_clock_anchor *anchor, uint32_t local_us, wall_clock_time *now)
+{
+    uint32_t elapsed = local_us - anchor->local_us;
+    /* Rate corrected elapsed time, the anchor age is kept below 2^31 us so this fits */
+    uint32_t wall_us = (uint32_t)(((uint64_t)elapsed * _wc_scale_q31) >> 31);
+    uint32_t micros = anchor->micros + wall_us % 1000000;
+    uint32_t seconds = anchor->seconds + wall_us / 1000000;
+
+    if (micros >= 1000000)
+    {
+        micros -= 1000000;
+        seconds++;
+    }
+
+    now->seconds = seconds;
+    now->micros = micros;
+    now->error_us = anchor->error_us + wall_clock_drift_us(elapsed);
+    now->source = anchor->source;
+}
+
+/*
+ * wall_clock_calibrate
+ * @brief Feed one measured RTC second into the rate measurement
+ * @param - local_us - SysTick microseconds between two adjacent SQW edges
+ * @return - none
+ * @note - called from the SQW edge interrupt
+ */
+static void wall_clock_calibrate(uint32_t local_us)
+{
+    _wc_cal_local_sum += local_us;
+    _wc_cal_count++;
+
+    if (_wc_cal_count >= WALL_CLOCK_CAL_SAMPLES)
+    {
+        _wc_local_per_sec = (_wc_cal_local_sum + _wc_cal_count / 2) / _wc_cal_count;
+        _wc_scale_q31 = (uint32_t)((1000000ull << 31) / _wc_local_per_sec);
+        _wc_calibrated = 1;
+        _wc_cal_local_sum = 0;
+        _wc_cal_count = 0;
+    }
+}
+
+/*
+ * wall_clock_init
+ * @brief Synchronize the wall clock from the RTC
+ * @param - dev - DS3231 handle of the RTC to follow
+ * @return - 0 = success, otherwise = failure
+ * @note - call after ds3231_init(), and after ds3231_mirror_enable() when the SQW
+ *         edges are wanted for sub-second accuracy
+ */
+uint8_t wall_clock_init(ds3231_t *dev)
+{
+    _wc_dev = dev;
+    _wc_calibrated = 0;
+    _wc_local_per_sec = 1000000;
+    _wc_scale_q31 = 0x80000000;
+    _wc_cal_local_sum = 0;
+    _wc_cal_count = 0;
+    _wc_anchor.source = WALL_CLOCK_UNSYNCED;
+
+    return wall_clock_sync();
+}
+
+/*
+ * wall_clock_sync
+ * @brief Read the RTC and re-anchor the wall clock when it disagrees with the extrapolation
+ * @param - none
+ * @return - 0 = success, otherwise = failure
+ * @note - an edge anchor that still matches the RTC is kept because it is far more
+ *         accurate than a register read; the next SQW edge refines a read anchor
+ */
+uint8_t wall_clock_sync(void)
+{
+    uint8_t retval = 1;
+    uint8_t status;
+    ds3231_datetime dt;
+    wall_clock_anchor anchor;
+    wall_clock_time start;
+    wall_clock_time end;
+    uint32_t start_us;
+    uint32_t end_us;
+    uint32_t seconds;
+    uint32_t primask;
+
+    start_us = get_micros();
+    status = ds3231_get_datetime(_wc_dev, &dt);
+    end_us = get_micros();
+    if ((status == 0) && (ds3231_datetime_to_epoch32(&dt, &seconds) == 0))
+    {
+        _wc_sync_tick = get_millis();
+
+        primask = __get_PRIMASK();
+        __disable_irq();
+        anchor = _wc_anchor;
+        if (anchor.source == WALL_CLOCK_SYNC_EDGE)
+        {
+            /* The RTC was sampled somewhere between start_us and end_us */
+            wall_clock_extrapolate(&anchor, start_us, &start);
+            wall_clock_extrapolate(&anchor, end_us, &end);
+            if (((start.seconds != seconds) && (end.seconds != seconds)) ||
+                (end.error_us > WALL_CLOCK_MAX_ANCHOR_ERROR_US) ||
+                ((end_us - anchor.local_us) > WALL_CLOCK_MAX_ANCHOR_AGE_US))
+            {
+                anchor.source = WALL_CLOCK_SYNC_READ;
+            }
+        }
+        else
+        {
+            anchor.source = WALL_CLOCK_SYNC_READ;
+        }
+
+        if (anchor.source == WALL_CLOCK_SYNC_READ)
+        {
+            /* The second is known, its phase is not: aim at the middle of it */
+            anchor.seconds = seconds;
+            anchor.micros = 500000;
+            anchor.local_us = end_us;
+            anchor.error_us = 500000 + (end_us - start_us);
+            _wc_read_start_us = start_us;
+            _wc_anchor = anchor;
+        }
+        _wc_resync_pending = 0;
+        __set_PRIMASK(primask);
+
+        retval = 0;
+    }
+
+    return retval;
+}
+
+/*
+ * wall_clock_invalidate
+ * @brief Drop the current anchor, the next wall_clock_poll() resynchronizes
+ * @param - none
+ * @return - none
+ * @note - call after writing the RTC time: writing the seconds register also
+ *         restarts the SQW countdown, so the edge phase is no longer valid
+ */
+void wall_clock_invalidate(void)
+{
+    _wc_anchor.source = WALL_CLOCK_UNSYNCED;
+}
+
+/*
+ * wall_clock_poll
+ * @brief Periodic service, resynchronizes from the RTC when needed
+ * @param - none
+ * @return - none
+ * @note - call from the main loop; it only touches the bus when unsynchronized,
+ *         when an edge could not be placed, or every WALL_CLOCK_RESYNC_MS, and
+ *         never more often than every WALL_CLOCK_RETRY_MS
+ */
+void wall_clock_poll(void)
+{
+    uint32_t tick = get_millis();
+
+    if (((_wc_anchor.source == WALL_CLOCK_UNSYNCED) ||
+         (_wc_resync_pending != 0) ||
+         ((tick - _wc_sync_tick) >= WALL_CLOCK_RESYNC_MS)) &&
+        ((tick - _wc_attempt_tick) >= WALL_CLOCK_RETRY_MS))
+    {
+        _wc_attempt_tick = tick;
+        wall_clock_sync();
+    }
+}
+
+/*
+ * wall_clock_on_sqw
+ * @brief Re-anchor the wall clock to a 1Hz SQW falling edge
+ * @param - none
+ * @return - none
+ * @note - call first thing in the EXTI handler of the SQW pin, the timestamp is
+ *         taken on entry
+ */
+void wall_clock_on_sqw(void)
+{
+    uint32_t edge_us = get_micros_isr();
+    uint32_t local_per_sec = _wc_local_per_sec;
+    uint32_t elapsed = edge_us - _wc_anchor.local_us;
+    uint32_t seconds;
+    int32_t residual;
+
+    if (_wc_anchor.source == WALL_CLOCK_SYNC_EDGE)
+    {
+        /* Whole RTC seconds since the last edge, tolerating missed edges */
+        seconds = (elapsed + local_per_sec / 2) / local_per_sec;
+        residual = (int32_t)(elapsed - seconds * local_per_sec);
+        if ((seconds != 0) && (residual < (int32_t)(local_per_sec / 20)) && (residual > -(int32_t)(local_per_sec / 20)))
+        {
+            if (seconds == 1)
+            {
+                wall_clock_calibrate(elapsed);
+            }
+            _wc_anchor.seconds += seconds;
+            _wc_anchor.micros = 0;
+            _wc_anchor.local_us = edge_us;
+            _wc_anchor.error_us = WALL_CLOCK_EDGE_LATENCY_US;
+        }
+        /* Otherwise a glitch on the pin: keep extrapolating */
+    }
+    else if (_wc_anchor.source == WALL_CLOCK_SYNC_READ)
+    {
+        /* The first edge after the read starts the next second, unless it
+         * fell inside the read where the sampled second is ambiguous */
+        if (((edge_us - _wc_read_start_us) > (_wc_anchor.local_us - _wc_read_start_us)) &&
+            (elapsed < local_per_sec + local_per_sec / 20))
+        {
+            _wc_anchor.seconds += 1;
+            _wc_anchor.micros = 0;
+            _wc_anchor.local_us = edge_us;
+            _wc_anchor.error_us = WALL_CLOCK_EDGE_LATENCY_US;
+            _wc_anchor.source = WALL_CLOCK_SYNC_EDGE;
+        }
+        else
+        {
+            _wc_resync_pending = 1;
+        }
+    }
+}
+
+/*
+ * wall_clock_now
+ * @brief Current wall clock time, extrapolated without any bus access
+ * @param - now - extrapolated time with its error bound
+ * @return - 0 = success, otherwise = failure (not synchronized yet)
+ * @note - callable from thread and interrupt context
+ */
+uint8_t wall_clock_now(wall_clock_time *now)
+{
+    uint8_t retval = 1;
+    wall_clock_anchor anchor;
+    uint32_t local_us;
+    uint32_t primask;
+
+    primask = __get_PRIMASK();
+    __disable_irq();
+    anchor = _wc_anchor;
+    __set_PRIMASK(primask);
+
+    /* Inside an ISR get_micros() would miss a pending SysTick */
+    local_us = (__get_IPSR() != 0) ? get_micros_isr() : get_micros();
+
+    if (anchor.source != WALL_CLOCK_UNSYNCED)
+    {
+        wall_clock_extrapolate(&anchor, local_us, now);
+        retval = 0;
+    }
+    else
+    {
+        now->seconds = 0;
+        now->micros = 0;
+        now->error_us = UINT32_MAX;
+        now->source = WALL_CLOCK_UNSYNCED;
+    }
+
+    return retval;
+}
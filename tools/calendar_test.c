@@ -0,0 +1,169 @@
+/*
+ * calendar_test.c - check the DS3231 calendar and epoch conversions against the C library
+ *
+ * Runs on a PC, not on the board. From the repository root:
+ *
+ *   gcc -O2 -Wall -DUSE_HAL_DRIVER -DSTM32F446xx -ICore/Inc -IDrivers/STM32F4xx_HAL_Driver/Inc \
+ *       -IDrivers/CMSIS/Device/ST/STM32F4xx/Include -IDrivers/CMSIS/Include \
+ *       tools/calendar_test.c Core/Src/ds3231_calendar.c -o calendar_test && ./calendar_test
+ *
+ * The HAL headers are only parsed, nothing from the HAL is called. Needs a 64-bit time_t.
+ * Every day of 1970 to 9999 goes through ds3231_days_from_civil() and ds3231_civil_from_days(),
+ * every day of the DS3231 calendar and random seconds through the epoch conversions.
+ * Prints the first mismatches and returns 1 if there were any.
+ */
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ds3231.h"
+
+#define RANDOM_SECONDS  10000000
+#define REPORT_MAX      10
+
+static unsigned long _failures;
+
+/*
+ * Count a mismatch and print the first few
+ * @param what - conversion that failed
+ * @param value - input of the conversion
+ */
+static void fail(const char *what, long long value)
+{
+    if (_failures++ < REPORT_MAX)
+    {
+        printf("FAIL %s %lld\n", what, value);
+    }
+}
+
+/*
+ * 64-bit random number, rand() only guarantees 15 bits
+ * @return - random number
+ */
+static unsigned long long random64(void)
+{
+    unsigned long long value = 0;
+    int i;
+
+    for (i = 0; i < 5; i++)
+    {
+        value = (value << 15) ^ (unsigned long long)(rand() & 0x7fff);
+    }
+
+    return value;
+}
+
+/*
+ * Check the inline day count conversions for one day
+ * @param days - days since 1970-01-01
+ */
+static void check_days(int32_t days)
+{
+    time_t t = (time_t)days * 86400;
+    struct tm tm;
+    uint16_t year;
+    uint8_t month;
+    uint8_t date;
+
+    gmtime_r(&t, &tm);
+    if (ds3231_days_from_civil(tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday) != days)
+    {
+        fail("ds3231_days_from_civil", days);
+    }
+
+    ds3231_civil_from_days(days, &year, &month, &date);
+    if ((year != tm.tm_year + 1900) || (month != tm.tm_mon + 1) || (date != tm.tm_mday))
+    {
+        fail("ds3231_civil_from_days", days);
+    }
+}
+
+/*
+ * Check the epoch conversions for one second of the DS3231 calendar
+ * @param epoch - seconds since 1970-01-01 00:00:00
+ */
+static void check_epoch(uint64_t epoch)
+{
+    time_t t = (time_t)epoch;
+    struct tm tm;
+    ds3231_datetime datetime;
+    uint64_t back;
+    uint32_t back32;
+
+    gmtime_r(&t, &tm);
+    if ((ds3231_epoch_to_datetime(epoch, &datetime) != 0) ||
+        (datetime.year != tm.tm_year + 1900) || (datetime.month != tm.tm_mon + 1) ||
+        (datetime.date != tm.tm_mday) || (datetime.hour != tm.tm_hour) ||
+        (datetime.minute != tm.tm_min) || (datetime.second != tm.tm_sec) ||
+        /* tm_wday 0 = Sunday, DS3231 day of week 1 = Monday to 7 = Sunday */
+        (datetime.day_of_week != (tm.tm_wday + 6) % 7 + 1))
+    {
+        fail("ds3231_epoch_to_datetime", (long long)epoch);
+        return;
+    }
+
+    if ((ds3231_datetime_to_epoch(&datetime, &back) != 0) || (back != epoch) ||
+        ((uint64_t)timegm(&tm) != epoch))
+    {
+        fail("ds3231_datetime_to_epoch", (long long)epoch);
+    }
+
+    if ((ds3231_datetime_to_epoch32(&datetime, &back32) == 0) != (epoch <= UINT32_MAX))
+    {
+        fail("ds3231_datetime_to_epoch32", (long long)epoch);
+    }
+}
+
+int main(void)
+{
+    ds3231_datetime datetime;
+    uint64_t epoch;
+    int32_t days;
+    long i;
+
+    if (sizeof(time_t) < 8)
+    {
+        printf("time_t is %u bytes, need 8\n", (unsigned)sizeof(time_t));
+        return 1;
+    }
+
+    /* 1970-01-01 to 9999-12-31 */
+    for (days = 0; days <= 2932896; days++)
+    {
+        check_days(days);
+    }
+
+    /* Both ends of every day of the DS3231 calendar */
+    for (epoch = DS3231_EPOCH_MIN; epoch <= DS3231_EPOCH_MAX; epoch += 86400)
+    {
+        check_epoch(epoch);
+        check_epoch(epoch + 86399);
+    }
+
+    srand(3231);
+    for (i = 0; i < RANDOM_SECONDS; i++)
+    {
+        check_epoch(DS3231_EPOCH_MIN + random64() % (DS3231_EPOCH_MAX - DS3231_EPOCH_MIN + 1));
+    }
+
+    /* Outside the calendar and impossible dates are refused */
+    if ((ds3231_epoch_to_datetime(DS3231_EPOCH_MIN - 1, &datetime) == 0) ||
+        (ds3231_epoch_to_datetime(DS3231_EPOCH_MAX + 1, &datetime) == 0))
+    {
+        fail("ds3231_epoch_to_datetime range", 0);
+    }
+    memset(&datetime, 0, sizeof(datetime));
+    datetime.year = 2100;
+    datetime.month = 2;
+    datetime.date = 29;
+    datetime.day_of_week = 1;
+    if (ds3231_datetime_to_epoch(&datetime, &epoch) == 0)
+    {
+        fail("ds3231_datetime_to_epoch 2100-02-29", 0);
+    }
+
+    printf("%s, %lu failures\n", (_failures == 0) ? "PASS" : "FAIL", _failures);
+
+    return (_failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,209 @@
+#!/usr/bin/env python3
+"""
+logdecode.py - turn the binary LOG() records of the firmware back into text lines
+
+Build the firmware with LOG_BINARY defined (Core/Inc/logger.h), capture UART2 and run
+
+    python3 tools/logdecode.py Debug/STM32_NUCLEO_F446RE_DS3231_RTC.elf capture.bin
+    python3 tools/logdecode.py firmware.elf /dev/ttyACM0
+
+The call sites (type, file, line, format) are read from the .logfmt section of the ELF
+file, which is not loaded on the target. The ID in each record is the offset of its call
+site in that section. The ELF file must be the one running on the board.
+
+Record: 0xA5, length of the rest, site ID (16 bit), Unix time (32 bit), microseconds in
+that second (32 bit), arguments, CRC-8 (polynomial 0x07) of the length byte through the
+last argument. All fields little endian. Python 3 standard library only.
+"""
+
+import argparse
+import datetime
+import re
+import struct
+import sys
+
+SYNC = 0xA5
+HEADER = 10          # bytes after the length byte before the arguments
+RECORD_MAX = 74      # LOGGER_BIN_MAX less the sync and length bytes
+EPOCH_MIN = 946684800  # 2000-01-01, first second of the DS3231 calendar
+
+CONVERSION = re.compile(r"%([-+ #0]*)(\*|\d+)?(?:\.(\*|\d+))?(hh|h|ll|l|j|z|t|L)?([diouxXcfFeEgGsp%])")
+
+
+def read_logfmt(path):
+    """Return {offset: (type, file, line, format)} from the .logfmt section of an ELF32 file."""
+    with open(path, "rb") as f:
+        elf = f.read()
+    if elf[:4] != b"\x7fELF" or elf[4] != 1:
+        sys.exit("%s: not an ELF32 file" % path)
+    endian = "<" if elf[5] == 1 else ">"
+    shoff, = struct.unpack_from(endian + "I", elf, 0x20)
+    shentsize, shnum, shstrndx = struct.unpack_from(endian + "HHH", elf, 0x2E)
+
+    def section(index):
+        return struct.unpack_from(endian + "IIIIIIIIII", elf, shoff + index * shentsize)
+
+    names = section(shstrndx)
+    for index in range(shnum):
+        sh = section(index)
+        name = elf[names[4] + sh[0]:].split(b"\0", 1)[0]
+        if name == b".logfmt":
+            data = elf[sh[4]:sh[4] + sh[5]]
+            break
+    else:
+        sys.exit("%s: no .logfmt section, was the firmware built with LOG_BINARY?" % path)
+
+    if len(data) > 0x10000:
+        sys.exit("%s: .logfmt is %u bytes, site IDs are 16 bit" % (path, len(data)))
+
+    sites = {}
+    offset = 0
+    while offset < len(data):
+        # Each site: type \0 file \0 line \0 format \0, padding between sites is \0
+        if data[offset] == 0:
+            offset += 1
+            continue
+        fields = data[offset:].split(b"\0", 4)
+        if len(fields) < 4:
+            break
+        kind, file, line, fmt = (x.decode("latin-1") for x in fields[:4])
+        sites[offset] = (kind, file, int(line), fmt)
+        offset += sum(len(x) + 1 for x in fields[:4])
+    return sites
+
+
+def decode_args(fmt, payload):
+    """Split the argument bytes following the printf conversions of fmt.
+
+    Returns the format with length modifiers removed, so Python % formatting accepts
+    it, and the argument tuple."""
+    args = []
+    pos = 0
+
+    def take(size, code):
+        nonlocal pos
+        value, = struct.unpack_from("<" + code, payload, pos)
+        pos += size
+        return value
+
+    def convert(match):
+        flags, width, precision, length, conv = match.groups()
+        if conv == "%":
+            return "%%"
+        for star in (width, precision):
+            if star == "*":
+                args.append(take(4, "i"))
+        if conv == "s":
+            size = payload[pos]
+            args.append(payload[pos + 1:pos + 1 + size].decode("latin-1"))
+            take(1 + size, "%ds" % (1 + size))
+        elif conv == "p":
+            args.append(take(4, "I"))
+            return "0x%08x"
+        elif conv in "fFeEgG":
+            args.append(take(8, "d"))
+        elif length == "ll":
+            args.append(take(8, "q" if conv in "di" else "Q"))
+        else:
+            args.append(take(4, "i" if conv in "di" else "I"))
+        if conv == "c":
+            args[-1] = chr(args[-1] & 0xFF)
+        return "%" + flags + (width or "") + ("." + precision if precision else "") + conv
+
+    text = CONVERSION.sub(convert, fmt)
+    return text, tuple(args)
+
+
+def format_record(sites, record, rtc):
+    """Rebuild the text line logger_printf_fn() would have sent."""
+    site, epoch, micros = struct.unpack_from("<HII", record, 0)
+    if site not in sites:
+        return "<unknown log site 0x%04x>\r\n" % site
+    kind, file, line, fmt = sites[site]
+
+    try:
+        text, args = decode_args(fmt, record[HEADER:])
+        message = text % args
+    except (struct.error, IndexError, TypeError, ValueError) as error:
+        message = "<%s: %s>" % (fmt, error)
+
+    out = ""
+    if rtc and epoch >= EPOCH_MIN:
+        now = datetime.datetime.fromtimestamp(epoch, datetime.timezone.utc)
+        out += "%04u-%02u-%02u-%02u:%02u:%02u.%06u: " % (
+            now.year, now.month, now.day, now.hour, now.minute, now.second, micros)
+    elif rtc:
+        # Wall clock not synchronized yet: time since start up with a zero date
+        out += "0000-00-00-%02u:%02u:%02u.%06u: " % (
+            epoch // 3600, epoch // 60 % 60, epoch % 60, micros)
+    name = re.split(r"[/\\]", file)[-1]
+    kind = kind[len("LOG_"):] if kind.startswith("LOG_") else kind
+    out += "%-8s: %-16s:%d " % (kind, name, line) + message
+    if not out.endswith("\n"):
+        out += "\r\n"
+    return out
+
+
+def crc8(data):
+    """CRC-8, polynomial 0x07, initial value 0, as logger_crc8() in logger.c."""
+    crc = 0
+    for byte in data:
+        crc ^= byte
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x07) & 0xFF if crc & 0x80 else (crc << 1) & 0xFF
+    return crc
+
+
+def records(stream):
+    """Yield record bodies, resynchronizing on the sync byte after garbage.
+
+    A record is accepted only when its CRC matches, so a 0xA5 inside another record or
+    line noise does not lock the decoder onto a fake record."""
+    buf = bytearray()
+    while True:
+        chunk = stream.read(256)
+        if not chunk:
+            return
+        buf += chunk
+        while True:
+            start = buf.find(SYNC)
+            if start < 0:
+                buf.clear()
+                break
+            del buf[:start]
+            if len(buf) < 2:
+                break
+            size = buf[1]
+            if size < HEADER + 1 or size > RECORD_MAX:
+                del buf[:1]
+                continue
+            if len(buf) < 2 + size:
+                break
+            if crc8(buf[1:1 + size]) != buf[1 + size]:
+                del buf[:1]
+                continue
+            yield bytes(buf[2:1 + size])
+            del buf[:2 + size]
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Decode binary LOG() records")
+    parser.add_argument("elf", help="firmware ELF file with the .logfmt section")
+    parser.add_argument("capture", nargs="?", default="-",
+                        help="capture file or serial device, - for stdin (default)")
+    parser.add_argument("--no-rtc", action="store_true",
+                        help="omit the timestamp, firmware built without HAVE_DS3231_RTC")
+    options = parser.parse_args()
+
+    sites = read_logfmt(options.elf)
+    stream = sys.stdin.buffer if options.capture == "-" else open(options.capture, "rb", buffering=0)
+    try:
+        for record in records(stream):
+            sys.stdout.write(format_record(sites, record, not options.no_rtc))
+            sys.stdout.flush()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()